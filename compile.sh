@@ -5,14 +5,14 @@ set -o errexit -o nounset -o pipefail -o xtrace
 : ${PREFIX:="."}
 
 declare -a SRC
-SRC=(htable rng utils pairs store acc rotate query)
+SRC=(htable rng utils pairs throttle store manifest stores acc tpool union rotate reclaim query shards)
 CC=${OTHERC:-gcc}
 
 LEAKCHECK_ENABLED=${LEAKCHECK_ENABLED:-}
 LEAKCHECK=${OTHERMEMCHECK:-valgrind}
 LEAKCHECK_ARGS="--leak-check=full --track-origins=yes --trace-children=yes --error-exitcode=1"
 
-CFLAGS="-g -O3 -march=native -pipe -std=gnu11 -D_GNU_SOURCE"
+CFLAGS="-g -O3 -march=native -pipe -std=gnu11 -D_GNU_SOURCE -pthread"
 CFLAGS="$CFLAGS -I${PREFIX}/src"
 
 CFLAGS="$CFLAGS -Werror -Wall -Wextra"
@@ -46,8 +46,11 @@ $CC -o rill_generate "${PREFIX}/test/rill_generate.c" librill.a $CFLAGS
 $CC -o test_indexer "${PREFIX}/test/indexer_test.c" librill.a $CFLAGS && ./test_indexer
 $CC -o test_coder "${PREFIX}/test/coder_test.c" librill.a $CFLAGS && ./test_coder
 $CC -o test_store "${PREFIX}/test/store_test.c" librill.a $CFLAGS && ./test_store
-$CC -o test_rotate "${PREFIX}/test/rotate_test.c" librill.a $CFLAGS
+$CC -o test_rotate "${PREFIX}/test/rotate_test.c" librill.a $CFLAGS && ./test_rotate
 $CC -o test_query "${PREFIX}/test/query_test.c" librill.a $CFLAGS && ./test_query
+$CC -o test_acc "${PREFIX}/test/acc_test.c" librill.a $CFLAGS && ./test_acc
+
+$CC -o bench_acc "${PREFIX}/test/acc_bench.c" librill.a $CFLAGS
 
 if [ -n "$LEAKCHECK_ENABLED" ]
 then
@@ -59,4 +62,6 @@ then
     $LEAKCHECK $LEAKCHECK_ARGS ./test_store
     echo test_query =========================================
     $LEAKCHECK $LEAKCHECK_ARGS ./test_query
+    echo test_acc ===========================================
+    $LEAKCHECK $LEAKCHECK_ARGS ./test_acc
 fi
@@ -11,6 +11,8 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
 
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -24,18 +26,35 @@
 // acc
 // -----------------------------------------------------------------------------
 
-static const uint32_t version = 1;
+/* version 2 adds per-slot sequence numbers for multi-producer ingestion
+   version 3 adds the spill ring and the high-water marks */
+static const uint32_t version = 3;
 static const uint32_t magic = 0x43434152;
 
+enum { cache_line_len = 64 };
+
+// The write counters get their own cache line as they're the only fields that
+// are written to by producers.
 struct rill_packed header
 {
     uint32_t magic;
     uint32_t version;
 
     uint64_t len;
+    uint64_t spill_len;
+
+    uint64_t ring_hwm;
+    uint64_t spill_hwm;
 
     atomic_size_t read;
+    atomic_size_t spill_read;
+    uint8_t __pad_read[cache_line_len - 7 * sizeof(uint64_t)];
+
     atomic_size_t write;
+    uint8_t __pad_write[cache_line_len - sizeof(uint64_t)];
+
+    atomic_size_t spill_write;
+    uint8_t __pad_spill[cache_line_len - sizeof(uint64_t)];
 };
 
 struct rill_packed kv
@@ -43,21 +62,85 @@ struct rill_packed kv
     uint64_t key, val;
 };
 
+struct dedup
+{
+    uint64_t key, val;
+    size_t gen;
+};
+
+struct ring
+{
+    size_t len;
+    struct kv *data;
+
+    // Holds the position + 1 of the last pair published in each slot of the
+    // ring which allows the reader to skip slots that were reserved but not
+    // yet written by a producer.
+    atomic_size_t *seqs;
+
+    atomic_size_t *read;
+    atomic_size_t *write;
+};
+
 struct rill_acc
 {
     int fd;
     const char *dir;
+    struct rill_acc_opts opts;
 
     void *vma;
     size_t vma_len;
 
     struct header *head;
-    struct kv *data;
+    struct ring ring;
+
+    // Absorbs the pairs that would otherwise overwrite unflushed pairs in the
+    // ring. Mapped lazily by the kernel and released after every flush so it
+    // only occupies memory while a burst is being drained.
+    void *spill_vma;
+    size_t spill_vma_len;
+    struct ring spill;
+
+    struct dedup *dedup;
+    size_t dedup_mask;
+    size_t dedup_suppressed;
+
+    pthread_t sorter;
+    pthread_mutex_t sorter_lock;
+    atomic_bool sorter_done;
+
+    // Position up to which the ring has been copied into sorted runs. Runs are
+    // held in the memory of the handle until they're flushed.
+    size_t sorted;
+    size_t runs_len, runs_cap;
+    struct rill_pairs **runs;
+    struct rill_pairs **inverted;
 };
 
 enum { min_cap = 32 };
 
+static const size_t slot_len = sizeof(struct kv) + sizeof(atomic_size_t);
+
+static size_t ring_vma_len(size_t len)
+{
+    return to_vma_len(sizeof(struct header) + len * slot_len);
+}
+
+static size_t spill_vma_len(size_t len)
+{
+    return len ? to_vma_len(len * slot_len) : 0;
+}
+
+static bool sorter_start(struct rill_acc *acc);
+static void sorter_stop(struct rill_acc *acc);
+
 struct rill_acc *rill_acc_open(const char *dir, size_t cap)
+{
+    return rill_acc_open_ex(dir, cap, &(struct rill_acc_opts) {0});
+}
+
+struct rill_acc *rill_acc_open_ex(
+        const char *dir, size_t cap, const struct rill_acc_opts *opts)
 {
     if (cap != rill_acc_read_only && cap < min_cap) cap = min_cap;
 
@@ -71,12 +154,25 @@ struct rill_acc *rill_acc_open(const char *dir, size_t cap)
         goto fail_alloc_struct;
     }
 
+    acc->opts = *opts;
     acc->dir = strndup(dir, PATH_MAX);
     if (!acc->dir) {
         rill_fail("unable to allocate memory for '%s'", dir);
         goto fail_alloc_dir;
     }
 
+    if (opts->dedup_len) {
+        size_t len = 1;
+        while (len < opts->dedup_len) len *= 2;
+
+        acc->dedup = calloc(len, sizeof(*acc->dedup));
+        if (!acc->dedup) {
+            rill_fail("unable to allocate dedup of len '%lu' for '%s'", len, dir);
+            goto fail_alloc_dedup;
+        }
+        acc->dedup_mask = len - 1;
+    }
+
     if (mkdir(dir, 0775) == -1 && errno != EEXIST) {
         rill_fail_errno("unable to open create dir '%s'", dir);
         goto fail_mkdir;
@@ -105,57 +201,103 @@ struct rill_acc *rill_acc_open(const char *dir, size_t cap)
         goto fail_open;
     }
 
+    size_t len = cap, spill_len = opts->spill_cap;
+
     if (create) {
-        acc->vma_len = to_vma_len(sizeof(*acc->head) + cap * sizeof(*acc->data));
-        if (ftruncate(acc->fd, acc->vma_len) == -1) {
-            rill_fail_errno("unable to ftruncate '%s' to len '%lu'", file, acc->vma_len);
+        if (ftruncate(acc->fd, ring_vma_len(len) + spill_vma_len(spill_len)) == -1) {
+            rill_fail_errno("unable to ftruncate '%s' to len '%lu'",
+                    file, ring_vma_len(len) + spill_vma_len(spill_len));
             goto fail_truncate;
         }
     }
     else {
-        size_t len = stat_ret.st_size;
-        if (len < sizeof(struct header)) {
+        struct header head;
+        if (pread(acc->fd, &head, sizeof(head), 0) != sizeof(head)) {
             rill_fail("invalid size for '%s'", file);
             goto fail_size;
         }
 
-        acc->vma_len = to_vma_len(len);
+        if (head.magic != magic) {
+            rill_fail("invalid magic '0x%x' for '%s'", head.magic, file);
+            goto fail_magic;
+        }
+
+        if (head.version != version) {
+            rill_fail("unknown version '%du' for '%s'", head.version, file);
+            goto fail_version;
+        }
+
+        len = head.len;
+        spill_len = head.spill_len;
+
+        size_t file_len = stat_ret.st_size;
+        if (ring_vma_len(len) + spill_vma_len(spill_len) > file_len) {
+            rill_fail("invalid len '%lu:%lu' for '%s'", len, spill_len, file);
+            goto fail_len;
+        }
     }
 
     int prot = PROT_READ | PROT_WRITE;
-    int flags = MAP_SHARED | MAP_POPULATE;
-    acc->vma = mmap(NULL, acc->vma_len, prot, flags, acc->fd, 0);
+    acc->vma_len = ring_vma_len(len);
+    acc->vma = mmap(NULL, acc->vma_len, prot, MAP_SHARED | MAP_POPULATE, acc->fd, 0);
     if (acc->vma == MAP_FAILED) {
         rill_fail_errno("unable to mmap '%s' of len '%lu'", file, acc->vma_len);
         goto fail_mmap;
     }
 
+    // Only a hint so a failure leaves rill_errno alone.
+    if (opts->huge_pages) (void) madvise(acc->vma, acc->vma_len, MADV_HUGEPAGE);
+
+    // The spill is sparse and isn't populated to avoid paying for the memory
+    // until it's actually needed.
+    if (spill_len) {
+        acc->spill_vma_len = spill_vma_len(spill_len);
+        acc->spill_vma = mmap(NULL, acc->spill_vma_len, prot, MAP_SHARED,
+                acc->fd, acc->vma_len);
+        if (acc->spill_vma == MAP_FAILED) {
+            rill_fail_errno("unable to mmap spill of '%s' of len '%lu'",
+                    file, acc->spill_vma_len);
+            goto fail_mmap_spill;
+        }
+    }
+
     acc->head = acc->vma;
-    acc->data = (void *) (acc->head + 1);
 
     if (create) {
         acc->head->magic = magic;
         acc->head->version = version;
-        acc->head->len = cap;
+        acc->head->len = len;
+        acc->head->spill_len = spill_len;
     }
-    else {
-        if (acc->head->magic != magic) {
-            rill_fail("invalid magic '0x%x' for '%s'", acc->head->magic, file);
-            goto fail_magic;
-        }
 
-        if (acc->head->version != version) {
-            rill_fail("unknown version '%du' for '%s'", acc->head->version, file);
-            goto fail_version;
-        }
-    }
+    acc->ring = (struct ring) {
+        .len = len,
+        .data = (void *) (acc->head + 1),
+        .read = &acc->head->read,
+        .write = &acc->head->write,
+    };
+    acc->ring.seqs = (void *) (acc->ring.data + len);
+
+    acc->spill = (struct ring) {
+        .len = spill_len,
+        .data = acc->spill_vma,
+        .read = &acc->head->spill_read,
+        .write = &acc->head->spill_write,
+    };
+    if (spill_len) acc->spill.seqs = (void *) (acc->spill.data + spill_len);
+
+    if (opts->sort_run_len && !sorter_start(acc)) goto fail_sorter;
 
     return acc;
 
-  fail_version:
-  fail_magic:
+  fail_sorter:
+    if (acc->spill_vma) munmap(acc->spill_vma, acc->spill_vma_len);
+  fail_mmap_spill:
     munmap(acc->vma, acc->vma_len);
   fail_mmap:
+  fail_len:
+  fail_version:
+  fail_magic:
   fail_size:
   fail_truncate:
     close(acc->fd);
@@ -163,6 +305,8 @@ struct rill_acc *rill_acc_open(const char *dir, size_t cap)
   fail_read_only:
   fail_stat:
   fail_mkdir:
+    free(acc->dedup);
+  fail_alloc_dedup:
     free((char *) acc->dir);
   fail_alloc_dir:
     free(acc);
@@ -172,59 +316,661 @@ struct rill_acc *rill_acc_open(const char *dir, size_t cap)
 
 void rill_acc_close(struct rill_acc *acc)
 {
+    if (acc->opts.sort_run_len) sorter_stop(acc);
+
+    if (acc->spill_vma) munmap(acc->spill_vma, acc->spill_vma_len);
     munmap(acc->vma, acc->vma_len);
     close(acc->fd);
+    free(acc->dedup);
     free((char *) acc->dir);
     free(acc);
 }
 
+void rill_acc_stats(const struct rill_acc *acc, struct rill_acc_stats *stats)
+{
+    *stats = (struct rill_acc_stats) {
+        .dedup_suppressed = acc->dedup_suppressed,
+        .ring_len = acc->ring.len,
+        .ring_hwm = acc->head->ring_hwm,
+        .spill_len = acc->spill.len,
+        .spill_hwm = acc->head->spill_hwm,
+    };
+}
+
+
+// -----------------------------------------------------------------------------
+// dedup
+// -----------------------------------------------------------------------------
+
+// Read positions of both rings which only move forward when a flush consumes
+// pairs. Stored in the header so that it's also visible to producers that live
+// in another process than the flusher.
+static size_t dedup_gen(struct rill_acc *acc)
+{
+    return atomic_load_explicit(acc->ring.read, memory_order_acquire) +
+        atomic_load_explicit(acc->spill.read, memory_order_acquire);
+}
+
+// Direct mapped and lossy: a pair only evicts the pair in its slot which is
+// good enough to catch the bursts of duplicates that are common in practice.
+// Duplicates that slip through are removed when the pairs are compacted.
+//
+// Every slot is tagged with the flush generation it was filled in and slots of
+// an older generation are treated as empty. A pair that was already flushed
+// must reach the next store as well or it would expire with the older store.
+static bool acc_dedup(struct rill_acc *acc, rill_key_t key, rill_val_t val)
+{
+    uint64_t hash = (key * 0x9E3779B97F4A7C15UL) ^ (val * 0xC2B2AE3D27D4EB4FUL);
+    struct dedup *slot = &acc->dedup[(hash ^ (hash >> 32)) & acc->dedup_mask];
+    size_t gen = dedup_gen(acc);
+
+    if (slot->key == key && slot->val == val && slot->gen == gen) {
+        acc->dedup_suppressed++;
+        return true;
+    }
+
+    *slot = (struct dedup) { .key = key, .val = val, .gen = gen };
+    return false;
+}
+
+
+// -----------------------------------------------------------------------------
+// ingest
+// -----------------------------------------------------------------------------
+
+// Pairs that would overwrite pairs not yet flushed from the ring are diverted
+// to the spill ring instead. The check is racy with multiple producers but the
+// overshoot is bounded by the number of producers and any pair that does get
+// overwritten is detected by the reader.
+static struct ring *acc_ring(struct rill_acc *acc, size_t n)
+{
+    if (!acc->spill.len) return &acc->ring;
+
+    size_t read = atomic_load_explicit(acc->ring.read, memory_order_acquire);
+    size_t write = atomic_load_explicit(acc->ring.write, memory_order_relaxed);
+    return write + n - read <= acc->ring.len ? &acc->ring : &acc->spill;
+}
+
+static size_t acc_reserve(struct rill_acc *acc, struct ring *ring, size_t n)
+{
+    if (acc->opts.multi_producer)
+        return atomic_fetch_add_explicit(ring->write, n, memory_order_relaxed);
+    return atomic_load_explicit(ring->write, memory_order_relaxed);
+}
+
+// Slots are written under a seqlock: their sequence number is cleared before
+// the pair is written and only set to its final value once the pair is
+// complete. A reader that races with a producer lapping it therefore either
+// sees the cleared sequence or a sequence that changed while it was copying
+// the pair, never a half-written pair with its old sequence.
+static void acc_claim(struct ring *ring, size_t write, size_t n)
+{
+    size_t index = write % ring->len;
+    for (size_t i = 0; i < n; ++i) {
+        atomic_store_explicit(&ring->seqs[index], 0, memory_order_relaxed);
+        if (++index == ring->len) index = 0;
+    }
+    atomic_thread_fence(memory_order_release);
+}
+
+static void acc_publish(
+        struct rill_acc *acc, struct ring *ring, size_t write, size_t n)
+{
+    size_t index = write % ring->len;
+    for (size_t i = 0; i < n; ++i) {
+        atomic_store_explicit(&ring->seqs[index], write + i + 1, memory_order_release);
+        if (++index == ring->len) index = 0;
+    }
+
+    if (!acc->opts.multi_producer)
+        atomic_store_explicit(ring->write, write + n, memory_order_release);
+}
+
 void rill_acc_ingest(struct rill_acc *acc, rill_key_t key, rill_val_t val)
 {
     assert(key && val);
+    if (acc->dedup && acc_dedup(acc, key, val)) return;
 
-    size_t write = atomic_load_explicit(&acc->head->write, memory_order_relaxed);
-    size_t index = write % acc->head->len;
-    struct kv *kv = &acc->data[index];
+    struct ring *ring = acc_ring(acc, 1);
+    size_t write = acc_reserve(acc, ring, 1);
+    struct kv *kv = &ring->data[write % ring->len];
+    acc_claim(ring, write, 1);
 
     kv->key = key;
     kv->val = val;
 
-    atomic_store_explicit(&acc->head->write, write + 1, memory_order_release);
+    acc_publish(acc, ring, write, 1);
 }
 
-bool rill_acc_write(struct rill_acc *acc, const char *file, rill_ts_t now)
+static void acc_ingest_batch(
+        struct rill_acc *acc, const struct rill_kv *kvs, size_t n)
+{
+    // Anything bigger then the ring would overwrite itself.
+    size_t len = acc->ring.len;
+    if (acc->spill.len && acc->spill.len < len) len = acc->spill.len;
+    for (; n > len; kvs += len, n -= len) acc_ingest_batch(acc, kvs, len);
+    if (!n) return;
+
+    struct ring *ring = acc_ring(acc, n);
+    size_t write = acc_reserve(acc, ring, n);
+    size_t index = write % ring->len;
+    acc_claim(ring, write, n);
+
+    // The wire format of the ring is the same as rill_kv so the batch can be
+    // copied as is with at most one split when wrapping around the ring.
+    size_t head = ring->len - index < n ? ring->len - index : n;
+    memcpy(ring->data + index, kvs, head * sizeof(*kvs));
+    memcpy(ring->data, kvs + head, (n - head) * sizeof(*kvs));
+
+    acc_publish(acc, ring, write, n);
+}
+
+void rill_acc_ingest_batch(
+        struct rill_acc *acc, const struct rill_kv *kvs, size_t n)
 {
-    size_t start = atomic_load_explicit(&acc->head->read, memory_order_acquire);
-    size_t end = atomic_load_explicit(&acc->head->write, memory_order_acquire);
-    if (start == end) return true;
-    assert(start < end);
+    for (size_t i = 0; i < n; ++i) assert(kvs[i].key && kvs[i].val);
 
-    if (end - start > acc->head->len) {
-        printf("acc lost '%lu' events: read=%lu, write=%lu, cap=%lu\n",
-                (end - start) - acc->head->len, start, end, acc->head->len);
-        start = end - acc->head->len;
+    if (!acc->dedup) {
+        acc_ingest_batch(acc, kvs, n);
+        return;
     }
 
-    struct rill_pairs *pairs = rill_pairs_new(end - start);
-    if (!pairs) {
-        rill_fail("unable to allocate pairs for len '%lu'", acc->head->len);
-        goto fail_pairs_alloc;
+    enum { chunk_len = 256 };
+    struct rill_kv chunk[chunk_len];
+
+    size_t len = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (acc_dedup(acc, kvs[i].key, kvs[i].val)) continue;
+
+        chunk[len++] = kvs[i];
+        if (len < chunk_len) continue;
+
+        acc_ingest_batch(acc, chunk, len);
+        len = 0;
     }
+    acc_ingest_batch(acc, chunk, len);
+}
 
-    for (size_t i = start; i < end; ++i) {
-        size_t index = i % acc->head->len;
-        struct kv *kv = &acc->data[index];
+// -----------------------------------------------------------------------------
+// read
+// -----------------------------------------------------------------------------
 
-        struct rill_pairs *ret = rill_pairs_push(pairs, kv->key, kv->val);
+// Copies the published pairs in [start, end) and returns the position where
+// the copy stopped which is either end or the first slot that was reserved but
+// not yet published. A slot that is never published (e.g. crashed producer)
+// will eventually be overwritten and skipped once the ring wraps around.
+static size_t acc_read(
+        const struct ring *ring, size_t start, size_t end, struct rill_pairs *pairs)
+{
+    size_t lost = 0;
+
+    size_t i = start;
+    for (; i < end; ++i) {
+        size_t index = i % ring->len;
+
+        size_t seq = atomic_load_explicit(&ring->seqs[index], memory_order_acquire);
+        if (seq < i + 1) break;
+
+        struct kv kv = ring->data[index];
+
+        // Catches slots that were claimed by a producer that lapped us while
+        // we were reading it. See acc_claim.
+        atomic_thread_fence(memory_order_acquire);
+        if (seq != i + 1 ||
+                atomic_load_explicit(&ring->seqs[index], memory_order_relaxed) != seq)
+        {
+            lost++;
+            continue;
+        }
+
+        struct rill_pairs *ret = rill_pairs_push(pairs, kv.key, kv.val);
         assert(ret == pairs);
     }
 
-    if (!rill_store_write(file, now, 0, pairs)) {
-        rill_fail("unable to write acc file '%s'", file);
+    if (lost) printf("acc lost '%lu' overwritten events\n", lost);
+    return i;
+}
+
+static size_t acc_skip_lost(const struct ring *ring, size_t start, size_t end)
+{
+    if (end - start <= ring->len) return start;
+
+    printf("acc lost '%lu' events: read=%lu, write=%lu, cap=%lu\n",
+            (end - start) - ring->len, start, end, ring->len);
+    return end - ring->len;
+}
+
+void rill_acc_cursor_init(struct rill_acc *acc, struct rill_acc_cursor *cursor)
+{
+    *cursor = (struct rill_acc_cursor) {
+        .ring = atomic_load_explicit(acc->ring.read, memory_order_acquire),
+        .spill = atomic_load_explicit(acc->spill.read, memory_order_acquire),
+    };
+}
+
+// Read-only counterpart of the flush which doesn't consume the pairs and can
+// therefore be used concurrently with the flushing handle.
+struct rill_pairs *rill_acc_read(
+        struct rill_acc *acc,
+        struct rill_acc_cursor *cursor,
+        struct rill_pairs *out)
+{
+    size_t end = atomic_load_explicit(acc->ring.write, memory_order_acquire);
+    size_t start = acc_skip_lost(&acc->ring, cursor->ring, end);
+
+    size_t spill_end = atomic_load_explicit(acc->spill.write, memory_order_acquire);
+    size_t spill_start = acc_skip_lost(&acc->spill, cursor->spill, spill_end);
+
+    out = rill_pairs_reserve(out, out->len + (end - start) + (spill_end - spill_start));
+    if (!out) return NULL;
+
+    cursor->ring = acc_read(&acc->ring, start, end, out);
+    cursor->spill = acc_read(&acc->spill, spill_start, spill_end, out);
+    return out;
+}
+
+// Records the amount of pending pairs in both rings at the start of a flush.
+// Only the flushing handle writes these so no atomics are required.
+static void acc_watermark(struct rill_acc *acc)
+{
+    size_t ring = atomic_load_explicit(acc->ring.write, memory_order_relaxed) -
+        atomic_load_explicit(acc->ring.read, memory_order_relaxed);
+    if (ring > acc->head->ring_hwm) acc->head->ring_hwm = ring;
+
+    size_t spill = atomic_load_explicit(acc->spill.write, memory_order_relaxed) -
+        atomic_load_explicit(acc->spill.read, memory_order_relaxed);
+    if (spill > acc->head->spill_hwm) acc->head->spill_hwm = spill;
+}
+
+// Hands the pages of the spill that were drained by a flush back to the
+// kernel. Partial pages at either end of the range are kept. A failure only
+// keeps the memory around until the pages are reused and doesn't fail the
+// flush so rill_errno is left alone.
+static void spill_release_range(void *ptr, size_t len)
+{
+    uintptr_t start = to_vma_len((uintptr_t) ptr);
+    uintptr_t end = ((uintptr_t) ptr + len) & ~(page_len - 1);
+    if (start >= end) return;
+
+    (void) madvise((void *) start, end - start, MADV_REMOVE);
+}
+
+static void spill_release(struct rill_acc *acc, size_t start, size_t end)
+{
+    const struct ring *spill = &acc->spill;
+    if (start == end) return;
+    if (end - start > spill->len) start = end - spill->len;
+
+    size_t index = start % spill->len;
+    size_t n = end - start;
+    size_t head = spill->len - index < n ? spill->len - index : n;
+
+    spill_release_range(spill->data + index, head * sizeof(*spill->data));
+    spill_release_range(spill->seqs + index, head * sizeof(*spill->seqs));
+    spill_release_range(spill->data, (n - head) * sizeof(*spill->data));
+    spill_release_range(spill->seqs, (n - head) * sizeof(*spill->seqs));
+}
+
+
+// -----------------------------------------------------------------------------
+// runs
+// -----------------------------------------------------------------------------
+
+static bool runs_reserve(struct rill_acc *acc)
+{
+    if (acc->runs_len < acc->runs_cap) return true;
+    size_t cap = acc->runs_cap ? acc->runs_cap * 2 : 16;
+
+    struct rill_pairs **runs = realloc(acc->runs, cap * sizeof(*runs));
+    if (!runs) return false;
+    acc->runs = runs;
+
+    struct rill_pairs **inverted = realloc(acc->inverted, cap * sizeof(*inverted));
+    if (!inverted) return false;
+    acc->inverted = inverted;
+
+    acc->runs_cap = cap;
+    return true;
+}
+
+// Sorts the published pairs of the ring in [start, end) into a new run, sets
+// pos to where the copy stopped and returns whether any progress was made.
+// Must be called with the sorter lock held.
+static bool acc_sort_run(
+        struct rill_acc *acc, const struct ring *ring,
+        size_t start, size_t end, size_t *pos)
+{
+    if (!runs_reserve(acc)) return false;
+
+    struct rill_pairs *run = rill_pairs_new(end - start);
+    if (!run) return false;
+
+    size_t stop = acc_read(ring, start, end, run);
+    if (!run->len) {
+        rill_pairs_free(run);
+        *pos = stop;
+        return stop != start;
+    }
+
+    rill_pairs_compact(run);
+
+    struct rill_pairs *inverted = rill_pairs_inverted(run);
+    if (!inverted) {
+        rill_pairs_free(run);
+        return false;
+    }
+
+    acc->runs[acc->runs_len] = run;
+    acc->inverted[acc->runs_len] = inverted;
+    acc->runs_len++;
+
+    *pos = stop;
+    return true;
+}
+
+static void acc_runs_clear(struct rill_acc *acc)
+{
+    for (size_t i = 0; i < acc->runs_len; ++i) {
+        rill_pairs_free(acc->runs[i]);
+        rill_pairs_free(acc->inverted[i]);
+    }
+    acc->runs_len = 0;
+}
+
+static void *sorter_run(void *data)
+{
+    struct rill_acc *acc = data;
+    const size_t run_len = acc->opts.sort_run_len;
+    const struct timespec idle = { .tv_nsec = 1 * 1000 * 1000 };
+
+    while (!atomic_load_explicit(&acc->sorter_done, memory_order_relaxed)) {
+        pthread_mutex_lock(&acc->sorter_lock);
+
+        size_t end = atomic_load_explicit(acc->ring.write, memory_order_acquire);
+        size_t start = acc_skip_lost(&acc->ring, acc->sorted, end);
+
+        bool progress = false;
+        if (end - start >= run_len)
+            progress = acc_sort_run(acc, &acc->ring, start, start + run_len, &acc->sorted);
+
+        pthread_mutex_unlock(&acc->sorter_lock);
+
+        if (!progress) nanosleep(&idle, NULL);
+    }
+
+    return NULL;
+}
+
+// Every run costs two allocations and a slot in the merge heap of every flush
+// so tiny runs only add overhead.
+enum { sort_run_min = 1024 };
+
+static bool sorter_start(struct rill_acc *acc)
+{
+    if (acc->opts.sort_run_len < sort_run_min)
+        acc->opts.sort_run_len = sort_run_min;
+
+    // Runs must be comfortably smaller then the ring to be sorted before they
+    // get overwritten.
+    if (acc->opts.sort_run_len > acc->ring.len / 2)
+        acc->opts.sort_run_len = acc->ring.len / 2;
+
+    acc->sorted = atomic_load_explicit(&acc->head->read, memory_order_acquire);
+    atomic_init(&acc->sorter_done, false);
+
+    int err = pthread_mutex_init(&acc->sorter_lock, NULL);
+    if (err) {
+        errno = err;
+        rill_fail_errno("unable to create sorter lock for '%s'", acc->dir);
+        return false;
+    }
+
+    err = pthread_create(&acc->sorter, NULL, sorter_run, acc);
+    if (err) {
+        errno = err;
+        rill_fail_errno("unable to create sorter thread for '%s'", acc->dir);
+        pthread_mutex_destroy(&acc->sorter_lock);
+        return false;
+    }
+
+    return true;
+}
+
+static void sorter_stop(struct rill_acc *acc)
+{
+    atomic_store_explicit(&acc->sorter_done, true, memory_order_relaxed);
+    pthread_join(acc->sorter, NULL);
+    pthread_mutex_destroy(&acc->sorter_lock);
+
+    acc_runs_clear(acc);
+    free(acc->runs);
+    free(acc->inverted);
+}
+
+// -----------------------------------------------------------------------------
+// dest
+// -----------------------------------------------------------------------------
+
+// Destination of a flush which is either a single store file or one store per
+// shard of a sharded database.
+struct acc_dest
+{
+    const char *file;
+
+    const char *dir;
+    const char *name;
+    size_t shards;
+};
+
+static bool dest_file(const struct acc_dest *dest, size_t shard, char *out, size_t len)
+{
+    char dir[PATH_MAX];
+    if (!rill_shard_dir(dest->dir, shard, dir, sizeof(dir))) return false;
+
+    if (mkdir(dest->dir, 0775) == -1 && errno != EEXIST) {
+        rill_fail_errno("unable to mkdir '%s'", dest->dir);
+        return false;
+    }
+
+    if (mkdir(dir, 0775) == -1 && errno != EEXIST) {
+        rill_fail_errno("unable to mkdir '%s'", dir);
+        return false;
+    }
+
+    if (snprintf(out, len, "%s/%s", dir, dest->name) < (int) len) return true;
+
+    rill_fail("shard file too long for '%s'", dest->name);
+    return false;
+}
+
+static struct rill_pairs *shard_filter(
+        const struct rill_pairs *pairs, bool inverted, size_t shard, size_t shards)
+{
+    struct rill_pairs *out = rill_pairs_new(pairs->len / shards + 1);
+    if (!out) return NULL;
+
+    for (size_t i = 0; i < pairs->len; ++i) {
+        const struct rill_kv *kv = &pairs->data[i];
+        if (rill_shard(inverted ? kv->val : kv->key, shards) != shard) continue;
+
+        out = rill_pairs_push(out, kv->key, kv->val);
+        if (!out) return NULL;
+    }
+
+    return out;
+}
+
+// A failure can leave some of the shards written. The pairs are then written
+// again by the next flush which is harmless as duplicates are removed by the
+// rotations.
+static bool dest_write(
+        const struct acc_dest *dest, rill_ts_t now,
+        struct rill_pairs *pairs, unsigned flags)
+{
+    if (!dest->shards) return rill_store_write_ex(dest->file, now, 0, pairs, flags);
+
+    for (size_t shard = 0; shard < dest->shards; ++shard) {
+        struct rill_pairs *part = shard_filter(pairs, false, shard, dest->shards);
+        if (!part) return false;
+
+        char file[PATH_MAX];
+        bool ret = !part->len ||
+            (dest_file(dest, shard, file, sizeof(file)) &&
+             rill_store_write_ex(file, now, 0, part, flags));
+
+        rill_pairs_free(part);
+        if (!ret) return false;
+    }
+
+    return true;
+}
+
+// Filtering a sorted and compacted run preserves both properties so every shard
+// is written from the subset of every run that belongs to it.
+static bool dest_write_runs(
+        const struct acc_dest *dest, rill_ts_t now,
+        struct rill_pairs *const *runs, struct rill_pairs *const *inverted,
+        size_t len, unsigned flags)
+{
+    if (!dest->shards)
+        return rill_store_write_runs(dest->file, now, 0, runs, inverted, len, flags);
+
+    struct rill_pairs **parts = calloc(len + 1, sizeof(*parts));
+    struct rill_pairs **inverted_parts = calloc(len + 1, sizeof(*inverted_parts));
+    if (!parts || !inverted_parts) {
+        rill_fail("unable to allocate '%lu' shard runs", len);
+        free(parts);
+        free(inverted_parts);
+        return false;
+    }
+
+    bool ret = true;
+    for (size_t shard = 0; shard < dest->shards && ret; ++shard) {
+        size_t parts_len = 0;
+
+        for (size_t i = 0; i < len && ret; ++i) {
+            struct rill_pairs *part = shard_filter(runs[i], false, shard, dest->shards);
+            struct rill_pairs *inverted_part =
+                shard_filter(inverted[i], true, shard, dest->shards);
+
+            ret = part && inverted_part;
+            if (ret && part->len) {
+                parts[parts_len] = part;
+                inverted_parts[parts_len] = inverted_part;
+                parts_len++;
+            }
+            else {
+                rill_pairs_free(part);
+                rill_pairs_free(inverted_part);
+            }
+        }
+
+        char file[PATH_MAX];
+        ret = ret && (!parts_len ||
+                (dest_file(dest, shard, file, sizeof(file)) &&
+                 rill_store_write_runs(
+                         file, now, 0, parts, inverted_parts, parts_len, flags)));
+
+        for (size_t i = 0; i < parts_len; ++i) {
+            rill_pairs_free(parts[i]);
+            rill_pairs_free(inverted_parts[i]);
+        }
+    }
+
+    free(parts);
+    free(inverted_parts);
+    return ret;
+}
+
+static const char *dest_name(const struct acc_dest *dest)
+{
+    return dest->shards ? dest->dir : dest->file;
+}
+
+
+// -----------------------------------------------------------------------------
+// flush
+// -----------------------------------------------------------------------------
+
+// The unsorted tail of the ring and the spill are sorted into final runs and
+// all the runs are then merged straight into the store file.
+static bool acc_write_runs(
+        struct rill_acc *acc, const struct acc_dest *dest, rill_ts_t now, unsigned flags)
+{
+    pthread_mutex_lock(&acc->sorter_lock);
+    acc_watermark(acc);
+
+    size_t end = atomic_load_explicit(acc->ring.write, memory_order_acquire);
+    size_t start = acc_skip_lost(&acc->ring, acc->sorted, end);
+    if (start != end) (void) acc_sort_run(acc, &acc->ring, start, end, &acc->sorted);
+
+    size_t spill_end = atomic_load_explicit(acc->spill.write, memory_order_acquire);
+    size_t spill_start = atomic_load_explicit(acc->spill.read, memory_order_acquire);
+    spill_start = acc_skip_lost(&acc->spill, spill_start, spill_end);
+
+    size_t spilled = spill_start;
+    if (spill_start != spill_end)
+        (void) acc_sort_run(acc, &acc->spill, spill_start, spill_end, &spilled);
+
+    bool ret = dest_write_runs(
+            dest, now, acc->runs, acc->inverted, acc->runs_len, flags);
+
+    if (ret) {
+        atomic_store_explicit(acc->ring.read, acc->sorted, memory_order_release);
+        atomic_store_explicit(acc->spill.read, spilled, memory_order_release);
+        spill_release(acc, spill_start, spilled);
+        acc_runs_clear(acc);
+    }
+    else rill_fail("unable to write acc file '%s'", dest_name(dest));
+
+    pthread_mutex_unlock(&acc->sorter_lock);
+    return ret;
+}
+
+
+// -----------------------------------------------------------------------------
+// write
+// -----------------------------------------------------------------------------
+
+bool rill_acc_write(struct rill_acc *acc, const char *file, rill_ts_t now)
+{
+    return rill_acc_write_ex(acc, file, now, 0);
+}
+
+static bool acc_write(
+        struct rill_acc *acc, const struct acc_dest *dest, rill_ts_t now, unsigned flags)
+{
+    if (acc->opts.sort_run_len) return acc_write_runs(acc, dest, now, flags);
+    acc_watermark(acc);
+
+    size_t start = atomic_load_explicit(acc->ring.read, memory_order_acquire);
+    size_t end = atomic_load_explicit(acc->ring.write, memory_order_acquire);
+    size_t spill_start = atomic_load_explicit(acc->spill.read, memory_order_acquire);
+    size_t spill_end = atomic_load_explicit(acc->spill.write, memory_order_acquire);
+    if (start == end && spill_start == spill_end) return true;
+    assert(start <= end && spill_start <= spill_end);
+
+    start = acc_skip_lost(&acc->ring, start, end);
+    spill_start = acc_skip_lost(&acc->spill, spill_start, spill_end);
+
+    size_t len = (end - start) + (spill_end - spill_start);
+    struct rill_pairs *pairs = rill_pairs_new(len);
+    if (!pairs) {
+        rill_fail("unable to allocate pairs for len '%lu'", len);
+        goto fail_pairs_alloc;
+    }
+
+    end = acc_read(&acc->ring, start, end, pairs);
+    spill_end = acc_read(&acc->spill, spill_start, spill_end, pairs);
+
+    if (!dest_write(dest, now, pairs, flags)) {
+        rill_fail("unable to write acc file '%s'", dest_name(dest));
         goto fail_write;
     }
 
-    atomic_store_explicit(&acc->head->read, end, memory_order_release);
+    atomic_store_explicit(acc->ring.read, end, memory_order_release);
+    atomic_store_explicit(acc->spill.read, spill_end, memory_order_release);
+    spill_release(acc, spill_start, spill_end);
 
     rill_pairs_free(pairs);
     return true;
@@ -234,3 +980,20 @@ bool rill_acc_write(struct rill_acc *acc, const char *file, rill_ts_t now)
   fail_pairs_alloc:
     return false;
 }
+
+bool rill_acc_write_ex(
+        struct rill_acc *acc, const char *file, rill_ts_t now, unsigned flags)
+{
+    return acc_write(acc, &(struct acc_dest) { .file = file }, now, flags);
+}
+
+bool rill_acc_write_shards(
+        struct rill_acc *acc,
+        const char *dir, size_t shards,
+        const char *name, rill_ts_t now, unsigned flags)
+{
+    assert(shards);
+
+    struct acc_dest dest = { .dir = dir, .name = name, .shards = shards };
+    return acc_write(acc, &dest, now, flags);
+}
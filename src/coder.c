@@ -93,12 +93,10 @@ static inline bool coder_write_sep(struct encoder *coder)
     return true;
 }
 
-static inline bool coder_write_val(struct encoder *coder, rill_val_t val)
+static inline bool coder_write_id(struct encoder *coder, rill_val_t id)
 {
-    val = vals_vtoi(&coder->rev, val);
-
     uint8_t buffer[coder_max_val_len];
-    size_t len = leb128_encode(buffer, val) - buffer;
+    size_t len = leb128_encode(buffer, id) - buffer;
 
     if (rill_unlikely(coder->it + len > coder->end)) {
         rill_fail("not enough space to write val: %p + %lu > %p\n",
@@ -112,24 +110,31 @@ static inline bool coder_write_val(struct encoder *coder, rill_val_t val)
     return true;
 }
 
-static bool coder_encode(struct encoder *coder, const struct rill_kv *kv)
+// Encodes a value that was already translated to its id in the dictionary of
+// the encoder.
+static bool coder_encode_id(struct encoder *coder, rill_key_t key, rill_val_t id)
 {
-    if (coder->key != kv->key) {
+    if (coder->key != key) {
         if (rill_likely(coder->key)) {
             if (!coder_write_sep(coder)) return false;
         }
 
-        index_put(coder->index, kv->key, coder_off(coder));
-        coder->key = kv->key;
+        index_put(coder->index, key, coder_off(coder));
+        coder->key = key;
         coder->keys++;
     }
 
-    if (!coder_write_val(coder, kv->val)) return false;
+    if (!coder_write_id(coder, id)) return false;
 
     coder->pairs++;
     return true;
 }
 
+static bool coder_encode(struct encoder *coder, const struct rill_kv *kv)
+{
+    return coder_encode_id(coder, kv->key, vals_vtoi(&coder->rev, kv->val));
+}
+
 static bool coder_finish(struct encoder *coder)
 {
     if (!coder_write_sep(coder)) return false;
@@ -153,7 +158,8 @@ static struct encoder make_encoder(
         .index = index,
     };
 
-    vals_rev_make(vals, &coder.rev);
+    // Encoders without vals can only be fed ids via coder_encode_id.
+    if (vals) vals_rev_make(vals, &coder.rev);
     return coder;
 }
 
@@ -175,15 +181,22 @@ struct decoder
     struct vals *vals;
 };
 
-static inline bool coder_read_val(struct decoder *coder, rill_val_t *val)
+static inline bool coder_read_id(struct decoder *coder, rill_val_t *id)
 {
-    if (!leb128_decode(&coder->it, coder->end, val)) {
+    if (!leb128_decode(&coder->it, coder->end, id)) {
         rill_fail("unable to decode value at '%p-%p'\n",
                 (void *) coder->it, (void *) coder->end);
         return false;
     }
+    return true;
+}
+
+static inline bool coder_read_val(struct decoder *coder, rill_val_t *val)
+{
+    if (!coder_read_id(coder, val)) return false;
 
-    if (*val) *val = coder->lookup->data[*val - 1].key;
+    // A decoder without a lookup yields the raw dictionary ids.
+    if (*val && coder->lookup) *val = coder->lookup->data[*val - 1].key;
     return true;
 }
 
@@ -204,6 +217,45 @@ static bool coder_decode(struct decoder *coder, struct rill_kv *kv)
     return coder_read_val(coder, &kv->val);
 }
 
+// Same as coder_decode but decodes up to cap pairs at a time. The ids are all
+// decoded first and only then translated through the dictionary which keeps
+// the decoding loop tight and allows the dictionary entries to be prefetched
+// ahead of their lookup. Returns the number of pairs decoded which is only
+// less than cap once the end of the column is reached or -1 on errors.
+static ssize_t coder_decode_batch(
+        struct decoder *coder, rill_key_t *keys, rill_val_t *vals, size_t cap)
+{
+    enum { prefetch = 8 };
+
+    size_t len = 0;
+    while (len < cap) {
+        rill_val_t id = 0;
+        if (rill_likely(coder->key) && !coder_read_id(coder, &id)) return -1;
+
+        if (!id) {
+            coder->key = index_get(coder->index, coder->keys);
+            coder->keys++;
+            if (!coder->key) break; // eof
+
+            if (!coder_read_id(coder, &id)) return -1;
+        }
+
+        keys[len] = coder->key;
+        vals[len] = id;
+        len++;
+    }
+
+    if (!coder->lookup) return len;
+
+    const struct index_kv *dict = coder->lookup->data;
+    for (size_t i = 0; i < len; ++i) {
+        if (i + prefetch < len) __builtin_prefetch(&dict[vals[i + prefetch] - 1]);
+        vals[i] = dict[vals[i] - 1].key;
+    }
+
+    return len;
+}
+
 static struct decoder make_decoder_at(
         uint8_t *it, uint8_t *end,
         struct index *lookup,
@@ -53,6 +53,69 @@ static bool index_find(
     return true;
 }
 
+// Galloping search for the lower bound of key starting from pos which must be
+// the lower bound of a smaller key. A sorted batch of lookups then costs a
+// number of probes proportional to the log of the distance between consecutive
+// keys instead of the log of the size of the index and only ever walks forward.
+static bool index_gallop(
+        struct index *index, rill_key_t key, size_t *pos, size_t *key_idx, uint64_t *off)
+{
+    size_t lo = *pos, hi = *pos;
+    const size_t len = index->len;
+
+    for (size_t step = 1; hi < len && index->data[hi].key < key; step *= 2) {
+        lo = hi + 1;
+        hi += step;
+    }
+    if (hi > len) hi = len;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (index->data[mid].key < key) lo = mid + 1;
+        else hi = mid;
+    }
+
+    *pos = lo;
+    if (lo == len || index->data[lo].key != key) return false;
+
+    *key_idx = lo;
+    *off = index->data[lo].off;
+    return true;
+}
+
+// Number of lookups advanced in lock-step by index_find_group.
+enum { index_group = 16 };
+
+// Lower bounds of a sorted group of keys within [start, len) of the index. Every
+// step of the binary search is taken by all the lookups of the group before
+// moving on to the next one and the probe of the next step is prefetched right
+// away. The cache misses of the group then overlap instead of forming a single
+// chain of dependent misses per key.
+static void index_find_group(
+        struct index *index, size_t start,
+        const rill_key_t *keys, size_t len, size_t *pos)
+{
+    assert(len <= index_group);
+    const struct index_kv *data = index->data;
+
+    size_t base[index_group];
+    for (size_t i = 0; i < len; ++i) base[i] = start;
+
+    size_t n = index->len - start;
+    while (n > 1) {
+        size_t half = n / 2;
+        n -= half;
+
+        for (size_t i = 0; i < len; ++i) {
+            base[i] = data[base[i] + half].key < keys[i] ? base[i] + half : base[i];
+            __builtin_prefetch(&data[base[i] + n / 2]);
+        }
+    }
+
+    for (size_t i = 0; i < len; ++i)
+        pos[i] = n ? base[i] + (data[base[i]].key < keys[i]) : start;
+}
+
 static rill_key_t index_get(struct index *index, size_t i)
 {
     return i < index->len ? index->data[i].key : 0;
@@ -0,0 +1,379 @@
+/* manifest.c
+   agent (agent@local), 19 Oct 2026
+   FreeBSD-style copyright and disclaimer apply
+*/
+
+#include "rill.h"
+#include "utils.h"
+
+#include <stdlib.h>
+#include <assert.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+// -----------------------------------------------------------------------------
+// manifest
+// -----------------------------------------------------------------------------
+
+static const uint32_t version = 1;
+static const uint32_t magic = 0x4E414D52;
+
+struct rill_packed header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t len;
+};
+
+struct rill_manifest *rill_manifest_new(size_t cap)
+{
+    if (!cap) cap = 1;
+
+    struct rill_manifest *manifest =
+        calloc(1, sizeof(*manifest) + cap * sizeof(manifest->data[0]));
+    if (!manifest) {
+        rill_fail("unable to alloc manifest: cap=%lu", cap);
+        return NULL;
+    }
+
+    manifest->cap = cap;
+    return manifest;
+}
+
+void rill_manifest_free(struct rill_manifest *manifest)
+{
+    free(manifest);
+}
+
+struct rill_manifest *rill_manifest_push(
+        struct rill_manifest *manifest, const struct rill_manifest_entry *entry)
+{
+    if (manifest->len == manifest->cap) {
+        size_t cap = manifest->cap * 2;
+        manifest = realloc(manifest, sizeof(*manifest) + cap * sizeof(manifest->data[0]));
+        if (!manifest) {
+            rill_fail("unable to realloc manifest: cap=%lu", cap);
+            return NULL;
+        }
+        manifest->cap = cap;
+    }
+
+    manifest->data[manifest->len++] = *entry;
+    return manifest;
+}
+
+static int entry_cmp(const void *lhs, const void *rhs)
+{
+    const struct rill_manifest_entry *l = lhs, *r = rhs;
+    return strncmp(l->file, r->file, rill_manifest_name_cap);
+}
+
+void rill_manifest_sort(struct rill_manifest *manifest)
+{
+    qsort(manifest->data, manifest->len, sizeof(manifest->data[0]), entry_cmp);
+}
+
+const struct rill_manifest_entry *rill_manifest_find(
+        const struct rill_manifest *manifest, const char *file)
+{
+    struct rill_manifest_entry key;
+    snprintf(key.file, sizeof(key.file), "%s", file);
+
+    return bsearch(&key, manifest->data, manifest->len,
+            sizeof(manifest->data[0]), entry_cmp);
+}
+
+
+// -----------------------------------------------------------------------------
+// io
+// -----------------------------------------------------------------------------
+
+bool rill_manifest_read(const char *dir, struct rill_manifest **out)
+{
+    *out = NULL;
+
+    char file[PATH_MAX];
+    snprintf(file, sizeof(file), "%s/manifest", dir);
+
+    int fd = open(file, O_RDONLY);
+    if (fd == -1) {
+        if (errno == ENOENT) return true;
+        rill_fail_errno("unable to open '%s'", file);
+        goto fail_open;
+    }
+
+    struct header head = {0};
+    if (read(fd, &head, sizeof(head)) != sizeof(head)) {
+        rill_fail_errno("unable to read header of '%s'", file);
+        goto fail_head;
+    }
+
+    if (head.magic != magic) {
+        rill_fail("invalid magic '0x%x' for '%s'", head.magic, file);
+        goto fail_head;
+    }
+
+    if (head.version != version) {
+        rill_fail("unknown version '%u' for '%s'", head.version, file);
+        goto fail_head;
+    }
+
+    struct stat stat_ret = {0};
+    if (fstat(fd, &stat_ret) == -1) {
+        rill_fail_errno("unable to stat '%s'", file);
+        goto fail_head;
+    }
+
+    // The length comes from disk and must fit in the file before anything is
+    // allocated for it.
+    size_t entries = (stat_ret.st_size - sizeof(head)) / sizeof(struct rill_manifest_entry);
+    if (head.len > entries) {
+        rill_fail("invalid len '%lu' for '%s'", head.len, file);
+        goto fail_head;
+    }
+
+    struct rill_manifest *manifest = rill_manifest_new(head.len);
+    if (!manifest) goto fail_alloc;
+
+    ssize_t len = head.len * sizeof(manifest->data[0]);
+    if (read(fd, manifest->data, len) != len) {
+        rill_fail_errno("unable to read entries of '%s'", file);
+        goto fail_read;
+    }
+    manifest->len = head.len;
+
+    close(fd);
+    *out = manifest;
+    return true;
+
+  fail_read:
+    rill_manifest_free(manifest);
+  fail_alloc:
+  fail_head:
+    close(fd);
+  fail_open:
+    return false;
+}
+
+// Writers are serialized through a dedicated lock file as the directory flock
+// is only held by rotations.
+static int manifest_lock(const char *dir)
+{
+    char file[PATH_MAX];
+    snprintf(file, sizeof(file), "%s/manifest.lock", dir);
+
+    int fd = open(file, O_RDONLY | O_CREAT, 0644);
+    if (fd == -1) {
+        rill_fail_errno("unable to open '%s'", file);
+        return -1;
+    }
+
+    if (flock(fd, LOCK_EX) == -1) {
+        rill_fail_errno("unable to acquire flock on '%s'", file);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void manifest_unlock(int fd)
+{
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+// The manifest is written to a temporary file which is then renamed over the
+// previous one so that readers never observe a partially written manifest.
+static bool manifest_write(const char *dir, const struct rill_manifest *manifest)
+{
+    char file[PATH_MAX];
+    snprintf(file, sizeof(file), "%s/manifest", dir);
+
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s/manifest.tmp", dir);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        rill_fail_errno("unable to open '%s'", tmp);
+        goto fail_open;
+    }
+
+    struct header head = { .magic = magic, .version = version, .len = manifest->len };
+    if (write(fd, &head, sizeof(head)) != sizeof(head)) {
+        rill_fail_errno("unable to write header of '%s'", tmp);
+        goto fail_write;
+    }
+
+    ssize_t len = manifest->len * sizeof(manifest->data[0]);
+    if (write(fd, manifest->data, len) != len) {
+        rill_fail_errno("unable to write entries of '%s'", tmp);
+        goto fail_write;
+    }
+
+    if (fdatasync(fd) == -1) {
+        rill_fail_errno("unable to fdatasync '%s'", tmp);
+        goto fail_write;
+    }
+
+    if (rename(tmp, file) == -1) {
+        rill_fail_errno("unable to rename '%s' to '%s'", tmp, file);
+        goto fail_write;
+    }
+
+    close(fd);
+    return true;
+
+  fail_write:
+    close(fd);
+    unlink(tmp);
+  fail_open:
+    return false;
+}
+
+bool rill_manifest_write(const char *dir, const struct rill_manifest *manifest)
+{
+    int fd = manifest_lock(dir);
+    if (fd == -1) return false;
+
+    bool ret = manifest_write(dir, manifest);
+
+    manifest_unlock(fd);
+    return ret;
+}
+
+// Checking for the manifest before taking the lock avoids creating a lock file
+// in directories without a manifest. A manifest created concurrently is built
+// from a scan of the directory which will include the new store.
+bool rill_manifest_add(const char *dir, const struct rill_manifest_entry *entry)
+{
+    char file[PATH_MAX];
+    snprintf(file, sizeof(file), "%s/manifest", dir);
+    if (access(file, F_OK) == -1) return true;
+
+    int fd = manifest_lock(dir);
+    if (fd == -1) return false;
+
+    struct rill_manifest *manifest = NULL;
+    if (!rill_manifest_read(dir, &manifest)) goto fail_read;
+    if (!manifest) goto done; // nothing to maintain
+
+    struct rill_manifest_entry *it =
+        (struct rill_manifest_entry *) rill_manifest_find(manifest, entry->file);
+    if (it) *it = *entry;
+    else {
+        struct rill_manifest *ret = rill_manifest_push(manifest, entry);
+        if (!ret) goto fail_push;
+        manifest = ret;
+        rill_manifest_sort(manifest);
+    }
+
+    if (!manifest_write(dir, manifest)) goto fail_write;
+
+    rill_manifest_free(manifest);
+  done:
+    manifest_unlock(fd);
+    return true;
+
+  fail_write:
+  fail_push:
+    rill_manifest_free(manifest);
+  fail_read:
+    manifest_unlock(fd);
+    return false;
+}
+
+static bool manifest_entry_of(
+        const char *dir,
+        const char *name,
+        const struct rill_manifest *known,
+        const struct rill_manifest *current,
+        struct rill_manifest_entry *entry)
+{
+    const struct rill_manifest_entry *it = NULL;
+    if (!it && known) it = rill_manifest_find(known, name);
+    if (!it && current) it = rill_manifest_find(current, name);
+    if (it) {
+        *entry = *it;
+        return true;
+    }
+
+    char file[PATH_MAX];
+    snprintf(file, sizeof(file), "%s/%s", dir, name);
+
+    // Unstamped stores fail to open and are added once they're written.
+    struct rill_store *store = rill_store_open(file);
+    if (!store) return false;
+
+    rill_store_manifest_entry(store, entry);
+    rill_store_close(store);
+    return true;
+}
+
+bool rill_manifest_rebuild(const char *dir, const struct rill_manifest *known)
+{
+    int fd = manifest_lock(dir);
+    if (fd == -1) goto fail_lock;
+
+    struct rill_manifest *current = NULL;
+    if (!rill_manifest_read(dir, &current)) current = NULL;
+
+    char (*names)[NAME_MAX + 1] = NULL;
+    ssize_t len = scan_dir_files(dir, &names);
+    if (len == -1) goto fail_names;
+
+    struct rill_manifest *manifest = rill_manifest_new(len);
+    if (!manifest) goto fail_manifest;
+
+    for (size_t i = 0; i < (size_t) len; ++i) {
+        struct rill_manifest_entry entry;
+        if (!manifest_entry_of(dir, names[i], known, current, &entry)) continue;
+        manifest = rill_manifest_push(manifest, &entry);
+        assert(manifest); // reserved up front
+    }
+    rill_manifest_sort(manifest);
+
+    if (!manifest_write(dir, manifest)) goto fail_write;
+
+    rill_manifest_free(manifest);
+    free(names);
+    rill_manifest_free(current);
+    manifest_unlock(fd);
+    return true;
+
+  fail_write:
+    rill_manifest_free(manifest);
+  fail_manifest:
+    free(names);
+  fail_names:
+    rill_manifest_free(current);
+    manifest_unlock(fd);
+  fail_lock:
+    return false;
+}
+
+// Readers fall back to scanning the directory without a manifest which is
+// always safe.
+bool rill_manifest_rm(const char *dir)
+{
+    int fd = manifest_lock(dir);
+    if (fd == -1) return false;
+
+    char file[PATH_MAX];
+    snprintf(file, sizeof(file), "%s/manifest", dir);
+
+    bool ret = true;
+    if (unlink(file) == -1 && errno != ENOENT) {
+        rill_fail_errno("unable to unlink '%s'", file);
+        ret = false;
+    }
+
+    manifest_unlock(fd);
+    return ret;
+}
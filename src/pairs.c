@@ -136,3 +136,20 @@ void rill_pairs_invert(struct rill_pairs* pairs)
         };
     }
 }
+
+struct rill_pairs *rill_pairs_inverted(const struct rill_pairs *pairs)
+{
+    struct rill_pairs *inverted = rill_pairs_new(pairs->len);
+    if (!inverted) return NULL;
+
+    for (size_t i = 0; i < pairs->len; ++i) {
+        inverted->data[i] = (struct rill_kv) {
+            .key = pairs->data[i].val,
+            .val = pairs->data[i].key,
+        };
+    }
+    inverted->len = pairs->len;
+
+    rill_pairs_compact(inverted);
+    return inverted;
+}
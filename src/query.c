@@ -5,9 +5,12 @@
 
 #include "rill.h"
 #include "utils.h"
+#include "tpool.h"
+#include "union.h"
 
 #include <assert.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -15,19 +18,393 @@
 #include <limits.h>
 
 
+// -----------------------------------------------------------------------------
+// view
+// -----------------------------------------------------------------------------
+
+// Pairs read from the accumulator are kept in sorted runs which are merged
+// whenever a run isn't at least twice the size of the next one. This keeps the
+// number of runs logarithmic in the number of pairs while the cost of merging
+// is amortized over the refreshes.
+enum { view_runs_cap = 64 };
+
+struct acc_view
+{
+    pthread_mutex_t lock;
+
+    struct rill_acc *acc;
+    struct rill_acc_cursor cursor;
+
+    size_t len;
+    struct rill_pairs *runs[view_runs_cap];
+    struct rill_pairs *inverted[view_runs_cap];
+};
+
+static struct acc_view *view_new(struct rill_acc *acc)
+{
+    struct acc_view *view = calloc(1, sizeof(*view));
+    if (!view) return NULL;
+
+    pthread_mutex_init(&view->lock, NULL);
+    view->acc = acc;
+    rill_acc_cursor_init(acc, &view->cursor);
+
+    return view;
+}
+
+static void view_free(struct acc_view *view)
+{
+    for (size_t i = 0; i < view->len; ++i) {
+        rill_pairs_free(view->runs[i]);
+        rill_pairs_free(view->inverted[i]);
+    }
+
+    pthread_mutex_destroy(&view->lock);
+    free(view);
+}
+
+static struct rill_pairs *pairs_merge(
+        const struct rill_pairs *lhs, const struct rill_pairs *rhs)
+{
+    struct rill_pairs *out = rill_pairs_new(lhs->len + rhs->len);
+    if (!out) return NULL;
+
+    size_t i = 0, j = 0;
+    while (i < lhs->len || j < rhs->len) {
+        const struct rill_kv *kv;
+        if (j == rhs->len) kv = &lhs->data[i++];
+        else if (i == lhs->len) kv = &rhs->data[j++];
+        else {
+            int cmp = rill_kv_cmp(&lhs->data[i], &rhs->data[j]);
+            kv = cmp <= 0 ? &lhs->data[i++] : &rhs->data[j++];
+            if (!cmp) j++;
+        }
+        out->data[out->len++] = *kv;
+    }
+
+    return out;
+}
+
+static bool view_merge(struct acc_view *view)
+{
+    size_t i = view->len - 2;
+
+    struct rill_pairs *runs = pairs_merge(view->runs[i], view->runs[i + 1]);
+    if (!runs) return false;
+
+    struct rill_pairs *inverted =
+        pairs_merge(view->inverted[i], view->inverted[i + 1]);
+    if (!inverted) {
+        rill_pairs_free(runs);
+        return false;
+    }
+
+    for (size_t j = i; j < view->len; ++j) {
+        rill_pairs_free(view->runs[j]);
+        rill_pairs_free(view->inverted[j]);
+    }
+
+    view->runs[i] = runs;
+    view->inverted[i] = inverted;
+    view->len--;
+    return true;
+}
+
+// Must be called with the view lock held.
+static bool view_refresh(struct acc_view *view)
+{
+    struct rill_pairs *run = rill_pairs_new(1);
+    if (!run) goto fail_alloc;
+
+    run = rill_acc_read(view->acc, &view->cursor, run);
+    if (!run) goto fail_read;
+
+    if (!run->len) {
+        rill_pairs_free(run);
+        return true;
+    }
+
+    rill_pairs_compact(run);
+
+    struct rill_pairs *inverted = rill_pairs_inverted(run);
+    if (!inverted) goto fail_invert;
+
+    view->runs[view->len] = run;
+    view->inverted[view->len] = inverted;
+    view->len++;
+
+    while (view->len >= 2) {
+        size_t i = view->len - 2;
+        bool full = view->len == view_runs_cap;
+        if (!full && view->runs[i]->len > 2 * view->runs[i + 1]->len) break;
+        if (!view_merge(view)) return false;
+    }
+
+    return true;
+
+  fail_invert:
+    rill_pairs_free(run);
+  fail_read:
+  fail_alloc:
+    rill_fail("unable to refresh acc view");
+    return false;
+}
+
+static size_t run_lower_bound(const struct rill_pairs *run, rill_key_t key)
+{
+    size_t lo = 0, hi = run->len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (run->data[mid].key < key) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static struct rill_pairs *run_query(
+        const struct rill_pairs *run, rill_key_t key, struct rill_pairs *out)
+{
+    size_t lo = run_lower_bound(run, key);
+    for (size_t i = lo; i < run->len && run->data[i].key == key; ++i) {
+        struct rill_pairs *next = rill_pairs_push(out, run->data[i].key, run->data[i].val);
+        if (!next) {
+            rill_pairs_free(out);
+            return NULL;
+        }
+        out = next;
+    }
+
+    return out;
+}
+
+// Queries the view for the given keys of column a or values of column b which
+// are returned in the same order as rill_store_query_key and
+// rill_store_query_value.
+static struct rill_pairs *view_query(
+        struct acc_view *view,
+        enum rill_col col,
+        const uint64_t *keys, size_t len,
+        struct rill_pairs *out)
+{
+    if (!view) return out;
+    pthread_mutex_lock(&view->lock);
+
+    if (!view_refresh(view)) goto fail;
+
+    struct rill_pairs **runs = col == rill_col_a ? view->runs : view->inverted;
+    for (size_t i = 0; i < view->len && out; ++i) {
+        for (size_t j = 0; j < len && out; ++j) {
+            if (keys[j]) out = run_query(runs[i], keys[j], out);
+        }
+    }
+
+    pthread_mutex_unlock(&view->lock);
+    return out;
+
+  fail:
+    pthread_mutex_unlock(&view->lock);
+    rill_pairs_free(out);
+    return NULL;
+}
+
+static struct rill_pairs *view_range(
+        struct acc_view *view,
+        enum rill_col col,
+        uint64_t lo, uint64_t hi,
+        struct rill_pairs *out)
+{
+    if (!view) return out;
+    pthread_mutex_lock(&view->lock);
+
+    if (!view_refresh(view)) goto fail;
+
+    struct rill_pairs **runs = col == rill_col_a ? view->runs : view->inverted;
+    for (size_t i = 0; i < view->len; ++i) {
+        const struct rill_pairs *run = runs[i];
+
+        size_t end = run_lower_bound(run, hi);
+        for (size_t j = run_lower_bound(run, lo); j < end; ++j) {
+            struct rill_pairs *next =
+                rill_pairs_push(out, run->data[j].key, run->data[j].val);
+            if (!next) goto fail;
+            out = next;
+        }
+    }
+
+    pthread_mutex_unlock(&view->lock);
+    return out;
+
+  fail:
+    pthread_mutex_unlock(&view->lock);
+    rill_pairs_free(out);
+    return NULL;
+}
+
+static struct rill_pairs *view_all(
+        struct acc_view *view, enum rill_col col, struct rill_pairs *out)
+{
+    if (!view) return out;
+    pthread_mutex_lock(&view->lock);
+
+    if (!view_refresh(view)) goto fail;
+
+    struct rill_pairs **runs = col == rill_col_a ? view->runs : view->inverted;
+    for (size_t i = 0; i < view->len; ++i) {
+        struct rill_pairs *next = rill_pairs_reserve(out, out->len + runs[i]->len);
+        if (!next) goto fail;
+        out = next;
+
+        memcpy(out->data + out->len, runs[i]->data,
+                runs[i]->len * sizeof(runs[i]->data[0]));
+        out->len += runs[i]->len;
+    }
+
+    pthread_mutex_unlock(&view->lock);
+    return out;
+
+  fail:
+    pthread_mutex_unlock(&view->lock);
+    rill_pairs_free(out);
+    return NULL;
+}
+
+
 // -----------------------------------------------------------------------------
 // rill
 // -----------------------------------------------------------------------------
 
+// The stores of a query are a snapshot of the directory that's replaced once a
+// rotation removes one of its stores. Queries and iterators hold a reference to
+// the snapshot they're using which is only closed once the last one is done.
+struct snapshot
+{
+    struct rill_stores *stores;
+    size_t refs;
+};
+
+struct snapshots
+{
+    pthread_mutex_t lock;
+    struct snapshot *current;
+};
+
+static struct snapshots *snapshots_new(const char *dir)
+{
+    struct snapshots *snapshots = calloc(1, sizeof(*snapshots));
+    if (!snapshots) {
+        rill_fail("unable to allocate snapshots for '%s'", dir);
+        goto fail_alloc_snapshots;
+    }
+
+    snapshots->current = calloc(1, sizeof(*snapshots->current));
+    if (!snapshots->current) {
+        rill_fail("unable to allocate snapshot for '%s'", dir);
+        goto fail_alloc_current;
+    }
+
+    snapshots->current->stores = rill_stores_open(dir);
+    if (!snapshots->current->stores) goto fail_stores;
+
+    snapshots->current->refs = 1;
+    pthread_mutex_init(&snapshots->lock, NULL);
+    return snapshots;
+
+  fail_stores:
+    free(snapshots->current);
+  fail_alloc_current:
+    free(snapshots);
+  fail_alloc_snapshots:
+    return NULL;
+}
+
+static void snapshot_unref(struct snapshots *snapshots, struct snapshot *snap)
+{
+    pthread_mutex_lock(&snapshots->lock);
+    bool last = !--snap->refs;
+    pthread_mutex_unlock(&snapshots->lock);
+
+    if (!last) return;
+    rill_stores_close(snap->stores);
+    free(snap);
+}
+
+static void snapshots_free(struct snapshots *snapshots)
+{
+    snapshot_unref(snapshots, snapshots->current);
+    pthread_mutex_destroy(&snapshots->lock);
+    free(snapshots);
+}
+
+static struct snapshot *snapshot_ref(struct snapshots *snapshots)
+{
+    pthread_mutex_lock(&snapshots->lock);
+    struct snapshot *snap = snapshots->current;
+    snap->refs++;
+    pthread_mutex_unlock(&snapshots->lock);
+    return snap;
+}
+
+// Replaces the stale snapshot with the stores currently in the directory unless
+// a concurrent query already replaced it.
+static bool snapshot_reload(
+        struct snapshots *snapshots, struct snapshot *stale, const char *dir)
+{
+    struct snapshot *snap = calloc(1, sizeof(*snap));
+    if (!snap) {
+        rill_fail("unable to allocate snapshot for '%s'", dir);
+        return false;
+    }
+
+    snap->stores = rill_stores_open(dir);
+    if (!snap->stores) {
+        free(snap);
+        return false;
+    }
+    snap->refs = 1;
+
+    pthread_mutex_lock(&snapshots->lock);
+    bool replace = snapshots->current == stale;
+    if (replace) snapshots->current = snap;
+    pthread_mutex_unlock(&snapshots->lock);
+
+    if (replace) snapshot_unref(snapshots, stale);
+    else snapshot_unref(snapshots, snap);
+    return true;
+}
+
+// A store that fails to open with ENOENT was removed by a rotation since the
+// snapshot was taken and its pairs now live in a store that's missing from the
+// snapshot. Skipping it would silently drop its pairs so the query is instead
+// retried on a reloaded snapshot. A store that's still listed after a few
+// reloads is missing for good which fails the query.
+enum { snapshot_retries = 8 };
+
+static bool store_removed(void)
+{
+    return rill_errno.errno_ == ENOENT;
+}
+
 struct rill_query
 {
     const char *dir;
 
-    size_t len;
-    struct rill_store *list[1024];
+    // Mutated on every query to pick up the latest pairs of the accumulator.
+    struct acc_view *view;
+
+    struct snapshots *snapshots;
+
+    // NULL if the stores are queried on the calling thread.
+    struct tpool *pool;
+    bool page_in;
 };
 
 struct rill_query * rill_query_open(const char *dir)
+{
+    return rill_query_open_ex(dir, &(struct rill_query_opts) {0});
+}
+
+struct rill_query * rill_query_open_ex(
+        const char *dir, const struct rill_query_opts *opts)
 {
     struct rill_query *query = calloc(1, sizeof(*query));
     if (!query) {
@@ -41,11 +418,25 @@ struct rill_query * rill_query_open(const char *dir)
         goto fail_alloc_dir;
     }
 
-    size_t cap = sizeof(query->list) / sizeof(query->list[0]);
-    query->len = rill_scan_dir(query->dir, query->list, cap);
+    query->snapshots = snapshots_new(query->dir);
+    if (!query->snapshots) goto fail_snapshots;
+    query->page_in = opts->page_in;
+
+    if (opts->threads) {
+        query->pool = tpool_new(opts->threads);
+        if (!query->pool) goto fail_pool;
+
+        if (opts->cpus_len && !tpool_pin(query->pool, opts->cpus, opts->cpus_len))
+            goto fail_pin;
+    }
 
     return query;
 
+  fail_pin:
+    tpool_free(query->pool);
+  fail_pool:
+    snapshots_free(query->snapshots);
+  fail_snapshots:
     free((char *) query->dir);
   fail_alloc_dir:
     free(query);
@@ -53,46 +444,372 @@ struct rill_query * rill_query_open(const char *dir)
     return NULL;
 }
 
+bool rill_query_attach(struct rill_query *query, struct rill_acc *acc)
+{
+    assert(!query->view);
+
+    query->view = view_new(acc);
+    if (!query->view) {
+        rill_fail("unable to allocate acc view for '%s'", query->dir);
+        return false;
+    }
+
+    return true;
+}
+
 void rill_query_close(struct rill_query *query)
 {
-    for (size_t i = 0; i < query->len; ++i)
-        rill_store_close(query->list[i]);
+    if (query->pool) tpool_free(query->pool);
+    snapshots_free(query->snapshots);
+
+    if (query->view) view_free(query->view);
 
     free((char *) query->dir);
     free(query);
 }
 
+
+// -----------------------------------------------------------------------------
+// fan-out
+// -----------------------------------------------------------------------------
+
+enum query_op
+{
+    query_op_keys,
+    query_op_vals,
+    query_op_key_range,
+    query_op_val_range,
+    query_op_all,
+};
+
+struct query_task
+{
+    enum query_op op;
+
+    const uint64_t *keys;
+    size_t len;
+    enum rill_col col;
+    bool page_in;
+
+    uint64_t lo, hi;
+
+    // Only the stores whose window overlaps [begin, end) are queried if end
+    // is set.
+    rill_ts_t begin, end;
+
+    struct rill_stores *stores;
+    size_t store;
+
+    struct rill_pairs *result;
+    struct rill_error error;
+};
+
+static struct rill_pairs *store_all(
+        struct rill_store *store, enum rill_col col, struct rill_pairs *out)
+{
+    struct rill_pairs *result =
+        rill_pairs_reserve(out, out->len + rill_store_pairs(store));
+    if (!result) goto fail_reserve;
+
+    // Stores without column b are inverted on the fly and sorted by the
+    // final compaction.
+    bool invert = !rill_store_has_col(store, col);
+    struct rill_store_it *it = rill_store_begin(store, invert ? rill_col_a : col);
+    if (!it) goto fail_begin;
+
+    enum { batch = 1024 };
+    rill_key_t keys[batch];
+    rill_val_t vals[batch];
+
+    while (true) {
+        ssize_t len = rill_store_it_next_batch(it, keys, vals, batch);
+        if (len == -1) goto fail;
+
+        for (ssize_t i = 0; i < len; ++i) {
+            struct rill_pairs *next = invert ?
+                rill_pairs_push(result, vals[i], keys[i]) :
+                rill_pairs_push(result, keys[i], vals[i]);
+            if (!next) goto fail;
+            result = next;
+        }
+
+        if (len < batch) break;
+    }
+
+    rill_store_it_free(it);
+    return result;
+
+  fail:
+    rill_store_it_free(it);
+  fail_begin:
+    rill_pairs_free(result);
+    return NULL;
+
+  fail_reserve:
+    rill_pairs_free(out);
+    return NULL;
+}
+
+// The pairs are owned by the query so they're freed on failure while the store
+// queries leave them to their caller.
+static struct rill_pairs *query_store(
+        const struct query_task *task,
+        struct rill_store *store,
+        struct rill_pairs *out)
+{
+    if (task->page_in && (task->op == query_op_keys || task->op == query_op_vals))
+        rill_store_page_in(store, task->col, task->keys, task->len);
+
+    struct rill_pairs *result = NULL;
+    switch (task->op) {
+    case query_op_keys:
+        result = rill_store_query_keys(store, task->keys, task->len, out);
+        break;
+    case query_op_vals:
+        result = rill_store_query_values(store, task->keys, task->len, out);
+        break;
+    case query_op_key_range:
+        result = rill_store_query_key_range(store, task->lo, task->hi, out);
+        break;
+    case query_op_val_range:
+        result = rill_store_query_value_range(store, task->lo, task->hi, out);
+        break;
+    case query_op_all: return store_all(store, task->col, out);
+    default: assert(false);
+    }
+
+    if (!result) rill_pairs_free(out);
+    return result;
+}
+
+static bool query_skip(
+        const struct query_task *task, const struct rill_stores *stores, size_t i)
+{
+    return task->end && !rill_stores_overlap(stores, i, task->begin, task->end);
+}
+
+static void query_run(void *data)
+{
+    struct query_task *task = data;
+
+    struct rill_store *store = NULL;
+    if (!query_skip(task, task->stores, task->store)) {
+        store = rill_stores_get(task->stores, task->store);
+        if (!store) {
+            task->error = rill_errno;
+            return;
+        }
+    }
+
+    task->result = rill_pairs_new(1);
+    if (store && task->result) task->result = query_store(task, store, task->result);
+    if (!task->result) task->error = rill_errno;
+}
+
+// Every store is queried by its own task into its own result which are then
+// concatenated. Stores are immutable so the only shared state is the lazy
+// opening of the stores which rill_stores_get handles.
+static struct rill_pairs *snapshot_query(
+        const struct rill_query *query,
+        struct rill_stores *stores,
+        const struct query_task *proto,
+        size_t first, size_t last)
+{
+    struct rill_pairs *result = rill_pairs_new(1);
+    if (!result) return NULL;
+
+    if (!query->pool) {
+        for (size_t i = first; i < last && result; ++i) {
+            if (query_skip(proto, stores, i)) continue;
+
+            struct rill_store *store = rill_stores_get(stores, i);
+            if (!store) {
+                rill_pairs_free(result);
+                return NULL;
+            }
+
+            result = query_store(proto, store, result);
+        }
+        return result;
+    }
+
+    size_t len = last - first;
+    if (!len) return result;
+
+    struct query_task *tasks = calloc(len, sizeof(*tasks));
+    if (!tasks) {
+        rill_fail("unable to allocate '%lu' store queries for '%s'", len, query->dir);
+        rill_pairs_free(result);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < len; ++i) {
+        tasks[i] = *proto;
+        tasks[i].stores = stores;
+        tasks[i].store = first + i;
+        tpool_submit(query->pool, query_run, &tasks[i]);
+    }
+    tpool_wait(query->pool);
+
+    size_t total = result->len;
+    for (size_t i = 0; i < len; ++i)
+        if (tasks[i].result) total += tasks[i].result->len;
+    struct rill_pairs *grown = rill_pairs_reserve(result, total);
+    if (!grown) rill_pairs_free(result);
+    result = grown;
+
+    for (size_t i = 0; i < len; ++i) {
+        struct query_task *task = &tasks[i];
+
+        if (!task->result) {
+            if (result) {
+                rill_errno = task->error;
+                rill_pairs_free(result);
+            }
+            result = NULL;
+            continue;
+        }
+
+        if (result) {
+            memcpy(result->data + result->len, task->result->data,
+                    task->result->len * sizeof(task->result->data[0]));
+            result->len += task->result->len;
+        }
+
+        rill_pairs_free(task->result);
+    }
+
+    free(tasks);
+    return result;
+}
+
+// Queries the stores of the current snapshot into new pairs. Newest is set if
+// the newest stores were part of the query.
+static struct rill_pairs *query_stores(
+        const struct rill_query *query, const struct query_task *proto, bool *newest)
+{
+    for (size_t attempt = 0;; ++attempt) {
+        struct snapshot *snap = snapshot_ref(query->snapshots);
+
+        size_t first = 0, last = rill_stores_len(snap->stores);
+        if (proto->end)
+            rill_stores_range(snap->stores, proto->begin, proto->end, &first, &last);
+        if (newest) *newest = !first;
+
+        struct rill_pairs *result = snapshot_query(query, snap->stores, proto, first, last);
+
+        bool retry = !result && store_removed() && attempt < snapshot_retries;
+        if (retry && !snapshot_reload(query->snapshots, snap, query->dir)) retry = false;
+        snapshot_unref(query->snapshots, snap);
+
+        if (!retry) return result;
+    }
+}
+
+
+// -----------------------------------------------------------------------------
+// query
+// -----------------------------------------------------------------------------
+
+// The values of a single key are yielded in sorted order by every store and
+// every run of the view so the result is made of sorted runs that are only
+// interrupted where two sources meet. Unioning these runs directly avoids
+// sorting the entire result. Falls back to a compaction if the pairs weren't
+// all produced by the query or if the scratch space can't be allocated.
+static void key_union(struct rill_pairs *pairs, size_t first, rill_key_t key)
+{
+    size_t len = pairs->len;
+    if (first || len <= 1) {
+        rill_pairs_compact(pairs);
+        return;
+    }
+
+    uint64_t *vals = malloc(len * (2 * sizeof(uint64_t) + sizeof(size_t)) + sizeof(size_t));
+    if (!vals) {
+        rill_pairs_compact(pairs);
+        return;
+    }
+    uint64_t *tmp = vals + len;
+    size_t *offs = (size_t *) (tmp + len);
+
+    size_t runs = 0;
+    for (size_t i = 0; i < len; ++i) {
+        assert(pairs->data[i].key == key);
+        vals[i] = pairs->data[i].val;
+        if (!i || vals[i] <= vals[i - 1]) offs[runs++] = i;
+    }
+    offs[runs] = len;
+
+    pairs->len = union_runs(vals, tmp, offs, runs);
+    for (size_t i = 0; i < pairs->len; ++i)
+        pairs->data[i] = (struct rill_kv) { .key = key, .val = vals[i] };
+
+    free(vals);
+}
+
+// Queries collect their pairs into pairs of their own which are freed by the
+// step that fails and only appended to out once every step succeeded. This
+// leaves out as it was on failure which is the same contract as the store
+// queries.
+static struct rill_pairs *query_append(struct rill_pairs *out, struct rill_pairs *pairs)
+{
+    struct rill_pairs *result = rill_pairs_reserve(out, out->len + pairs->len);
+    if (result) {
+        memcpy(result->data + result->len, pairs->data,
+                pairs->len * sizeof(pairs->data[0]));
+        result->len += pairs->len;
+    }
+
+    rill_pairs_free(pairs);
+    return result;
+}
+
 struct rill_pairs *rill_query_key(
         const struct rill_query *query, rill_key_t key, struct rill_pairs *out)
 {
     if (!key) return out;
 
-    struct rill_pairs *result = out;
-    for (size_t i = 0; i < query->len; ++i) {
-        result = rill_store_query_key(query->list[i], key, result);
-        if (!result) return NULL;
-    }
+    struct query_task task = { .op = query_op_keys, .keys = &key, .len = 1 };
+    struct rill_pairs *pairs = query_stores(query, &task, NULL);
+    if (!pairs) return NULL;
 
-    rill_pairs_compact(result);
+    pairs = view_query(query->view, rill_col_a, &key, 1, pairs);
+    if (!pairs) return NULL;
+
+    key_union(pairs, 0, key);
+
+    size_t base = out->len;
+    struct rill_pairs *result = query_append(out, pairs);
+    if (result && base) rill_pairs_compact(result);
     return result;
 }
 
-struct rill_pairs *rill_query_keys(
+struct rill_pairs *rill_query_key_ts(
         const struct rill_query *query,
-        const rill_key_t *keys, size_t len,
+        rill_key_t key, rill_ts_t begin, rill_ts_t end,
         struct rill_pairs *out)
 {
-    if (!len) return out;
+    if (!key || begin >= end) return out;
 
-    struct rill_pairs *result = out;
-    for (size_t i = 0; i < query->len; ++i) {
-        for (size_t j = 0; i < len; ++j) {
-            result = rill_store_query_key(query->list[i], keys[j], result);
-            if (!result) return NULL;
-        }
+    struct query_task task = {
+        .op = query_op_keys, .keys = &key, .len = 1,
+        .begin = begin, .end = end,
+    };
+    bool newest = false;
+    struct rill_pairs *pairs = query_stores(query, &task, &newest);
+    if (!pairs) return NULL;
+
+    // The pairs of the accumulator are newer then any store.
+    if (newest) {
+        pairs = view_query(query->view, rill_col_a, &key, 1, pairs);
+        if (!pairs) return NULL;
     }
 
-    rill_pairs_compact(result);
+    key_union(pairs, 0, key);
+
+    size_t base = out->len;
+    struct rill_pairs *result = query_append(out, pairs);
+    if (result && base) rill_pairs_compact(result);
     return result;
 }
 
@@ -105,6 +822,47 @@ static int compare_rill_values(const void *v1, const void *v2) {
     return 0;
 }
 
+// The keys are sorted once so that every store can be walked in a single
+// forward pass over its index and its values.
+struct rill_pairs *rill_query_keys(
+        const struct rill_query *query,
+        const rill_key_t *keys, size_t len,
+        struct rill_pairs *out)
+{
+    if (!len) return out;
+
+    rill_key_t *sorted = malloc(sizeof(keys[0]) * len);
+    if (!sorted) {
+        rill_fail("unable to allocate '%lu' keys", len);
+        return NULL;
+    }
+
+    memcpy(sorted, keys, sizeof(keys[0]) * len);
+    qsort(sorted, len, sizeof(keys[0]), compare_rill_values);
+
+    struct query_task task = {
+        .op = query_op_keys, .col = rill_col_a,
+        .keys = sorted, .len = len,
+        .page_in = query->page_in,
+    };
+    struct rill_pairs *pairs = query_stores(query, &task, NULL);
+    if (!pairs) goto fail;
+
+    pairs = view_query(query->view, rill_col_a, sorted, len, pairs);
+    if (!pairs) goto fail;
+
+    struct rill_pairs *result = query_append(out, pairs);
+    if (!result) goto fail;
+
+    rill_pairs_compact(result);
+    free(sorted);
+    return result;
+
+  fail:
+    free(sorted);
+    return NULL;
+}
+
 struct rill_pairs *rill_query_vals(
         const struct rill_query *query,
         const rill_val_t *vals, size_t len,
@@ -113,60 +871,278 @@ struct rill_pairs *rill_query_vals(
     if (!len) return out;
 
     rill_val_t *sorted = malloc(sizeof(vals[0]) * len);
-    if (!sorted) goto fail_alloc;
+    if (!sorted) {
+        rill_fail("unable to allocate '%lu' values", len);
+        return NULL;
+    }
 
     memcpy(sorted, vals, sizeof(vals[0]) * len);
     qsort(sorted, len, sizeof(vals[0]), compare_rill_values);
 
-    struct rill_pairs *result = out;
-    for (size_t i = 0; i < query->len; ++i) {
-        for (size_t j = 0; j < len; ++j) {
-            result = rill_store_query_value(query->list[i], sorted[j], result);
-            if (!result) goto fail_scan;
-        }
-    }
+    struct query_task task = {
+        .op = query_op_vals, .col = rill_col_b,
+        .keys = sorted, .len = len,
+        .page_in = query->page_in,
+    };
+    struct rill_pairs *pairs = query_stores(query, &task, NULL);
+    if (!pairs) goto fail;
+
+    pairs = view_query(query->view, rill_col_b, sorted, len, pairs);
+    if (!pairs) goto fail;
+
+    struct rill_pairs *result = query_append(out, pairs);
+    if (!result) goto fail;
 
     rill_pairs_compact(result);
     free(sorted);
     return result;
 
-  fail_scan:
+  fail:
     free(sorted);
-  fail_alloc:
-    // \todo potentially leaking result
     return NULL;
 }
 
+static struct rill_pairs *query_range(
+        const struct rill_query *query,
+        enum query_op op, enum rill_col col,
+        uint64_t lo, uint64_t hi,
+        struct rill_pairs *out)
+{
+    if (lo >= hi) return out;
+
+    struct query_task task = { .op = op, .col = col, .lo = lo, .hi = hi };
+    struct rill_pairs *pairs = query_stores(query, &task, NULL);
+    if (!pairs) return NULL;
+
+    pairs = view_range(query->view, col, lo, hi, pairs);
+    if (!pairs) return NULL;
+
+    struct rill_pairs *result = query_append(out, pairs);
+    if (!result) return NULL;
+
+    rill_pairs_compact(result);
+    return result;
+}
+
+struct rill_pairs *rill_query_key_range(
+        const struct rill_query *query,
+        rill_key_t lo, rill_key_t hi,
+        struct rill_pairs *out)
+{
+    return query_range(query, query_op_key_range, rill_col_a, lo, hi, out);
+}
+
+struct rill_pairs *rill_query_val_range(
+        const struct rill_query *query,
+        rill_val_t lo, rill_val_t hi,
+        struct rill_pairs *out)
+{
+    return query_range(query, query_op_val_range, rill_col_b, lo, hi, out);
+}
+
 struct rill_pairs *rill_query_all(
     const struct rill_query *query, enum rill_col col)
 {
-    struct rill_pairs *result = rill_pairs_new(1);
-    for (size_t i = 0; i < query->len; ++i) {
-        size_t pairs = rill_store_pairs(query->list[i]);
-        result = rill_pairs_reserve(result, result->len + pairs);
-        if (!result) goto fail_scan;
-
-        struct rill_store_it *it = rill_store_begin(query->list[i], col);
-        if (!it) goto fail_scan;
-
-        struct rill_kv kv;
-        while (true) {
-            if (!rill_store_it_next(it, &kv)) {
-                rill_store_it_free(it);
-                goto fail_scan;
-            }
-            if (rill_kv_nil(&kv)) break;
+    struct query_task task = { .op = query_op_all, .col = col };
+    struct rill_pairs *result = query_stores(query, &task, NULL);
+    if (!result) return NULL;
 
-            result = rill_pairs_push(result, kv.key, kv.val);
-        }
-        rill_store_it_free(it);
-    }
+    result = view_all(query->view, col, result);
+    if (!result) return NULL;
 
     rill_pairs_compact(result);
     return result;
+}
+
+
+// -----------------------------------------------------------------------------
+// it
+// -----------------------------------------------------------------------------
+
+// Every source is already sorted and free of duplicates so they're merged via
+// a heap of their heads and only the duplicates across sources are skipped.
+// Stores that lack the requested column are inverted a pass at a time so memory
+// usage is independent of the size of the stores except for the pairs of the
+// accumulator which are sorted into a run when the iterator is created.
+
+struct query_src
+{
+    struct rill_kv kv;
+
+    struct rill_store_it *it;
+
+    struct rill_pairs *run;
+    size_t pos;
+};
+
+struct rill_query_it
+{
+    struct rill_kv last;
+
+    const struct rill_query *query;
+    struct snapshot *snap;
+
+    size_t len;
+    struct query_src heap[];
+};
+
+static bool src_next(struct query_src *src)
+{
+    if (src->it) return rill_store_it_next(src->it, &src->kv);
+
+    if (src->pos < src->run->len) src->kv = src->run->data[src->pos++];
+    else src->kv = (struct rill_kv) {0};
+    return true;
+}
+
+static void src_free(struct query_src *src)
+{
+    if (src->it) rill_store_it_free(src->it);
+    rill_pairs_free(src->run);
+    *src = (struct query_src) {0};
+}
+
+static void it_sift_down(struct rill_query_it *it, size_t i)
+{
+    while (true) {
+        size_t min = i, lhs = 2 * i + 1, rhs = 2 * i + 2;
+        if (lhs < it->len && rill_kv_cmp(&it->heap[lhs].kv, &it->heap[min].kv) < 0) min = lhs;
+        if (rhs < it->len && rill_kv_cmp(&it->heap[rhs].kv, &it->heap[min].kv) < 0) min = rhs;
+        if (min == i) return;
+
+        struct query_src tmp = it->heap[i];
+        it->heap[i] = it->heap[min];
+        it->heap[min] = tmp;
+        i = min;
+    }
+}
+
+// Reads the head of the last source which is only kept if it's not empty.
+static bool it_push(struct rill_query_it *it)
+{
+    struct query_src *src = &it->heap[it->len];
+
+    if (!src_next(src)) {
+        src_free(src);
+        return false;
+    }
+
+    if (rill_kv_nil(&src->kv)) src_free(src);
+    else it->len++;
+    return true;
+}
+
+// Stores without the column are inverted in passes which share a single budget
+// so that the memory held by the iterator doesn't grow with the number of such
+// stores. Every pass is a full scan of column a so they're never made smaller
+// than a floor which can exceed the budget when there are many such stores.
+enum { it_invert_pairs = 1 << 20, it_invert_min = 1 << 14 };
+
+static struct rill_query_it *query_begin(
+        const struct rill_query *query, struct snapshot *snap, enum rill_col col)
+{
+    size_t stores = rill_stores_len(snap->stores);
+
+    struct rill_query_it *it = calloc(1, sizeof(*it) + (stores + 1) * sizeof(it->heap[0]));
+    if (!it) {
+        rill_fail("unable to allocate iterator over '%lu' stores for '%s'", stores, query->dir);
+        return NULL;
+    }
+
+    it->query = query;
+    it->snap = snap;
+
+    size_t inverted = 0;
+    for (size_t i = 0; i < stores; ++i) {
+        struct rill_store *store = rill_stores_get(snap->stores, i);
+        if (!store) goto fail;
+        if (!rill_store_has_col(store, col)) inverted++;
+    }
+
+    size_t pass = inverted ? it_invert_pairs / inverted : 0;
+    if (pass < it_invert_min) pass = it_invert_min;
+
+    for (size_t i = 0; i < stores; ++i) {
+        struct rill_store *store = rill_stores_get(snap->stores, i);
+        if (!store) goto fail;
+
+        struct query_src *src = &it->heap[it->len];
+        src->it = rill_store_has_col(store, col) ?
+            rill_store_begin(store, col) : rill_store_begin_inverted(store, pass);
+        if (!src->it) goto fail;
+
+        if (!it_push(it)) goto fail;
+    }
+
+    if (query->view) {
+        struct rill_pairs *run = rill_pairs_new(1);
+        if (!run) goto fail;
+
+        run = view_all(query->view, col, run);
+        if (!run) goto fail;
+        rill_pairs_compact(run);
+
+        it->heap[it->len].run = run;
+        if (!it_push(it)) goto fail;
+    }
+
+    for (size_t i = it->len / 2; i > 0; --i) it_sift_down(it, i - 1);
+    return it;
 
-  fail_scan:
-    free(result);
+  fail:
+    // The snapshot is left to the caller.
+    it->snap = NULL;
+    rill_query_it_free(it);
     return NULL;
+}
+
+// The iterator holds on to its snapshot as the stores it's reading from must
+// outlive it. Stores removed before the iterator could open them are handled
+// the same way as for the other queries.
+struct rill_query_it *rill_query_begin(
+        const struct rill_query *query, enum rill_col col)
+{
+    for (size_t attempt = 0;; ++attempt) {
+        struct snapshot *snap = snapshot_ref(query->snapshots);
+
+        struct rill_query_it *it = query_begin(query, snap, col);
+        if (it) return it;
+
+        bool retry = store_removed() && attempt < snapshot_retries;
+        if (retry && !snapshot_reload(query->snapshots, snap, query->dir)) retry = false;
+        snapshot_unref(query->snapshots, snap);
+
+        if (!retry) return NULL;
+    }
+}
+
+void rill_query_it_free(struct rill_query_it *it)
+{
+    for (size_t i = 0; i < it->len; ++i) src_free(&it->heap[i]);
+    if (it->snap) snapshot_unref(it->query->snapshots, it->snap);
+    free(it);
+}
+
+bool rill_query_it_next(struct rill_query_it *it, struct rill_kv *kv)
+{
+    while (it->len) {
+        struct query_src *top = &it->heap[0];
+        struct rill_kv head = top->kv;
+
+        if (!src_next(top)) return false;
+        if (rill_kv_nil(&top->kv)) {
+            src_free(top);
+            it->len--;
+            if (it->len) *top = it->heap[it->len];
+        }
+        it_sift_down(it, 0);
+
+        if (!rill_kv_cmp(&head, &it->last)) continue;
+
+        *kv = it->last = head;
+        return true;
+    }
 
+    *kv = (struct rill_kv) {0};
+    return true;
 }
@@ -0,0 +1,213 @@
+/* reclaim.c
+   agent (agent@local), 19 Oct 2026
+   FreeBSD-style copyright and disclaimer apply
+*/
+
+#include "rill.h"
+#include "utils.h"
+
+#include <time.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+
+// -----------------------------------------------------------------------------
+// reclaim
+// -----------------------------------------------------------------------------
+
+enum { reclaim_chunk = 64UL << 20 };
+
+// Truncating a file from the end releases its extents a chunk at a time which
+// keeps every individual operation short. Freeing a large file via a single
+// unlink instead releases all of its extents at once and can stall the I/O of
+// the entire file system.
+static bool reclaim_file(
+        const char *file,
+        const struct rill_reclaim_opts *opts,
+        struct rill_reclaim_stats *stats)
+{
+    int fd = open(file, O_WRONLY);
+    if (fd == -1) {
+        if (errno == ENOENT) return true;
+        rill_fail_errno("unable to open '%s'", file);
+        return false;
+    }
+
+    // Stores hold a shared lock for as long as they're opened and truncating
+    // the file would fault their mappings.
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+        if (errno == EWOULDBLOCK) {
+            stats->busy++;
+            close(fd);
+            return true;
+        }
+
+        rill_fail_errno("unable to lock '%s'", file);
+        goto fail;
+    }
+
+    struct stat stat_ret = {0};
+    if (fstat(fd, &stat_ret) == -1) {
+        rill_fail_errno("unable to stat '%s'", file);
+        goto fail;
+    }
+
+    size_t chunk = opts->chunk_bytes ? opts->chunk_bytes : reclaim_chunk;
+    size_t len = stat_ret.st_size;
+
+    while (len) {
+        size_t bytes = len < chunk ? len : chunk;
+        len -= bytes;
+
+        if (ftruncate(fd, len) == -1) {
+            rill_fail_errno("unable to truncate '%s' to '%lu'", file, len);
+            goto fail;
+        }
+
+        stats->bytes += bytes;
+        if (opts->throttle) rill_throttle_charge(opts->throttle, bytes);
+    }
+
+    if (unlink(file) == -1 && errno != ENOENT) {
+        rill_fail_errno("unable to unlink '%s'", file);
+        goto fail;
+    }
+
+    stats->files++;
+    close(fd);
+    return true;
+
+  fail:
+    close(fd);
+    return false;
+}
+
+bool rill_reclaim(const char *dir, const struct rill_reclaim_opts *opts)
+{
+    struct rill_reclaim_stats stats = {0};
+
+    char trash[PATH_MAX];
+    if (!trash_dir(dir, trash, sizeof(trash))) return false;
+
+    char (*names)[NAME_MAX + 1] = NULL;
+    ssize_t len = scan_dir_files(trash, &names);
+    if (len == -1) return false;
+
+    bool ret = true;
+    for (ssize_t i = 0; i < len; ++i) {
+        char file[PATH_MAX];
+        if (snprintf(file, sizeof(file), "%s/%s", trash, names[i]) >= (int) sizeof(file)) {
+            rill_fail("path too long for '%s' in '%s'", names[i], trash);
+            ret = false;
+            continue;
+        }
+
+        ret = reclaim_file(file, opts, &stats) && ret;
+    }
+
+    free(names);
+    if (opts->stats) *opts->stats = stats;
+    return ret;
+}
+
+
+// -----------------------------------------------------------------------------
+// reclaimer
+// -----------------------------------------------------------------------------
+
+struct rill_reclaimer
+{
+    char dir[PATH_MAX];
+    struct rill_reclaim_opts opts;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool done;
+};
+
+static void *reclaimer_run(void *data)
+{
+    struct rill_reclaimer *reclaimer = data;
+    if (reclaimer->opts.throttle) (void) rill_throttle_apply(reclaimer->opts.throttle);
+
+    size_t interval = reclaimer->opts.interval_ms ? reclaimer->opts.interval_ms : 1000;
+
+    pthread_mutex_lock(&reclaimer->lock);
+    while (!reclaimer->done) {
+        pthread_mutex_unlock(&reclaimer->lock);
+        if (!rill_reclaim(reclaimer->dir, &reclaimer->opts)) rill_perror(&rill_errno);
+        pthread_mutex_lock(&reclaimer->lock);
+
+        struct timespec deadline;
+        (void) clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += interval / 1000;
+        deadline.tv_nsec += (interval % 1000) * 1000 * 1000;
+        if (deadline.tv_nsec >= 1000 * 1000 * 1000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000 * 1000 * 1000;
+        }
+
+        while (!reclaimer->done) {
+            int err = pthread_cond_timedwait(&reclaimer->cond, &reclaimer->lock, &deadline);
+            if (err == ETIMEDOUT) break;
+        }
+    }
+    pthread_mutex_unlock(&reclaimer->lock);
+
+    return NULL;
+}
+
+struct rill_reclaimer *rill_reclaimer_start(
+        const char *dir, const struct rill_reclaim_opts *opts)
+{
+    struct rill_reclaimer *reclaimer = calloc(1, sizeof(*reclaimer));
+    if (!reclaimer) {
+        rill_fail("unable to allocate reclaimer for '%s'", dir);
+        goto fail_alloc;
+    }
+
+    snprintf(reclaimer->dir, sizeof(reclaimer->dir), "%s", dir);
+    reclaimer->opts = *opts;
+    reclaimer->opts.stats = NULL; // can't be safely shared with the thread.
+
+    pthread_mutex_init(&reclaimer->lock, NULL);
+    pthread_cond_init(&reclaimer->cond, NULL);
+
+    int err = pthread_create(&reclaimer->thread, NULL, reclaimer_run, reclaimer);
+    if (err) {
+        errno = err;
+        rill_fail_errno("unable to create reclaimer thread for '%s'", dir);
+        goto fail_thread;
+    }
+
+    return reclaimer;
+
+  fail_thread:
+    pthread_cond_destroy(&reclaimer->cond);
+    pthread_mutex_destroy(&reclaimer->lock);
+    free(reclaimer);
+  fail_alloc:
+    return NULL;
+}
+
+void rill_reclaimer_stop(struct rill_reclaimer *reclaimer)
+{
+    if (!reclaimer) return;
+
+    pthread_mutex_lock(&reclaimer->lock);
+    reclaimer->done = true;
+    pthread_cond_signal(&reclaimer->cond);
+    pthread_mutex_unlock(&reclaimer->lock);
+
+    pthread_join(reclaimer->thread, NULL);
+
+    pthread_cond_destroy(&reclaimer->cond);
+    pthread_mutex_destroy(&reclaimer->lock);
+    free(reclaimer);
+}
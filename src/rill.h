@@ -8,6 +8,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/types.h>
 
 
 // -----------------------------------------------------------------------------
@@ -92,6 +93,9 @@ void rill_pairs_print(const struct rill_pairs *pairs);
 
 void rill_pairs_invert(struct rill_pairs* pairs);
 
+// Sorted copy of pairs with keys and values swapped.
+struct rill_pairs *rill_pairs_inverted(const struct rill_pairs *pairs);
+
 
 // -----------------------------------------------------------------------------
 // store
@@ -99,11 +103,49 @@ void rill_pairs_invert(struct rill_pairs* pairs);
 
 enum rill_col { rill_col_a = 0, rill_col_b = 1 };
 
+enum rill_store_flags
+{
+    // Skips the reverse column which roughly halves the cost of writing a
+    // store. Value queries fall back to a scan of column a.
+    rill_store_col_a_only = 1 << 0,
+
+    // Leaves the manifest of the directory alone for writers that rebuild it
+    // once they're done, such as rotations. Not persisted in the store.
+    rill_store_no_manifest = 1 << 1,
+};
+
 struct rill_store;
 struct rill_store_it;
 struct rill_space;
+struct rill_throttle;
+
+enum rill_advice
+{
+    rill_advice_normal = 0,
+    rill_advice_random,
+    rill_advice_sequential,
+};
+
+// Mapping policies applied to the sections of a store when it's opened. The
+// header and both indexes make up the index section while the two columns make
+// up the data section.
+struct rill_store_opts
+{
+    enum rill_advice index_advice;
+    enum rill_advice data_advice;
+
+    // Prefaults the index section to avoid page faults on the first lookups.
+    bool populate_index;
+
+    // Requests transparent huge pages for the entire mapping to reduce dTLB
+    // misses. Only effective if the kernel supports huge pages for the
+    // underlying file system.
+    bool huge_pages;
+};
 
 struct rill_store *rill_store_open(const char *file);
+struct rill_store *rill_store_open_ex(
+        const char *file, const struct rill_store_opts *opts);
 void rill_store_close(struct rill_store *store);
 
 bool rill_store_write(
@@ -112,17 +154,55 @@ bool rill_store_write(
         size_t quant,
         struct rill_pairs *pairs);
 
+bool rill_store_write_ex(
+        const char *file,
+        rill_ts_t ts,
+        size_t quant,
+        struct rill_pairs *pairs,
+        unsigned flags);
+
+// Writes the union of runs which must each be sorted and compacted. inverted
+// must contain the inverted and sorted version of each run.
+bool rill_store_write_runs(
+        const char *file,
+        rill_ts_t ts,
+        size_t quant,
+        struct rill_pairs *const *runs,
+        struct rill_pairs *const *inverted,
+        size_t len,
+        unsigned flags);
+
 bool rill_store_merge(
         const char *file,
         rill_ts_t ts, size_t quant,
         struct rill_store **list, size_t len);
 
+bool rill_store_merge_ex(
+        const char *file,
+        rill_ts_t ts, size_t quant,
+        struct rill_store **list, size_t len,
+        unsigned flags);
+
+// Same as rill_store_merge_ex but paces the writes of the merge against the
+// given throttle which can be NULL.
+bool rill_store_merge_throttle(
+        const char *file,
+        rill_ts_t ts, size_t quant,
+        struct rill_store **list, size_t len,
+        unsigned flags,
+        struct rill_throttle *throttle);
+
 bool rill_store_rm(struct rill_store *store);
 
+// Moves the store into the trash directory of its database directory and closes
+// it. The file is freed later by rill_reclaim.
+bool rill_store_trash(struct rill_store *store);
+
 const char * rill_store_file(const struct rill_store *store);
 unsigned rill_store_version(const struct rill_store *store);
 rill_ts_t rill_store_ts(const struct rill_store *store);
 size_t rill_store_quant(const struct rill_store *store);
+bool rill_store_has_col(const struct rill_store *store, enum rill_col col);
 size_t rill_store_keys_count(const struct rill_store *store, enum rill_col column);
 size_t rill_store_pairs(const struct rill_store *store);
 size_t rill_store_index_len(const struct rill_store *store, enum rill_col col);
@@ -135,11 +215,51 @@ size_t rill_store_space_pairs(struct rill_space *space, enum rill_col col);
 void rill_space_free(struct rill_space* space);
 
 
+// Queries append their pairs to out and return it, possibly reallocated in
+// which case out must no longer be used. On failure NULL is returned and out is
+// left as it was and still owned by the caller.
 struct rill_pairs *rill_store_query_value(
         struct rill_store *store, rill_val_t val, struct rill_pairs *out);
 struct rill_pairs *rill_store_query_key(
         struct rill_store *store, rill_key_t key, struct rill_pairs *out);
 
+// Keys must be sorted. Large batches are answered by a sequential scan of the
+// store instead of a lookup per key.
+struct rill_pairs *rill_store_query_keys(
+        struct rill_store *store,
+        const rill_key_t *keys, size_t len,
+        struct rill_pairs *out);
+
+// Values must be sorted. Same as rill_store_query_keys except that the pairs of
+// a scan are appended in key order and must be compacted.
+struct rill_pairs *rill_store_query_values(
+        struct rill_store *store,
+        const rill_val_t *vals, size_t len,
+        struct rill_pairs *out);
+
+// Pairs of column a whose key is within [lo, hi) in key order. Only the section
+// of the column covered by the range is decoded.
+struct rill_pairs *rill_store_query_key_range(
+        struct rill_store *store,
+        rill_key_t lo, rill_key_t hi,
+        struct rill_pairs *out);
+
+// Pairs of column b whose value is within [lo, hi). Same as
+// rill_store_query_values, the pairs of stores without column b are appended in
+// key order and must be compacted.
+struct rill_pairs *rill_store_query_value_range(
+        struct rill_store *store,
+        rill_val_t lo, rill_val_t hi,
+        struct rill_pairs *out);
+
+// Issues asynchronous reads for the value lists of a sorted batch of keys of
+// the given column ahead of a rill_store_query_keys or rill_store_query_values
+// of the same batch. Purely advisory.
+void rill_store_page_in(
+        struct rill_store *store,
+        enum rill_col column,
+        const uint64_t *keys, size_t len);
+
 
 size_t rill_store_keys(
         const struct rill_store *store, rill_val_t *out, size_t cap,
@@ -147,9 +267,21 @@ size_t rill_store_keys(
 
 struct rill_store_it *rill_store_begin(
         struct rill_store *store, enum rill_col column);
+
+// Iterates over column b of any store, including the ones written without it,
+// by inverting column a in passes over ranges of the value dictionary. A pass
+// holds roughly pass_pairs pairs in memory and 0 defaults to 1M pairs.
+struct rill_store_it *rill_store_begin_inverted(
+        struct rill_store *store, size_t pass_pairs);
 void rill_store_it_free(struct rill_store_it *it);
 bool rill_store_it_next(struct rill_store_it *it, struct rill_kv *kv);
 
+// Decodes up to cap pairs into keys and vals. Returns the number of pairs
+// decoded which is only less than cap at the end of the column or -1 on error.
+// Can be mixed with rill_store_it_next on the same iterator.
+ssize_t rill_store_it_next_batch(
+        struct rill_store_it *it, rill_key_t *keys, rill_val_t *vals, size_t cap);
+
 
 // -----------------------------------------------------------------------------
 // acc
@@ -159,18 +291,257 @@ struct rill_acc;
 
 enum { rill_acc_read_only = 0 };
 
+struct rill_acc_opts
+{
+    // Allows multiple threads or processes to concurrently ingest into the
+    // same accumulator. Must be enabled by every producer.
+    bool multi_producer;
+
+    // Number of recently ingested pairs remembered to suppress duplicates
+    // before they reach the ring. The filter is owned by the handle so each
+    // producer must use its own handle. 0 disables the filter.
+    size_t dedup_len;
+
+    // Sorts the ring in runs of this many pairs on a background thread as
+    // they're published which turns flushes into a merge of the runs. Only
+    // useful on the handle used to flush. Runs are clamped between 1024 pairs
+    // and half the ring. 0 disables the background sorting.
+    size_t sort_run_len;
+
+    // Number of additional slots used to absorb bursts when the ring is full
+    // instead of overwriting pairs that weren't flushed yet. Only used when
+    // the accumulator is created. 0 disables the spill.
+    size_t spill_cap;
+
+    // Requests transparent huge pages for the ring which is written
+    // sequentially and wraps around and therefore touches every page.
+    bool huge_pages;
+};
+
+struct rill_acc_stats
+{
+    size_t dedup_suppressed;
+
+    // The high-water marks are the largest number of pending pairs observed
+    // at the start of a flush and are persisted in the accumulator file.
+    size_t ring_len, ring_hwm;
+    size_t spill_len, spill_hwm;
+};
+
 struct rill_acc *rill_acc_open(const char *dir, size_t cap);
+struct rill_acc *rill_acc_open_ex(
+        const char *dir, size_t cap, const struct rill_acc_opts *opts);
 void rill_acc_close(struct rill_acc *acc);
+void rill_acc_stats(const struct rill_acc *acc, struct rill_acc_stats *stats);
 
 void rill_acc_ingest(struct rill_acc *acc, rill_key_t key, rill_val_t val);
+void rill_acc_ingest_batch(
+        struct rill_acc *acc, const struct rill_kv *kvs, size_t n);
 bool rill_acc_write(struct rill_acc *acc, const char *file, rill_ts_t now);
+bool rill_acc_write_ex(
+        struct rill_acc *acc, const char *file, rill_ts_t now, unsigned flags);
+
+// Partitions the pairs by key into one store named name in each of the shard
+// directories of dir. Shards without any pairs are skipped.
+bool rill_acc_write_shards(
+        struct rill_acc *acc,
+        const char *dir, size_t shards,
+        const char *name, rill_ts_t now, unsigned flags);
+
+// Position in the rings of an accumulator up to which the published pairs have
+// been read by rill_acc_read. Initialized to the position of the last flush.
+struct rill_acc_cursor
+{
+    size_t ring, spill;
+};
+
+void rill_acc_cursor_init(struct rill_acc *acc, struct rill_acc_cursor *cursor);
+struct rill_pairs *rill_acc_read(
+        struct rill_acc *acc,
+        struct rill_acc_cursor *cursor,
+        struct rill_pairs *out);
+
+
+// -----------------------------------------------------------------------------
+// throttle
+// -----------------------------------------------------------------------------
+
+enum rill_ioprio
+{
+    rill_ioprio_none = 0,
+    rill_ioprio_best_effort,
+    rill_ioprio_idle,
+};
+
+// Budget shared by background merges to keep them from starving queries of
+// disk bandwidth. The written bytes of a merge are charged against a token
+// bucket as they're handed to the kernel for writeback.
+struct rill_throttle_opts
+{
+    // Sustained rate of the bucket. 0 disables the bucket.
+    size_t bytes_per_sec;
+
+    // Size of the bucket. 0 defaults to a second worth of bytes_per_sec.
+    size_t burst_bytes;
+
+    // Rate used while the pressure signal is raised. 0 pauses merges until the
+    // signal is lowered.
+    size_t pressure_bytes_per_sec;
+
+    // Applied to the pool threads executing the merges of a rotation and to
+    // the reclaimer thread. The calling thread of a rotation without threads is
+    // left as is since an unprivileged thread can't undo them. A nice of 0 is
+    // left as is.
+    int nice;
+    enum rill_ioprio ioprio;
+    int ioprio_level; // 0 (highest) to 7 for rill_ioprio_best_effort
+};
+
+struct rill_throttle_stats
+{
+    size_t bytes;
+
+    // Time spent sleeping on the bucket and paused by the pressure signal.
+    uint64_t throttled_ns;
+    uint64_t paused_ns;
+};
+
+struct rill_throttle *rill_throttle_new(const struct rill_throttle_opts *opts);
+void rill_throttle_free(struct rill_throttle *throttle);
+void rill_throttle_stats(
+        const struct rill_throttle *throttle, struct rill_throttle_stats *stats);
+
+// The pressure signal is raised while at least one raise is outstanding which
+// allows concurrent queries to each signal their own pressure.
+void rill_throttle_raise(struct rill_throttle *throttle);
+void rill_throttle_lower(struct rill_throttle *throttle);
+
+// Applies the priorities of the throttle to the calling thread for the rest of
+// its lifetime. Returns false without setting rill_errno if any of them couldn't
+// be applied.
+bool rill_throttle_apply(const struct rill_throttle *throttle);
+
+// Charges the bytes against the budget and blocks as required.
+void rill_throttle_charge(struct rill_throttle *throttle, size_t bytes);
 
 
 // -----------------------------------------------------------------------------
 // rotate
 // -----------------------------------------------------------------------------
 
+enum rill_compaction
+{
+    // Merges every store into hour, day, week and month quants.
+    rill_compaction_time = 0,
+
+    // Same quants as rill_compaction_time but a group of stores that adds up
+    // to less than min_bytes isn't merged and is instead carried over to the
+    // next quant. Stores are always merged into their month.
+    rill_compaction_skip_small,
+
+    // Merges runs of fanout adjacent stores of the same month whose sizes are
+    // within size_ratio of each other. Stores are always merged into their
+    // month once the month is over.
+    rill_compaction_size,
+};
+
+enum { rill_rotate_tiers = 4 };
+
+// Bytes read and written by the merges of each tier (hour, day, week and
+// month). Stores that are only carried over to the next tier aren't counted.
+struct rill_rotate_tier
+{
+    rill_ts_t quant;
+    size_t merges, inputs;
+    size_t bytes_read, bytes_written;
+};
+
+struct rill_rotate_stats
+{
+    struct rill_rotate_tier tiers[rill_rotate_tiers];
+    size_t bytes_read, bytes_written;
+
+    // Number of stores left in the directory which is the fan-out of a query.
+    size_t stores;
+
+    // Time spent by the throttle during the rotation. Includes the time of any
+    // other user of the throttle.
+    uint64_t throttled_ns, paused_ns;
+};
+
+struct rill_rotate_opts
+{
+    // Merges of this quant and above write column b while smaller ones only
+    // write column a. Column b is built from column a as needed. 0 writes
+    // column b at every quant.
+    rill_ts_t col_b_quant;
+
+    // Number of threads used to execute independent merges concurrently. 0
+    // executes every merge on the calling thread.
+    size_t threads;
+
+    enum rill_compaction compaction;
+    size_t min_bytes; // rill_compaction_skip_small
+    size_t fanout, size_ratio; // rill_compaction_size; defaults to 4 and 4
+
+    // Stores older then this are deleted. 0 defaults to 16 months.
+    rill_ts_t expire_secs;
+
+    // Paces the merges of the rotation if not NULL.
+    struct rill_throttle *throttle;
+
+    // Merged and expired stores are moved to the trash directory instead of
+    // being unlinked while holding the rotation lock. The trash must then be
+    // emptied via rill_reclaim.
+    bool trash;
+
+    // Filled in by the rotation if not NULL.
+    struct rill_rotate_stats *stats;
+};
+
 bool rill_rotate(const char *dir, rill_ts_t now);
+bool rill_rotate_ex(
+        const char *dir, rill_ts_t now, const struct rill_rotate_opts *opts);
+
+
+// -----------------------------------------------------------------------------
+// reclaim
+// -----------------------------------------------------------------------------
+
+struct rill_reclaim_stats
+{
+    size_t files, bytes;
+
+    // Files that were skipped because they're still opened by a reader.
+    size_t busy;
+};
+
+struct rill_reclaim_opts
+{
+    // Files are truncated by this many bytes at a time to avoid freeing all
+    // their extents at once. 0 defaults to 64MB.
+    size_t chunk_bytes;
+
+    // Every truncated chunk is charged against the throttle if not NULL.
+    struct rill_throttle *throttle;
+
+    // Delay between reclaims of a rill_reclaimer. 0 defaults to 1 second.
+    size_t interval_ms;
+
+    // Filled in by rill_reclaim if not NULL.
+    struct rill_reclaim_stats *stats;
+};
+
+// Frees the files in the trash directory of the database directory. Files still
+// opened by a store are left for a later reclaim.
+bool rill_reclaim(const char *dir, const struct rill_reclaim_opts *opts);
+
+// Background thread that periodically reclaims the trash of a directory.
+struct rill_reclaimer;
+
+struct rill_reclaimer *rill_reclaimer_start(
+        const char *dir, const struct rill_reclaim_opts *opts);
+void rill_reclaimer_stop(struct rill_reclaimer *reclaimer);
 
 
 // -----------------------------------------------------------------------------
@@ -179,14 +550,54 @@ bool rill_rotate(const char *dir, rill_ts_t now);
 
 struct rill_query;
 
+struct rill_query_opts
+{
+    // Number of threads used to query the stores in parallel. 0 queries every
+    // store on the calling thread. Concurrent queries on the same handle share
+    // the threads.
+    size_t threads;
+
+    // Pins the query threads round-robin on these cpus if not empty.
+    const size_t *cpus;
+    size_t cpus_len;
+
+    // Reads the value lists of a batch of keys or values asynchronously before
+    // decoding them. Speeds up batches on cold stores at the cost of reading
+    // a little more than required.
+    bool page_in;
+};
+
+// Queries run on a snapshot of the stores of the directory. The snapshot is
+// reloaded and the query restarted whenever a concurrent rotation removed one
+// of its stores so that its results never miss the pairs of a merged store.
 struct rill_query * rill_query_open(const char *dir);
+struct rill_query * rill_query_open_ex(
+        const char *dir, const struct rill_query_opts *opts);
 void rill_query_close(struct rill_query *db);
 
+// Makes the pairs ingested into the accumulator since its last flush visible
+// to the query without waiting for a store file to be written. The accumulator
+// must outlive the query. The view is never trimmed: pairs stay in it after
+// they're flushed and every pair is held once per column, roughly 32 bytes per
+// distinct pair ingested since the view was attached. Its memory therefore
+// grows with the ingestion rate for as long as the query stays open, which is
+// why the query should be reopened after every rotation.
+bool rill_query_attach(struct rill_query *query, struct rill_acc *acc);
+
+// Same contract as the store queries: the pairs are appended to out which is
+// returned, possibly reallocated. On failure NULL is returned and out is left
+// as it was and still owned by the caller.
 struct rill_pairs *rill_query_key(
         const struct rill_query *query,
         rill_key_t key,
         struct rill_pairs *out);
 
+// Only queries the stores whose quant overlaps [begin, end).
+struct rill_pairs *rill_query_key_ts(
+        const struct rill_query *query,
+        rill_key_t key, rill_ts_t begin, rill_ts_t end,
+        struct rill_pairs *out);
+
 struct rill_pairs *rill_query_keys(
         const struct rill_query *query,
         const rill_key_t *keys, size_t len,
@@ -197,12 +608,173 @@ struct rill_pairs *rill_query_vals(
         const rill_val_t *vals, size_t len,
         struct rill_pairs *out);
 
+// Pairs whose key, or value for rill_query_val_range, is within [lo, hi).
+struct rill_pairs *rill_query_key_range(
+        const struct rill_query *query,
+        rill_key_t lo, rill_key_t hi,
+        struct rill_pairs *out);
+
+struct rill_pairs *rill_query_val_range(
+        const struct rill_query *query,
+        rill_val_t lo, rill_val_t hi,
+        struct rill_pairs *out);
+
+// Returns a new set of pairs or NULL on failure.
 struct rill_pairs *rill_query_all(
     const struct rill_query *query, enum rill_col col);
 
+// Merges the stores of the query on the fly to iterate over the pairs of a
+// column in sorted order without duplicates. A nil pair marks the end of the
+// iteration. The query must outlive the iterator. Column b of stores written
+// without it is inverted in passes, each a full pass over their column a, which
+// share a budget of roughly 1M pairs across those stores with a floor of 16K
+// pairs per store. The pairs of an attached accumulator are held in memory.
+struct rill_query_it;
+
+struct rill_query_it *rill_query_begin(
+        const struct rill_query *query, enum rill_col col);
+void rill_query_it_free(struct rill_query_it *it);
+bool rill_query_it_next(struct rill_query_it *it, struct rill_kv *kv);
+
 
 // -----------------------------------------------------------------------------
-// misc
+// shards
 // -----------------------------------------------------------------------------
 
+// A sharded database partitions its key space by hash into a fixed number of
+// shard directories which are each a regular database. Keys only live in a
+// single shard and every shard is rotated independently under its own lock.
+// The number of shards is part of the layout and can't be changed.
+
+size_t rill_shard(rill_key_t key, size_t shards);
+bool rill_shard_dir(const char *dir, size_t shard, char *out, size_t len);
+
+// Rotates every shard using up to opts->threads threads where every shard is
+// rotated on a single thread. Stats are summed over all the shards.
+bool rill_rotate_shards(
+        const char *dir, size_t shards,
+        rill_ts_t now, const struct rill_rotate_opts *opts);
+
+// Query front-end which routes key lookups to their shard and fans value
+// lookups out to every shard on up to threads threads. Batches of keys are
+// partitioned by shard and every shard is queried once for its keys.
+struct rill_shards;
+
+struct rill_shards *rill_shards_open(const char *dir, size_t shards, size_t threads);
+void rill_shards_close(struct rill_shards *shards);
+
+size_t rill_shards_len(const struct rill_shards *shards);
+struct rill_query *rill_shards_query(struct rill_shards *shards, size_t shard);
+
+struct rill_pairs *rill_shards_query_key(
+        struct rill_shards *shards, rill_key_t key, struct rill_pairs *out);
+struct rill_pairs *rill_shards_query_keys(
+        struct rill_shards *shards,
+        const rill_key_t *keys, size_t len,
+        struct rill_pairs *out);
+struct rill_pairs *rill_shards_query_vals(
+        struct rill_shards *shards,
+        const rill_val_t *vals, size_t len,
+        struct rill_pairs *out);
+struct rill_pairs *rill_shards_query_all(
+        struct rill_shards *shards, enum rill_col col);
+
+
+// -----------------------------------------------------------------------------
+// manifest
+// -----------------------------------------------------------------------------
+
+// The manifest lists the stores of a directory along with their metadata to
+// avoid scanning the directory and opening every store. It's created and
+// rewritten by rill_rotate and stores written in a directory that contains a
+// manifest are added to it once they're stamped.
+
+enum { rill_manifest_name_cap = 256 };
+
+struct rill_manifest_entry
+{
+    char file[rill_manifest_name_cap]; // relative to the directory
+    rill_ts_t ts;
+    size_t quant;
+    size_t pairs;
+    uint64_t flags;
+
+    size_t index_bytes[2];
+    size_t pairs_bytes[2];
+};
+
+struct rill_manifest
+{
+    size_t len, cap;
+    struct rill_manifest_entry data[];
+};
+
+struct rill_manifest *rill_manifest_new(size_t cap);
+void rill_manifest_free(struct rill_manifest *manifest);
+struct rill_manifest *rill_manifest_push(
+        struct rill_manifest *manifest, const struct rill_manifest_entry *entry);
+
+// Manifests are kept sorted by file name which allows logarithmic lookups.
+// Read manifests are always sorted.
+void rill_manifest_sort(struct rill_manifest *manifest);
+const struct rill_manifest_entry *rill_manifest_find(
+        const struct rill_manifest *manifest, const char *file);
+
+// Sets out to NULL and returns true if the directory has no manifest.
+bool rill_manifest_read(const char *dir, struct rill_manifest **out);
+bool rill_manifest_write(const char *dir, const struct rill_manifest *manifest);
+bool rill_manifest_add(const char *dir, const struct rill_manifest_entry *entry);
+bool rill_manifest_rm(const char *dir);
+
+// Rewrites the manifest from the stores currently in the directory. Metadata is
+// taken from known first, then from the existing manifest and stores missing
+// from both are opened.
+bool rill_manifest_rebuild(const char *dir, const struct rill_manifest *known);
+
+void rill_store_manifest_entry(
+        const struct rill_store *store, struct rill_manifest_entry *entry);
+
+
+// -----------------------------------------------------------------------------
+// stores
+// -----------------------------------------------------------------------------
+
+// Set of the stores of a directory sorted by decreasing ts. Stores listed in
+// the manifest are opened lazily on first access while the stores of a
+// directory without a manifest are all opened upfront.
+
+struct rill_stores;
+
+struct rill_stores *rill_stores_open(const char *dir);
+void rill_stores_close(struct rill_stores *stores);
+
+size_t rill_stores_len(const struct rill_stores *stores);
+const struct rill_manifest_entry *rill_stores_entry(
+        const struct rill_stores *stores, size_t i);
+
+// Returns NULL with rill_errno set if the store can't be opened. A store that
+// was removed by a concurrent rotation fails with ENOENT and its pairs are then
+// in a store that the set doesn't list so the set must be reopened to see them.
+// Safe to call concurrently.
+struct rill_store *rill_stores_get(struct rill_stores *stores, size_t i);
+
+// Transfers the ownership of the store to the caller.
+struct rill_store *rill_stores_take(struct rill_stores *stores, size_t i);
+
+// The window of a store is the quant that contains its ts. Stores in [first,
+// last) contain every store whose window overlaps [begin, end) but can also
+// contain stores close to the range that don't. rill_stores_overlap filters
+// those out.
+void rill_stores_range(
+        const struct rill_stores *stores,
+        rill_ts_t begin, rill_ts_t end,
+        size_t *first, size_t *last);
+
+bool rill_stores_overlap(
+        const struct rill_stores *stores, size_t i,
+        rill_ts_t begin, rill_ts_t end);
+
+// Opens up to cap stores of the directory into list, most recent first, and
+// returns how many were opened. Stores that can't be opened are skipped. Unlike
+// rill_stores_open every store is opened upfront.
 size_t rill_scan_dir(const char *dir, struct rill_store **list, size_t cap);
@@ -53,6 +53,7 @@ int main(int argc, char **argv)
         printf("quant:       %lu\n", rill_store_quant(store));
         printf("keys data a: %zu\n", rill_store_keys_count(store, rill_col_a));
         printf("keys data b: %zu\n", rill_store_keys_count(store, rill_col_b));
+        printf("col b:       %s\n", rill_store_has_col(store, rill_col_b) ? "yes" : "no");
         printf("pairs:       %lu\n", rill_store_pairs(store));
         printf("index a len: %zu\n", rill_store_index_len(store, rill_col_a));
         printf("index b len: %zu\n", rill_store_index_len(store, rill_col_b));
@@ -80,6 +81,7 @@ int main(int argc, char **argv)
         struct rill_kv kv = {0};
         const enum rill_col col = a ? rill_col_a : rill_col_b;
         struct rill_store_it *it = rill_store_begin(store, col);
+        if (!it) rill_exit(1);
 
         printf("pairs %c:\n", a ? 'a' : 'b');
         while (rill_store_it_next(it, &kv)) {
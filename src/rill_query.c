@@ -22,7 +22,7 @@ bool is_file(const char *path)
 
 void usage()
 {
-    fprintf(stderr, "rill_query [-k <key>|-v <val>] <db>\n");
+    fprintf(stderr, "rill_query [-k <key>|-v <val>] [-t <threads>] [-p] <db>\n");
     exit(1);
 }
 
@@ -62,12 +62,15 @@ int main(int argc, char *argv[])
 {
     rill_key_t key = 0;
     rill_val_t val = 0;
+    struct rill_query_opts opts = {0};
 
     int opt = 0;
-    while ((opt = getopt(argc, argv, "k:v:")) != -1) {
+    while ((opt = getopt(argc, argv, "k:v:t:p")) != -1) {
         switch (opt) {
         case 'k': key = read_u64(optarg); break;
         case 'v': val = read_u64(optarg); break;
+        case 't': opts.threads = strtoul(optarg, NULL, 10); break;
+        case 'p': opts.page_in = true; break;
         default: usage(); exit(1);
         }
     }
@@ -89,7 +92,7 @@ int main(int argc, char *argv[])
         rill_store_close(store);
     }
     else {
-        struct rill_query *query = rill_query_open(db);
+        struct rill_query *query = rill_query_open_ex(db, &opts);
         if (!query) rill_exit(1);
 
         if (key) pairs = rill_query_key(query, key, pairs);
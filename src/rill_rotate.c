@@ -19,8 +19,27 @@ int main(int argc, const char **argv)
     struct timespec ts;
     (void) clock_gettime(CLOCK_REALTIME, &ts);
 
+    struct rill_rotate_stats stats = {0};
+    struct rill_rotate_opts opts = { .stats = &stats, .trash = true };
+
     printf("rotating '%s' at '%lu'\n", argv[1], ts.tv_sec);
-    if (!rill_rotate(argv[1], ts.tv_sec)) rill_exit(1);
+    if (!rill_rotate_ex(argv[1], ts.tv_sec, &opts)) rill_exit(1);
+
+    for (size_t i = 0; i < rill_rotate_tiers; ++i) {
+        const struct rill_rotate_tier *tier = &stats.tiers[i];
+        printf("quant %lu: merges=%lu, inputs=%lu, read=%lu, written=%lu\n",
+                tier->quant, tier->merges, tier->inputs,
+                tier->bytes_read, tier->bytes_written);
+    }
+    printf("stores=%lu, read=%lu, written=%lu\n",
+            stats.stores, stats.bytes_read, stats.bytes_written);
+
+    // Done outside of the rotation lock to keep the rotation short.
+    struct rill_reclaim_stats reclaim = {0};
+    if (!rill_reclaim(argv[1], &(struct rill_reclaim_opts) { .stats = &reclaim }))
+        rill_exit(1);
+    printf("reclaimed: files=%lu, bytes=%lu, busy=%lu\n",
+            reclaim.files, reclaim.bytes, reclaim.busy);
 
     return 0;
 }
@@ -5,10 +5,12 @@
 
 #include "rill.h"
 #include "utils.h"
+#include "tpool.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <stdatomic.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -18,28 +20,9 @@
 
 
 // -----------------------------------------------------------------------------
-// rotate
+// merge
 // -----------------------------------------------------------------------------
 
-static ssize_t expire(rill_ts_t now, struct rill_store **list, ssize_t len)
-{
-    if (len < 0) return len;
-    if (now < expire_secs) return len; // mostly for tests.
-
-    size_t i = 0;
-    for (; i < (size_t) len; ++i) {
-        if (rill_store_ts(list[i]) < (now - expire_secs)) break;
-    }
-
-    size_t end = i;
-    for (; i < (size_t) len; ++i) {
-        rill_store_rm(list[i]);
-        list[i] = NULL;
-    }
-
-    return end;
-}
-
 static int file_exists(const char *file)
 {
     struct stat s;
@@ -82,75 +65,189 @@ static bool file_name(
     return true;
 }
 
+static bool store_rm(struct rill_store *store, const struct rill_rotate_opts *opts)
+{
+    return opts->trash ? rill_store_trash(store) : rill_store_rm(store);
+}
+
 static struct rill_store *merge(
         const char *dir,
         rill_ts_t ts, rill_ts_t quant,
-        struct rill_store **list, size_t len)
+        struct rill_store **list, size_t len,
+        const struct rill_rotate_opts *opts)
 {
     assert(len > 0);
-    if (len == 1) {
+
+    unsigned flags = quant < opts->col_b_quant ? rill_store_col_a_only : 0;
+
+    // A single store is only rewritten if it's missing its column b.
+    if (len == 1 && (flags || rill_store_has_col(list[0], rill_col_b))) {
         struct rill_store *result = list[0];
         list[0] = NULL;
         return result;
     }
 
+    // The manifest is rebuilt once at the end of the rotation.
+    flags |= rill_store_no_manifest;
+
     char file[PATH_MAX];
     if (!file_name(dir, ts, quant, file, sizeof(file))) return NULL;
-    if (!rill_store_merge(file, ts, quant, list, len)) return NULL;
+    if (!rill_store_merge_throttle(file, ts, quant, list, len, flags, opts->throttle))
+        return NULL;
 
     for (size_t i = 0; i < len; ++i) {
-        rill_store_rm(list[i]);
+        store_rm(list[i], opts);
         list[i] = NULL;
     }
 
     return rill_store_open(file);
 }
 
-static ssize_t merge_quant(
-        const char *dir,
+static size_t entry_bytes(const struct rill_manifest_entry *entry)
+{
+    return
+        entry->index_bytes[rill_col_a] + entry->index_bytes[rill_col_b] +
+        entry->pairs_bytes[rill_col_a] + entry->pairs_bytes[rill_col_b];
+}
+
+static size_t store_bytes(const struct rill_store *store)
+{
+    struct rill_manifest_entry entry;
+    rill_store_manifest_entry(store, &entry);
+    return entry_bytes(&entry);
+}
+
+static const rill_ts_t tier_quants[rill_rotate_tiers] =
+    { hour_secs, day_secs, week_secs, month_secs };
+
+static size_t quant_tier(rill_ts_t quant)
+{
+    for (size_t i = 0; i < rill_rotate_tiers; ++i)
+        if (tier_quants[i] == quant) return i;
+    assert(false);
+    return 0;
+}
+
+
+// -----------------------------------------------------------------------------
+// plan
+// -----------------------------------------------------------------------------
+
+// Rotation is planned up front as a forest where the leaves are the existing
+// stores and every other node merges its inputs into a single store of its
+// quant. A node is executed as soon as all its inputs are available which
+// allows independent groups of every quant to be merged concurrently.
+struct node
+{
+    rill_ts_t ts, quant;
+    struct rill_store *store;
+
+    // Leaves that weren't opened yet are only opened when they're merged.
+    size_t index;
+    bool lazy;
+
+    // Estimated size of the store used to plan the merges. The bytes read and
+    // written are only filled in if the node was rewritten.
+    size_t bytes;
+    size_t bytes_read, bytes_written;
+
+    struct plan *plan;
+    struct node *parent;
+
+    size_t len;
+    struct node **inputs;
+
+    atomic_size_t pending;
+    bool ready;
+    bool failed;
+};
+
+struct plan
+{
+    const char *dir;
+    struct rill_stores *stores;
+    const struct rill_rotate_opts *opts;
+    struct tpool *pool;
+    rill_ts_t expire;
+
+    // rill_errno is thread-local so the error of the first node to fail is
+    // carried back to the thread that executes the plan.
+    atomic_bool failed;
+    struct rill_error error;
+
+    size_t len, edges_len;
+    struct node *nodes;
+    struct node **edges;
+};
+
+static struct node *plan_node(
+        struct plan *plan,
+        rill_ts_t ts, rill_ts_t quant,
+        struct node **inputs, size_t len)
+{
+    struct node *node = &plan->nodes[plan->len++];
+    *node = (struct node) {
+        .ts = ts,
+        .quant = quant,
+        .plan = plan,
+        .len = len,
+        .inputs = &plan->edges[plan->edges_len],
+    };
+    plan->edges_len += len;
+
+    size_t pending = 0;
+    for (size_t i = 0; i < len; ++i) {
+        node->inputs[i] = inputs[i];
+        node->bytes += inputs[i]->bytes;
+        inputs[i]->parent = node;
+        if (inputs[i]->len) pending++;
+    }
+    atomic_init(&node->pending, pending);
+
+    return node;
+}
+
+static bool plan_skip(
+        struct plan *plan, rill_ts_t quant, struct node **list, size_t len)
+{
+    if (plan->opts->compaction != rill_compaction_skip_small) return false;
+    if (quant == month_secs) return false;
+
+    size_t bytes = 0;
+    for (size_t i = 0; i < len; ++i) bytes += list[i]->bytes;
+    return bytes < plan->opts->min_bytes;
+}
+
+// Same grouping as a serial rotation would do on the result of the previous
+// quant. Nodes in the quant represented by now are dropped as we're still
+// filling in this quant. Additionally, if it's in our current quant then it
+// will also be in all bigger quants so we can just forget these nodes for the
+// rest of the rotation. Groups that are skipped are carried over as is.
+static size_t plan_quant(
+        struct plan *plan,
         rill_ts_t now, rill_ts_t quant,
-        struct rill_store **list, ssize_t len)
+        struct node **list, size_t len)
 {
     if (len <= 1) return len;
 
     size_t out_len = 0;
-    struct rill_store *out[(size_t) len];
-
     size_t start = 0;
-    rill_ts_t current_quant = rill_store_ts(list[0]) / quant;
+    rill_ts_t current_quant = list[0]->ts / quant;
 
-    for (size_t i = 0; i < (size_t) len; i++) {
+    for (size_t i = 0; i < len; i++) {
         size_t end = i + 1;
-        assert(i >= start);
-        assert(end > start);
-
-        size_t next_ts = i + 1 != (size_t) len ? rill_store_ts(list[i + 1]) : -1UL;
-
-        // Useful for debugging
-        /* printf("[%lu,%lu] file=%s, now=%lu(%lu), ts=%lu(%lu), next=%lu(%lu), earliest=%lu(%lu)\n", */
-        /*         quant, i, rill_store_file(list[i]), now, now / quant, */
-        /*         rill_store_ts(list[i]), rill_store_ts(list[i]) / quant, */
-        /*         i + 1 != (size_t) len ? rill_store_ts(list[i + 1]) : 0, */
-        /*         i + 1 != (size_t) len ? rill_store_ts(list[i + 1]) / quant : 0, */
-        /*         rill_store_ts(list[start]), rill_store_ts(list[start]) / quant); */
-
+        size_t next_ts = i + 1 != len ? list[i + 1]->ts : -1UL;
         if (next_ts / quant == current_quant) continue;
 
-        rill_ts_t earliest_ts = rill_store_ts(list[start]);
+        rill_ts_t earliest_ts = list[start]->ts;
         if (earliest_ts / quant != now / quant) {
-            struct rill_store *store = merge(dir, earliest_ts, quant, list + start, end - start);
-            if (!store) goto fail;
-            out[out_len++] = store;
-        }
-
-        // if a file is in the quant represented by now then we don't want to
-        // merge it as we're still filling in this quant. Additionally, if it's
-        // in our current quant then it will also be in all bigger quants so we
-        // can just forget these files for the rest of the rotation.
-        else {
-            for (size_t j = start; j < end; ++j) {
-                rill_store_close(list[j]);
-                list[j] = NULL;
+            // Writing to out_len is safe as it never goes past start.
+            if (plan_skip(plan, quant, list + start, end - start)) {
+                for (size_t j = start; j < end; ++j) list[out_len++] = list[j];
+            }
+            else {
+                list[out_len++] =
+                    plan_node(plan, earliest_ts, quant, list + start, end - start);
             }
         }
 
@@ -158,28 +255,254 @@ static ssize_t merge_quant(
         start = i + 1;
     }
 
-    for (size_t i = 0; i < (size_t) len; ++i) assert(!list[i]);
-    memcpy(list, out, out_len * sizeof(out[0]));
     return out_len;
+}
 
-  fail:
-    for (size_t i = 0; i < out_len; ++i)
-        rill_store_close(out[i]);
+// Smallest quant whose window contains both ts.
+static rill_ts_t plan_span(rill_ts_t a, rill_ts_t b)
+{
+    for (size_t i = 0; i < rill_rotate_tiers; ++i) {
+        if (a / tier_quants[i] == b / tier_quants[i]) return tier_quants[i];
+    }
+    return month_secs;
+}
 
-    return -1;
+// Size-tiered grouping which merges runs of adjacent stores of similar sizes.
+// Only adjacent stores are merged to keep the ts ranges of the stores disjoint
+// and every run is contained within a month so that the month quant can still
+// be used for expiration. Passes are repeated until no runs are left which can
+// merge the output of the previous pass.
+static size_t plan_size(
+        struct plan *plan, rill_ts_t now, struct node **list, size_t len)
+{
+    size_t fanout = plan->opts->fanout ? plan->opts->fanout : 4;
+    size_t ratio = plan->opts->size_ratio ? plan->opts->size_ratio : 4;
+    if (fanout < 2) fanout = 2;
+
+    bool merged;
+    do {
+        merged = false;
+
+        size_t out_len = 0, start = 0;
+        size_t min = 0, max = 0;
+
+        for (size_t i = 0; i < len; ++i) {
+            struct node *node = list[i];
+
+            // The current hour is still being filled by the accumulators.
+            bool eligible = node->ts / hour_secs != now / hour_secs;
+
+            if (start < i) {
+                size_t lo = node->bytes < min ? node->bytes : min;
+                size_t hi = node->bytes > max ? node->bytes : max;
+                bool extend = eligible &&
+                    node->ts / month_secs == list[start]->ts / month_secs &&
+                    hi <= lo * ratio;
+
+                if (extend) { min = lo; max = hi; }
+                else {
+                    for (size_t j = start; j < i; ++j) list[out_len++] = list[j];
+                    start = i;
+                }
+            }
+
+            if (!eligible) {
+                list[out_len++] = node;
+                start = i + 1;
+                continue;
+            }
+
+            if (start == i) min = max = node->bytes;
+            if (i + 1 - start < fanout) continue;
+
+            rill_ts_t ts = list[start]->ts;
+            rill_ts_t quant = plan_span(ts, node->ts);
+            list[out_len++] = plan_node(plan, ts, quant, list + start, i + 1 - start);
+
+            start = i + 1;
+            merged = true;
+        }
+
+        for (size_t j = start; j < len; ++j) list[out_len++] = list[j];
+        len = out_len;
+
+    } while (merged);
+
+    return plan_quant(plan, now, month_secs, list, len);
 }
 
-static int store_cmp(const void *l, const void *r)
+static bool node_open(struct plan *plan, struct node *node)
 {
-    const struct rill_store *const *lhs = l;
-    const struct rill_store *const *rhs = r;
+    if (!node->lazy) return true;
 
-    // earliest (biggest) to oldest (smallest)
-    if (rill_store_ts(*lhs) < rill_store_ts(*rhs)) return +1;
-    if (rill_store_ts(*lhs) > rill_store_ts(*rhs)) return -1;
-    return 0;
+    node->store = rill_stores_take(plan->stores, node->index);
+    node->lazy = false;
+    return node->store;
+}
+
+static void plan_run(void *data)
+{
+    struct node *node = data;
+    struct plan *plan = node->plan;
+
+    // The priorities can't be undone by an unprivileged thread so they're left
+    // off the caller's thread when the pool executes the merge inline.
+    if (plan->opts->throttle && tpool_worker())
+        (void) rill_throttle_apply(plan->opts->throttle);
+
+    struct rill_store *list[node->len];
+    for (size_t i = 0; i < node->len; ++i) {
+        struct node *input = node->inputs[i];
+        if (input->failed || !node_open(plan, input)) node->failed = true;
+        list[i] = input->store;
+    }
+
+    if (!node->failed) {
+        size_t bytes = 0;
+        for (size_t i = 0; i < node->len; ++i) bytes += store_bytes(list[i]);
+        struct rill_store *first = list[0];
+
+        node->store = merge(
+                plan->dir, node->ts, node->quant, list, node->len, plan->opts);
+        if (!node->store) node->failed = true;
+
+        // A single store that didn't need to be rewritten is handed back.
+        else if (node->store != first) {
+            node->bytes_read = bytes;
+            node->bytes_written = store_bytes(node->store);
+        }
+
+        for (size_t i = 0; i < node->len; ++i)
+            node->inputs[i]->store = list[i];
+    }
+
+    if (node->failed && !atomic_exchange(&plan->failed, true))
+        plan->error = rill_errno;
+
+    struct node *parent = node->parent;
+    if (parent && atomic_fetch_sub(&parent->pending, 1) == 1)
+        tpool_submit(plan->pool, plan_run, parent);
 }
 
+static bool plan_exec(struct plan *plan)
+{
+    // Executing a node can trigger the execution of its parent so the ready
+    // nodes must be identified before anything is submitted.
+    for (size_t i = 0; i < plan->len; ++i) {
+        struct node *node = &plan->nodes[i];
+        node->ready = node->len && !atomic_load(&node->pending);
+    }
+
+    for (size_t i = 0; i < plan->len; ++i) {
+        if (plan->nodes[i].ready)
+            tpool_submit(plan->pool, plan_run, &plan->nodes[i]);
+    }
+
+    tpool_wait(plan->pool);
+    if (!atomic_load(&plan->failed)) return true;
+
+    rill_errno = plan->error;
+    return false;
+}
+
+static void plan_expire(
+        struct plan *plan, rill_ts_t now, struct node **list, size_t *len)
+{
+    if (now < plan->expire) return; // mostly for tests.
+
+    size_t i = 0;
+    for (; i < *len; ++i) {
+        if (list[i]->ts < (now - plan->expire)) break;
+    }
+
+    for (size_t j = i; j < *len; ++j) {
+        struct node *node = list[j];
+
+        if (node->store) store_rm(node->store, plan->opts);
+        else {
+            const struct rill_manifest_entry *entry =
+                rill_stores_entry(plan->stores, node->index);
+
+            char file[PATH_MAX];
+            snprintf(file, sizeof(file), "%s/%s", plan->dir, entry->file);
+            if (plan->opts->trash) trash_file(file);
+            else if (unlink(file) == -1) rill_fail_errno("unable to unlink '%s'", file);
+        }
+
+        node->store = NULL;
+        node->lazy = false;
+    }
+
+    *len = i;
+}
+
+// The ts of the stores is all that's needed to plan the rotation so stores that
+// weren't opened by the store set are only opened when they're merged. The set
+// is already sorted from earliest to oldest.
+static void plan_leaves(struct plan *plan, struct node **list)
+{
+    for (size_t i = 0; i < rill_stores_len(plan->stores); ++i) {
+        struct node *node = &plan->nodes[plan->len++];
+        const struct rill_manifest_entry *entry = rill_stores_entry(plan->stores, i);
+        *node = (struct node) {
+            .ts = entry->ts,
+            .plan = plan,
+            .index = i,
+            .lazy = true,
+            .bytes = entry_bytes(entry),
+        };
+        list[i] = node;
+    }
+}
+
+static struct rill_manifest *plan_manifest(struct plan *plan)
+{
+    struct rill_manifest *manifest = rill_manifest_new(plan->len);
+    if (!manifest) return NULL;
+
+    for (size_t i = 0; i < plan->len; ++i) {
+        struct node *node = &plan->nodes[i];
+
+        struct rill_manifest_entry entry;
+        if (node->store) rill_store_manifest_entry(node->store, &entry);
+        else if (node->lazy) entry = *rill_stores_entry(plan->stores, node->index);
+        else continue;
+
+        manifest = rill_manifest_push(manifest, &entry);
+        assert(manifest); // reserved up front
+    }
+
+    rill_manifest_sort(manifest);
+    return manifest;
+}
+
+static void plan_stats(struct plan *plan, struct rill_rotate_stats *stats)
+{
+    *stats = (struct rill_rotate_stats) {0};
+    for (size_t i = 0; i < rill_rotate_tiers; ++i)
+        stats->tiers[i].quant = tier_quants[i];
+
+    for (size_t i = 0; i < plan->len; ++i) {
+        struct node *node = &plan->nodes[i];
+        if (node->store || node->lazy) stats->stores++;
+        if (!node->bytes_written) continue;
+
+        struct rill_rotate_tier *tier = &stats->tiers[quant_tier(node->quant)];
+        tier->merges++;
+        tier->inputs += node->len;
+        tier->bytes_read += node->bytes_read;
+        tier->bytes_written += node->bytes_written;
+
+        stats->bytes_read += node->bytes_read;
+        stats->bytes_written += node->bytes_written;
+    }
+}
+
+
+// -----------------------------------------------------------------------------
+// rotate
+// -----------------------------------------------------------------------------
+
 // Note that an flock is released on process termination on linux. This means
 // that we don't have to worry about cleaning up in case of segfaults or signal
 // termination.
@@ -209,27 +532,92 @@ static void unlock(int fd)
 }
 
 bool rill_rotate(const char *dir, rill_ts_t now)
+{
+    return rill_rotate_ex(dir, now, &(struct rill_rotate_opts) {0});
+}
+
+bool rill_rotate_ex(
+        const char *dir, rill_ts_t now, const struct rill_rotate_opts *opts)
 {
     int fd = lock(dir);
     if (!fd) return true;
     if (fd == -1) return false;
 
-    enum { cap = 1024 };
-    struct rill_store *list[cap];
-    size_t list_len = rill_scan_dir(dir, list, cap);
-    qsort(list, list_len, sizeof(list[0]), store_cmp);
+    bool ret = false;
+    enum { quants = 4 };
+
+    struct plan plan = {
+        .dir = dir,
+        .opts = opts,
+        .expire = opts->expire_secs ? opts->expire_secs : expire_secs,
+    };
+    atomic_init(&plan.failed, false);
+
+    plan.stores = rill_stores_open(dir);
+    if (!plan.stores) goto fail_stores;
+
+    size_t len = rill_stores_len(plan.stores);
+    plan.nodes = calloc(len * (quants + 1) + 1, sizeof(*plan.nodes));
+    plan.edges = calloc(len * quants + 1, sizeof(*plan.edges));
+    struct node **nodes = calloc(len + 1, sizeof(*nodes));
+    if (!plan.nodes || !plan.edges || !nodes) {
+        rill_fail("unable to allocate rotation plan for '%s'", dir);
+        goto fail_plan;
+    }
+
+    plan.pool = tpool_new(opts->threads);
+    if (!plan.pool) goto fail_pool;
+
+    plan_leaves(&plan, nodes);
+    plan_expire(&plan, now, nodes, &len);
+
+    switch (opts->compaction) {
+    case rill_compaction_time:
+    case rill_compaction_skip_small:
+        for (size_t i = 0; i < rill_rotate_tiers; ++i)
+            len = plan_quant(&plan, now, tier_quants[i], nodes, len);
+        break;
+    case rill_compaction_size:
+        len = plan_size(&plan, now, nodes, len);
+        break;
+    default: assert(false);
+    }
+
+    struct rill_throttle_stats throttle_start = {0}, throttle_end = {0};
+    if (opts->throttle) rill_throttle_stats(opts->throttle, &throttle_start);
+
+    ret = plan_exec(&plan);
 
-    ssize_t len = list_len;
-    len = expire(now, list, len);
-    len = merge_quant(dir, now, hour_secs, list, len);
-    len = merge_quant(dir, now, day_secs, list, len);
-    len = merge_quant(dir, now, week_secs, list, len);
-    len = merge_quant(dir, now, month_secs, list, len);
+    if (opts->throttle) rill_throttle_stats(opts->throttle, &throttle_end);
+    if (opts->stats) {
+        plan_stats(&plan, opts->stats);
+        opts->stats->throttled_ns =
+            throttle_end.throttled_ns - throttle_start.throttled_ns;
+        opts->stats->paused_ns = throttle_end.paused_ns - throttle_start.paused_ns;
+    }
 
-    for (size_t i = 0; i < list_len; ++i) {
-        if (list[i]) rill_store_close(list[i]);
+    // A manifest that can't be trusted is removed which makes readers fall
+    // back to scanning the directory.
+    struct rill_manifest *known = ret ? plan_manifest(&plan) : NULL;
+    if (!known) {
+        struct rill_error error = rill_errno;
+        rill_manifest_rm(dir);
+        rill_errno = error;
     }
+    else if (!rill_manifest_rebuild(dir, known)) rill_manifest_rm(dir);
+    rill_manifest_free(known);
 
+    tpool_free(plan.pool);
+  fail_pool:
+    for (size_t i = 0; i < plan.len; ++i) {
+        if (plan.nodes[i].store) rill_store_close(plan.nodes[i].store);
+    }
+  fail_plan:
+    free(nodes);
+    free(plan.nodes);
+    free(plan.edges);
+    rill_stores_close(plan.stores);
+  fail_stores:
     unlock(fd);
-    return len >= 0;
+    return ret;
 }
@@ -0,0 +1,396 @@
+/* shards.c
+   agent (agent@local), 19 Oct 2026
+   FreeBSD-style copyright and disclaimer apply
+*/
+
+#include "rill.h"
+#include "utils.h"
+#include "tpool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <unistd.h>
+
+
+// -----------------------------------------------------------------------------
+// shard
+// -----------------------------------------------------------------------------
+
+// Finalizer of murmur3 which spreads sequential keys evenly over the shards.
+// It determines where keys are stored on disk and must therefore never change.
+size_t rill_shard(rill_key_t key, size_t shards)
+{
+    assert(shards);
+
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdUL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53UL;
+    key ^= key >> 33;
+
+    return key % shards;
+}
+
+bool rill_shard_dir(const char *dir, size_t shard, char *out, size_t len)
+{
+    if (snprintf(out, len, "%s/shard-%03lu", dir, shard) < (int) len) return true;
+
+    rill_fail("shard path too long for '%s'", dir);
+    return false;
+}
+
+
+// -----------------------------------------------------------------------------
+// rotate
+// -----------------------------------------------------------------------------
+
+struct rotate_task
+{
+    char dir[PATH_MAX];
+    rill_ts_t now;
+    struct rill_rotate_opts opts;
+    struct rill_rotate_stats stats;
+
+    bool ok;
+    struct rill_error error;
+};
+
+static void rotate_run(void *data)
+{
+    struct rotate_task *task = data;
+
+    task->ok = rill_rotate_ex(task->dir, task->now, &task->opts);
+    if (!task->ok) task->error = rill_errno;
+}
+
+static void rotate_stats_add(
+        struct rill_rotate_stats *stats, const struct rill_rotate_stats *shard)
+{
+    for (size_t i = 0; i < rill_rotate_tiers; ++i) {
+        if (shard->tiers[i].quant) stats->tiers[i].quant = shard->tiers[i].quant;
+        stats->tiers[i].merges += shard->tiers[i].merges;
+        stats->tiers[i].inputs += shard->tiers[i].inputs;
+        stats->tiers[i].bytes_read += shard->tiers[i].bytes_read;
+        stats->tiers[i].bytes_written += shard->tiers[i].bytes_written;
+    }
+
+    stats->bytes_read += shard->bytes_read;
+    stats->bytes_written += shard->bytes_written;
+    stats->stores += shard->stores;
+    stats->throttled_ns += shard->throttled_ns;
+    stats->paused_ns += shard->paused_ns;
+}
+
+bool rill_rotate_shards(
+        const char *dir, size_t shards,
+        rill_ts_t now, const struct rill_rotate_opts *opts)
+{
+    struct rotate_task *tasks = calloc(shards, sizeof(*tasks));
+    if (!tasks) {
+        rill_fail("unable to allocate '%lu' shard rotations for '%s'", shards, dir);
+        goto fail_alloc;
+    }
+
+    struct tpool *pool = tpool_new(opts->threads);
+    if (!pool) goto fail_pool;
+
+    bool ret = true;
+    for (size_t i = 0; i < shards; ++i) {
+        struct rotate_task *task = &tasks[i];
+        task->ok = true;
+
+        if (!rill_shard_dir(dir, i, task->dir, sizeof(task->dir))) {
+            task->ok = false;
+            task->error = rill_errno;
+            continue;
+        }
+
+        // Shards are only created on their first write.
+        if (access(task->dir, F_OK) == -1) continue;
+
+        task->now = now;
+        task->opts = *opts;
+        task->opts.threads = 0;
+        task->opts.stats = &task->stats;
+        tpool_submit(pool, rotate_run, task);
+    }
+    tpool_wait(pool);
+
+    if (opts->stats) *opts->stats = (struct rill_rotate_stats) {0};
+    for (size_t i = 0; i < shards; ++i) {
+        if (opts->stats) rotate_stats_add(opts->stats, &tasks[i].stats);
+        if (!tasks[i].ok && ret) {
+            rill_errno = tasks[i].error;
+            ret = false;
+        }
+    }
+
+    tpool_free(pool);
+    free(tasks);
+    return ret;
+
+  fail_pool:
+    free(tasks);
+  fail_alloc:
+    return false;
+}
+
+
+// -----------------------------------------------------------------------------
+// shards
+// -----------------------------------------------------------------------------
+
+struct rill_shards
+{
+    struct tpool *pool;
+
+    size_t len;
+    struct rill_query *queries[];
+};
+
+struct rill_shards *rill_shards_open(const char *dir, size_t len, size_t threads)
+{
+    assert(len);
+
+    struct rill_shards *shards =
+        calloc(1, sizeof(*shards) + len * sizeof(shards->queries[0]));
+    if (!shards) {
+        rill_fail("unable to allocate '%lu' shards for '%s'", len, dir);
+        goto fail_alloc;
+    }
+
+    shards->pool = tpool_new(threads);
+    if (!shards->pool) goto fail_pool;
+
+    for (; shards->len < len; shards->len++) {
+        char shard[PATH_MAX];
+        if (!rill_shard_dir(dir, shards->len, shard, sizeof(shard))) goto fail_query;
+
+        shards->queries[shards->len] = rill_query_open(shard);
+        if (!shards->queries[shards->len]) goto fail_query;
+    }
+
+    return shards;
+
+  fail_query:
+    for (size_t i = 0; i < shards->len; ++i)
+        rill_query_close(shards->queries[i]);
+    tpool_free(shards->pool);
+  fail_pool:
+    free(shards);
+  fail_alloc:
+    return NULL;
+}
+
+void rill_shards_close(struct rill_shards *shards)
+{
+    if (!shards) return;
+
+    for (size_t i = 0; i < shards->len; ++i)
+        rill_query_close(shards->queries[i]);
+
+    tpool_free(shards->pool);
+    free(shards);
+}
+
+size_t rill_shards_len(const struct rill_shards *shards)
+{
+    return shards->len;
+}
+
+struct rill_query *rill_shards_query(struct rill_shards *shards, size_t shard)
+{
+    assert(shard < shards->len);
+    return shards->queries[shard];
+}
+
+struct rill_pairs *rill_shards_query_key(
+        struct rill_shards *shards, rill_key_t key, struct rill_pairs *out)
+{
+    struct rill_query *query = shards->queries[rill_shard(key, shards->len)];
+    return rill_query_key(query, key, out);
+}
+
+
+// -----------------------------------------------------------------------------
+// fan-out
+// -----------------------------------------------------------------------------
+
+struct fanout_task
+{
+    struct rill_query *query;
+
+    rill_key_t *keys;
+    const rill_val_t *vals;
+    size_t len;
+    enum rill_col col;
+
+    struct rill_pairs *result;
+    struct rill_error error;
+};
+
+static void fanout_keys(void *data)
+{
+    struct fanout_task *task = data;
+
+    struct rill_pairs *out = rill_pairs_new(task->len);
+    if (out) task->result = rill_query_keys(task->query, task->keys, task->len, out);
+    if (!task->result) {
+        task->error = rill_errno;
+        rill_pairs_free(out);
+    }
+}
+
+static void fanout_vals(void *data)
+{
+    struct fanout_task *task = data;
+
+    struct rill_pairs *out = rill_pairs_new(task->len);
+    if (out) task->result = rill_query_vals(task->query, task->vals, task->len, out);
+    if (!task->result) {
+        task->error = rill_errno;
+        rill_pairs_free(out);
+    }
+}
+
+static void fanout_all(void *data)
+{
+    struct fanout_task *task = data;
+
+    task->result = rill_query_all(task->query, task->col);
+    if (!task->result) task->error = rill_errno;
+}
+
+static struct fanout_task *fanout_tasks(
+        struct rill_shards *shards, const struct fanout_task *proto)
+{
+    struct fanout_task *tasks = calloc(shards->len, sizeof(*tasks));
+    if (!tasks) {
+        rill_fail("unable to allocate '%lu' shard queries", shards->len);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < shards->len; ++i) {
+        tasks[i] = *proto;
+        tasks[i].query = shards->queries[i];
+    }
+    return tasks;
+}
+
+// Shards never share keys so their results are only concatenated and sorted.
+// The results are only appended to out once every shard succeeded which leaves
+// out to the caller on failure.
+static struct rill_pairs *fanout(
+        struct rill_shards *shards,
+        tpool_fn_t fn, struct fanout_task *tasks,
+        struct rill_pairs *out)
+{
+    for (size_t i = 0; i < shards->len; ++i)
+        tpool_submit(shards->pool, fn, &tasks[i]);
+    tpool_wait(shards->pool);
+
+    size_t len = out->len;
+    struct rill_pairs *result = out;
+    for (size_t i = 0; i < shards->len; ++i) {
+        if (tasks[i].result) len += tasks[i].result->len;
+        else if (result) {
+            rill_errno = tasks[i].error;
+            result = NULL;
+        }
+    }
+
+    if (result) result = rill_pairs_reserve(result, len);
+
+    for (size_t i = 0; i < shards->len; ++i) {
+        struct fanout_task *task = &tasks[i];
+        if (!task->result) continue;
+
+        if (result) {
+            memcpy(result->data + result->len, task->result->data,
+                    task->result->len * sizeof(task->result->data[0]));
+            result->len += task->result->len;
+        }
+        rill_pairs_free(task->result);
+    }
+
+    free(tasks);
+    if (result) rill_pairs_compact(result);
+    return result;
+}
+
+// Keys are partitioned by shard so that every shard is queried once for all of
+// its keys.
+struct rill_pairs *rill_shards_query_keys(
+        struct rill_shards *shards,
+        const rill_key_t *keys, size_t len,
+        struct rill_pairs *out)
+{
+    if (!len) return out;
+
+    struct fanout_task *tasks = fanout_tasks(shards, &(struct fanout_task) {0});
+    if (!tasks) goto fail_tasks;
+
+    rill_key_t *split = malloc(len * sizeof(*split));
+    if (!split) {
+        rill_fail("unable to allocate '%lu' shard keys", len);
+        goto fail_split;
+    }
+
+    for (size_t i = 0; i < len; ++i)
+        tasks[rill_shard(keys[i], shards->len)].len++;
+
+    for (size_t i = 0, off = 0; i < shards->len; ++i) {
+        tasks[i].keys = split + off;
+        off += tasks[i].len;
+        tasks[i].len = 0;
+    }
+
+    for (size_t i = 0; i < len; ++i) {
+        struct fanout_task *task = &tasks[rill_shard(keys[i], shards->len)];
+        task->keys[task->len++] = keys[i];
+    }
+
+    struct rill_pairs *result = fanout(shards, fanout_keys, tasks, out);
+    free(split);
+    return result;
+
+  fail_split:
+    free(tasks);
+  fail_tasks:
+    return NULL;
+}
+
+struct rill_pairs *rill_shards_query_vals(
+        struct rill_shards *shards,
+        const rill_val_t *vals, size_t len,
+        struct rill_pairs *out)
+{
+    if (!len) return out;
+
+    struct fanout_task proto = { .vals = vals, .len = len };
+    struct fanout_task *tasks = fanout_tasks(shards, &proto);
+    if (!tasks) return NULL;
+
+    return fanout(shards, fanout_vals, tasks, out);
+}
+
+struct rill_pairs *rill_shards_query_all(
+        struct rill_shards *shards, enum rill_col col)
+{
+    struct fanout_task proto = { .col = col };
+    struct fanout_task *tasks = fanout_tasks(shards, &proto);
+    if (!tasks) return NULL;
+
+    struct rill_pairs *out = rill_pairs_new(1);
+    if (!out) {
+        free(tasks);
+        return NULL;
+    }
+
+    struct rill_pairs *result = fanout(shards, fanout_all, tasks, out);
+    if (!result) rill_pairs_free(out);
+    return result;
+}
@@ -17,6 +17,7 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/file.h>
 #include <sys/types.h>
 
 
@@ -56,7 +57,8 @@ struct rill_packed header
     uint64_t index_a_off;
     uint64_t index_b_off;
 
-    uint64_t reserved[2];
+    uint64_t flags;
+    uint64_t reserved[1];
 
     uint64_t stamp;
 };
@@ -148,20 +150,79 @@ static struct decoder store_decoder(
     return store_decoder_at(store, 0, 0, column);
 }
 
+static bool store_has_col_b(const struct rill_store *store)
+{
+    return !(store->head->flags & rill_store_col_a_only);
+}
+
+
 // -----------------------------------------------------------------------------
 // vma
 // -----------------------------------------------------------------------------
 
+// Advice is only a hint that doesn't change the outcome of an operation so its
+// failures are ignored rather than left in rill_errno where they would be
+// mistaken for the cause of a later failure.
+
 static inline void vma_will_need(struct rill_store *store)
 {
-    if (madvise(store->vma, store->vma_len, MADV_WILLNEED) == -1)
-        rill_fail("unable to madvise '%s'", store->file);
+    (void) madvise(store->vma, store->vma_len, MADV_WILLNEED);
 }
 
 static inline void vma_dont_need(struct rill_store *store)
 {
-    if (madvise(store->vma, store->vma_len, MADV_DONTNEED) == -1)
-        rill_fail("unable to madvise '%s'", store->file);
+    (void) madvise(store->vma, store->vma_len, MADV_DONTNEED);
+}
+
+// Sections aren't page aligned so the range is extended to the enclosing pages.
+static void vma_advise(struct rill_store *store, size_t start, size_t end, int advice)
+{
+    start &= ~(page_len - 1);
+    end = to_vma_len(end);
+    if (end > store->vma_len) end = store->vma_len;
+    if (start >= end) return;
+
+    (void) madvise(store->vma + start, end - start, advice);
+}
+
+static int vma_advice(enum rill_advice advice)
+{
+    switch (advice) {
+    case rill_advice_random: return MADV_RANDOM;
+    case rill_advice_sequential: return MADV_SEQUENTIAL;
+    case rill_advice_normal: default: return MADV_NORMAL;
+    }
+}
+
+// Kernels that predate MADV_POPULATE_READ only get a readahead of the section
+// which still avoids the major faults but not the minor ones.
+static void vma_populate(struct rill_store *store, size_t len)
+{
+#ifdef MADV_POPULATE_READ
+    size_t end = to_vma_len(len);
+    if (end > store->vma_len) end = store->vma_len;
+
+    if (!madvise(store->vma, end, MADV_POPULATE_READ)) return;
+    if (errno != EINVAL) return;
+#endif
+
+    vma_advise(store, 0, len, MADV_WILLNEED);
+}
+
+// Failures are ignored as the store remains usable with the default policy.
+static void vma_apply(struct rill_store *store, const struct rill_store_opts *opts)
+{
+    size_t index_end = store->head->data_a_off;
+
+    if (opts->populate_index) vma_populate(store, index_end);
+    if (opts->huge_pages) vma_advise(store, 0, store->vma_len, MADV_HUGEPAGE);
+
+    // The index advice is applied last so that it wins on the page shared
+    // with the data section.
+    if (opts->data_advice != rill_advice_normal)
+        vma_advise(store, index_end, store->vma_len, vma_advice(opts->data_advice));
+    if (opts->index_advice != rill_advice_normal)
+        vma_advise(store, 0, index_end, vma_advice(opts->index_advice));
 }
 
 
@@ -177,6 +238,12 @@ static bool is_supported_version(uint32_t version)
 }
 
 struct rill_store *rill_store_open(const char *file)
+{
+    return rill_store_open_ex(file, &(struct rill_store_opts) {0});
+}
+
+struct rill_store *rill_store_open_ex(
+        const char *file, const struct rill_store_opts *opts)
 {
     struct rill_store *store = calloc(1, sizeof(*store));
     if (!store) {
@@ -190,8 +257,24 @@ struct rill_store *rill_store_open(const char *file)
         goto fail_alloc_file;
     }
 
+    store->fd = open(file, O_RDONLY);
+    if (store->fd == -1) {
+        rill_fail_errno("unable to open '%s'", file);
+        goto fail_open;
+    }
+
+    // Keeps rill_reclaim from truncating the file under our mapping once it's
+    // moved to the trash. Released when the fd is closed. Taken before the
+    // size is read so that a file being truncated is never mapped and reported
+    // as removed instead.
+    if (flock(store->fd, LOCK_SH | LOCK_NB) == -1) {
+        if (errno == EWOULDBLOCK) errno = ENOENT;
+        rill_fail_errno("unable to lock '%s'", file);
+        goto fail_lock;
+    }
+
     struct stat stat_ret = {0};
-    if (stat(file, &stat_ret) == -1) {
+    if (fstat(store->fd, &stat_ret) == -1) {
         rill_fail_errno("unable to stat '%s'", file);
         goto fail_stat;
     }
@@ -204,12 +287,6 @@ struct rill_store *rill_store_open(const char *file)
 
     store->vma_len = to_vma_len(len);
 
-    store->fd = open(file, O_RDONLY);
-    if (store->fd == -1) {
-        rill_fail_errno("unable to open '%s'", file);
-        goto fail_open;
-    }
-
     store->vma = mmap(NULL, store->vma_len, PROT_READ, MAP_SHARED, store->fd, 0);
     if (store->vma == MAP_FAILED) {
         rill_fail_errno("unable to mmap '%s' of len '%lu'", file, store->vma_len);
@@ -238,6 +315,7 @@ struct rill_store *rill_store_open(const char *file)
         goto fail_stamp;
     }
 
+    vma_apply(store, opts);
     return store;
 
   fail_version:
@@ -245,10 +323,11 @@ struct rill_store *rill_store_open(const char *file)
   fail_stamp:
     munmap(store->vma, store->vma_len);
   fail_mmap:
-    close(store->fd);
-  fail_open:
   fail_size:
   fail_stat:
+  fail_lock:
+    close(store->fd);
+  fail_open:
     free((char *) store->file);
   fail_alloc_file:
     free(store);
@@ -275,6 +354,14 @@ bool rill_store_rm(struct rill_store *store)
     return true;
 }
 
+bool rill_store_trash(struct rill_store *store)
+{
+    if (!trash_file(store->file)) return false;
+
+    rill_store_close(store);
+    return true;
+}
+
 
 // -----------------------------------------------------------------------------
 // writer
@@ -283,11 +370,12 @@ bool rill_store_rm(struct rill_store *store)
 static bool writer_open(
         struct rill_store *store,
         const char *file,
-        struct vals *vals,
-        struct vals *inverted_vals,
+        size_t vals,
+        size_t keys,
         size_t pairs,
         rill_ts_t ts,
-        size_t quant)
+        size_t quant,
+        unsigned flags)
 {
     store->file = file;
 
@@ -299,10 +387,10 @@ static bool writer_open(
 
     size_t len =
         sizeof(struct header) +
-        index_cap(inverted_vals->len) +
-        index_cap(vals->len) +
-        coder_cap(vals->len, pairs) +
-        coder_cap(inverted_vals->len, pairs);
+        index_cap(keys) +
+        index_cap(vals) +
+        coder_cap(vals, pairs);
+    if (!(flags & rill_store_col_a_only)) len += coder_cap(keys, pairs);
 
     if (ftruncate(store->fd, len) == -1) {
         rill_fail_errno("unable to resize '%s'", file);
@@ -324,6 +412,7 @@ static bool writer_open(
         .version = version,
         .ts = ts,
         .quant = quant,
+        .flags = flags & rill_store_col_a_only,
     };
 
     return true;
@@ -336,9 +425,59 @@ static bool writer_open(
     return false;
 }
 
-static void writer_close(
-    struct rill_store *store, size_t len)
+static void store_entry(
+        const struct rill_store *store, size_t len, struct rill_manifest_entry *entry)
+{
+    const char *name = strrchr(store->file, '/');
+    name = name ? name + 1 : store->file;
+
+    *entry = (struct rill_manifest_entry) {
+        .ts = store->head->ts,
+        .quant = store->head->quant,
+        .pairs = store->head->pairs,
+        .flags = store->head->flags,
+        .index_bytes[rill_col_a] = store->head->index_b_off - store->head->index_a_off,
+        .index_bytes[rill_col_b] = store->head->data_a_off - store->head->index_b_off,
+        .pairs_bytes[rill_col_a] = store->head->data_b_off - store->head->data_a_off,
+        .pairs_bytes[rill_col_b] = len - store->head->data_b_off,
+    };
+    snprintf(entry->file, sizeof(entry->file), "%s", name);
+}
+
+void rill_store_manifest_entry(
+        const struct rill_store *store, struct rill_manifest_entry *entry)
+{
+    store_entry(store, store->vma_len, entry);
+}
+
+// Adds the freshly stamped store to the manifest of its directory if there is
+// one. A manifest that can't be updated is removed instead so that readers fall
+// back to the directory rather than miss the store until the next rotation.
+static bool writer_manifest_add(struct rill_store *store, size_t len)
+{
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", store->file);
+
+    char *sep = strrchr(dir, '/');
+    if (sep) *sep = 0;
+    else strcpy(dir, ".");
+
+    struct rill_manifest_entry entry;
+    store_entry(store, len, &entry);
+    if (rill_manifest_add(dir, &entry)) return true;
+
+    struct rill_error error = rill_errno;
+    if (rill_manifest_rm(dir)) return true;
+
+    rill_errno = error;
+    return false;
+}
+
+static bool writer_close(
+    struct rill_store *store, size_t len, unsigned flags)
 {
+    bool ret = true;
+
     if (len) {
         assert(len <= store->vma_len);
         if (ftruncate(store->fd, len) == -1)
@@ -355,12 +494,16 @@ static void writer_close(
         store->head->stamp = stamp;
         if (fdatasync(store->fd) == -1)
             rill_fail_errno("unable to fdatasync stamp '%s'", store->file);
+
+        if (!(flags & rill_store_no_manifest))
+            ret = writer_manifest_add(store, len);
     }
     else if (unlink(store->file) == -1)
         rill_fail_errno("unable to unlink '%s'", store->file);
 
     munmap(store->vma, store->vma_len);
     close(store->fd);
+    return ret;
 }
 
 static void init_store_offsets(
@@ -382,29 +525,65 @@ static void prepare_col_b_offsets(
     store->data_b = (void *) ((uintptr_t) store->vma + store->head->data_b_off);
 }
 
+static size_t pairs_keys(const struct rill_pairs *pairs)
+{
+    size_t keys = 0;
+    for (size_t i = 0; i < pairs->len; ++i)
+        if (!i || pairs->data[i].key != pairs->data[i - 1].key) keys++;
+    return keys;
+}
+
+// Index b doubles as the dictionary of column a so it must be written even if
+// column b isn't. The offsets are meaningless in that case and are left to 0.
+static void write_vals_index(struct index *index, const struct vals *vals)
+{
+    for (size_t i = 0; i < vals->len; ++i)
+        index_put(index, vals->data[i], 0);
+}
+
 bool rill_store_write(
         const char *file,
         rill_ts_t ts,
         size_t quant,
         struct rill_pairs *pairs)
+{
+    return rill_store_write_ex(file, ts, quant, pairs, 0);
+}
+
+bool rill_store_write_ex(
+        const char *file,
+        rill_ts_t ts,
+        size_t quant,
+        struct rill_pairs *pairs,
+        unsigned flags)
 {
     rill_pairs_compact(pairs);
     if (!pairs->len) return true;
 
+    const bool col_b = !(flags & rill_store_col_a_only);
+
     struct vals *vals = vals_cols_from_pairs(pairs, rill_col_b);
     if (!vals) goto fail_vals;
-    struct vals *invert_vals = vals_cols_from_pairs(pairs, rill_col_a);
-    if (!invert_vals) goto fail_invert_vals;
+
+    size_t keys = 0;
+    struct vals *invert_vals = NULL;
+    if (col_b) {
+        invert_vals = vals_cols_from_pairs(pairs, rill_col_a);
+        if (!invert_vals) goto fail_invert_vals;
+        keys = invert_vals->len;
+    }
+    else keys = pairs_keys(pairs);
 
     struct rill_store store = {0};
-    if (!writer_open(&store, file, vals, invert_vals,
-                     pairs->len, ts, quant)) {
+    if (!writer_open(&store, file, vals->len, keys,
+                     pairs->len, ts, quant, flags)) {
         rill_fail("unable to create '%s'", file);
         goto fail_open;
     }
 
-    init_store_offsets(&store, vals->len, invert_vals->len);
+    init_store_offsets(&store, vals->len, keys);
 
+    struct encoder coder_b = {0};
     struct encoder coder_a =
         store_encoder(&store, store.index_a, vals, store.head->data_a_off);
 
@@ -414,21 +593,27 @@ bool rill_store_write(
     if (!coder_finish(&coder_a)) goto fail_encode_a;
 
     prepare_col_b_offsets(&store, &coder_a);
+    size_t len = store.head->data_b_off;
 
-    struct encoder coder_b =
-        store_encoder(&store, store.index_b, invert_vals, store.head->data_b_off);
+    if (col_b) {
+        coder_b = store_encoder(
+                &store, store.index_b, invert_vals, store.head->data_b_off);
 
-    rill_pairs_invert(pairs);
-    rill_pairs_compact(pairs); /* recompact mainly for sort */
+        rill_pairs_invert(pairs);
+        rill_pairs_compact(pairs); /* recompact mainly for sort */
 
-    for (size_t i = 0; i < pairs->len; ++i) {
-        if (!coder_encode(&coder_b, &pairs->data[i])) goto fail_encode_b;
+        for (size_t i = 0; i < pairs->len; ++i) {
+            if (!coder_encode(&coder_b, &pairs->data[i])) goto fail_encode_b;
+        }
+        if (!coder_finish(&coder_b)) goto fail_encode_b;
+
+        len += coder_off(&coder_b);
     }
-    if (!coder_finish(&coder_b)) goto fail_encode_b;
+    else write_vals_index(store.index_b, vals);
 
     store.head->pairs = coder_a.pairs;
 
-    writer_close(&store, store.head->data_b_off + coder_off(&coder_b));
+    bool ret = writer_close(&store, len, flags);
 
     coder_close(&coder_a);
     coder_close(&coder_b);
@@ -436,13 +621,13 @@ bool rill_store_write(
     free(vals);
     free(invert_vals);
 
-    return true;
+    return ret;
 
   fail_encode_b:
-    coder_close(&coder_b);
   fail_encode_a:
+    coder_close(&coder_b);
     coder_close(&coder_a);
-    writer_close(&store, 0);
+    writer_close(&store, 0, flags);
   fail_open:
     free(invert_vals);
   fail_invert_vals:
@@ -491,61 +676,258 @@ static struct vals *vals_merge_from_index(struct vals *vals, struct index *merge
 }
 
 
+// The columns of a merge are paced by starting the writeback of every chunk as
+// soon as it's encoded and charging it against the throttle. Otherwise the dirty
+// pages are left to the kernel and the msync of writer_close which writes back
+// most of the file in a single burst.
+enum { pace_chunk = 1 << 20 };
+
+struct pace
+{
+    struct rill_throttle *throttle;
+    struct rill_store *store;
+    size_t off;
+};
+
+static void pace_flush(struct pace *pace, size_t end)
+{
+    if (end <= pace->off) return;
+
+    // Only a hint so failures can be safely ignored.
+    (void) sync_file_range(pace->store->fd, pace->off, end - pace->off,
+            SYNC_FILE_RANGE_WRITE);
+
+    rill_throttle_charge(pace->throttle, end - pace->off);
+    pace->off = end;
+}
+
+static inline void pace_write(struct pace *pace, const struct encoder *coder)
+{
+    if (!pace) return;
+
+    size_t end = coder->it - (uint8_t *) pace->store->vma;
+    if (rill_likely(end - pace->off < pace_chunk)) return;
+
+    pace_flush(pace, end);
+}
+
+// The indexes are written in place as the columns are encoded so they're only
+// charged once the merge is done.
+static void pace_finish(struct pace *pace, size_t len)
+{
+    if (!pace) return;
+
+    pace_flush(pace, len);
+    rill_throttle_charge(pace->throttle, pace->store->head->data_a_off);
+}
+
+// Merges never materialize the values of their inputs. The dictionary ids of
+// every input are instead decoded in batches and remapped in bulk to the ids of
+// the merged dictionary. Both dictionaries are sorted so the remapping
+// preserves the order of the values and the ids can be compared and encoded
+// directly.
+enum { merge_batch = 256, merge_prefetch = 8 };
+
+struct merge_src
+{
+    struct decoder decoder;
+    uint64_t *remap;
+
+    size_t pos, len;
+    rill_key_t keys[merge_batch];
+    rill_val_t ids[merge_batch];
+};
+
+// Every value of the input is in the merged dictionary so the lookups are a
+// galloping search from the previous value.
+static uint64_t *merge_remap(const struct index *lookup, const struct vals *vals)
+{
+    uint64_t *remap = calloc(lookup->len + 1, sizeof(*remap));
+    if (!remap) {
+        rill_fail("unable to allocate remap of '%lu' vals", lookup->len);
+        return NULL;
+    }
+
+    size_t pos = 0;
+    for (size_t i = 0; i < lookup->len; ++i) {
+        rill_val_t val = lookup->data[i].key;
+
+        size_t hi = pos;
+        for (size_t step = 1; hi < vals->len && vals->data[hi] < val; step *= 2) {
+            pos = hi + 1;
+            hi += step;
+        }
+        if (hi > vals->len) hi = vals->len;
+
+        while (pos < hi) {
+            size_t mid = pos + (hi - pos) / 2;
+            if (vals->data[mid] < val) pos = mid + 1;
+            else hi = mid;
+        }
+
+        assert(pos < vals->len && vals->data[pos] == val);
+        remap[i] = pos + 1;
+    }
+
+    return remap;
+}
+
+static bool merge_src_fill(struct merge_src *src)
+{
+    ssize_t len = coder_decode_batch(&src->decoder, src->keys, src->ids, merge_batch);
+    if (len == -1) return false;
+
+    for (ssize_t i = 0; i < len; ++i) {
+        if (i + merge_prefetch < len)
+            __builtin_prefetch(&src->remap[src->ids[i + merge_prefetch] - 1]);
+        src->ids[i] = src->remap[src->ids[i] - 1];
+    }
+
+    src->pos = 0;
+    src->len = len;
+    return true;
+}
+
+static inline int merge_src_cmp(const struct merge_src *lhs, const struct merge_src *rhs)
+{
+    rill_key_t lhs_key = lhs->keys[lhs->pos], rhs_key = rhs->keys[rhs->pos];
+    if (lhs_key != rhs_key) return lhs_key < rhs_key ? -1 : 1;
+
+    rill_val_t lhs_id = lhs->ids[lhs->pos], rhs_id = rhs->ids[rhs->pos];
+    if (lhs_id != rhs_id) return lhs_id < rhs_id ? -1 : 1;
+
+    return 0;
+}
+
 static bool merge_with_config(
     struct encoder* coder,
     struct rill_store** list,
     size_t list_len,
-    enum rill_col col)
+    enum rill_col col,
+    const struct vals *vals,
+    struct pace *pace)
 {
-    struct rill_kv kvs[list_len];
-
-    struct decoder decoders[list_len];
+    struct merge_src *srcs = calloc(list_len, sizeof(*srcs));
+    if (!srcs) {
+        rill_fail("unable to allocate '%lu' merge inputs", list_len);
+        return false;
+    }
 
     size_t it_len = 0;
     for (size_t i = 0; i < list_len; ++i) {
         if (!list[i]) continue;
-        decoders[it_len] = store_decoder(list[i], col);
+
+        struct merge_src *src = &srcs[it_len];
+        src->decoder = store_decoder(list[i], col);
+
+        src->remap = merge_remap(src->decoder.lookup, vals);
+        if (!src->remap) goto fail;
+        src->decoder.lookup = NULL;
         it_len++;
-    }
-    assert(it_len);
 
-    for (size_t i = 0; i < it_len; ++i) {
-        if (!(coder_decode(&decoders[i], &kvs[i]))) goto fail_decoder;
+        if (!merge_src_fill(src)) goto fail;
+        if (!src->len) {
+            free(src->remap);
+            it_len--;
+        }
     }
 
-    struct rill_kv prev = {0};
+    rill_key_t prev_key = 0;
+    rill_val_t prev_id = 0;
 
     while (it_len > 0) {
         size_t target = 0;
 
         for (size_t i = 1; i < it_len; ++i) {
-            if (rill_kv_cmp(&kvs[i], &kvs[target]) < 0)
+            if (merge_src_cmp(&srcs[i], &srcs[target]) < 0)
                 target = i;
         }
 
-        struct rill_kv *kv = &kvs[target];
-        struct decoder *decoder = &decoders[target];
+        struct merge_src *src = &srcs[target];
+        rill_key_t key = src->keys[src->pos];
+        rill_val_t id = src->ids[src->pos];
 
-        if (rill_likely(rill_kv_nil(&prev) || rill_kv_cmp(&prev, kv) < 0)) {
-            if (!coder_encode(coder, kv)) goto fail_decoder;
-            prev = *kv;
+        if (rill_likely(key != prev_key || id != prev_id)) {
+            if (!coder_encode_id(coder, key, id)) goto fail;
+            pace_write(pace, coder);
+            prev_key = key;
+            prev_id = id;
         }
 
-        if (!coder_decode(decoder, kv)) goto fail_decoder;
-        if (rill_unlikely(rill_kv_nil(kv))) {
-            memmove(kvs + target,
-                    kvs + target + 1,
-                    (it_len - target - 1) * sizeof(kvs[0]));
-            memmove(decoders + target,
-                    decoders + target + 1,
-                    (it_len - target - 1) * sizeof(decoders[0]));
+        src->pos++;
+        if (src->pos < src->len) continue;
+        if (src->len == merge_batch && !merge_src_fill(src)) goto fail;
+
+        if (rill_unlikely(src->pos == src->len)) {
+            free(src->remap);
+            if (target != it_len - 1) *src = srcs[it_len - 1];
             it_len--;
         }
     }
 
+    free(srcs);
     return true;
 
-  fail_decoder:
+  fail:
+    for (size_t i = 0; i < it_len; ++i) free(srcs[i].remap);
+    free(srcs);
+    return false;
+}
+
+// Column b has to be rebuilt from column a for inputs that were written without
+// it which requires a full sort of the inverted pairs. To bound memory usage,
+// the dictionary is split into value ranges that are each inverted in a
+// separate pass over column a of every input.
+enum { invert_pass_pairs = 1 << 28 };
+
+static bool merge_invert_col_a(
+        struct encoder *coder,
+        struct rill_store **list, size_t list_len,
+        const struct vals *vals, size_t pairs,
+        struct pace *pace)
+{
+    size_t passes = pairs / invert_pass_pairs + 1;
+    size_t step = vals->len / passes + 1;
+
+    struct rill_pairs *inverted = rill_pairs_new(pairs / passes + 1);
+    if (!inverted) return false;
+
+    for (size_t lo = 0; lo < vals->len; lo += step) {
+        const bool last = lo + step >= vals->len;
+        const rill_val_t min = vals->data[lo];
+        const rill_val_t max = last ? 0 : vals->data[lo + step];
+
+        rill_pairs_clear(inverted);
+
+        for (size_t i = 0; i < list_len; ++i) {
+            if (!list[i]) continue;
+
+            struct rill_kv kv = {0};
+            struct decoder decoder = store_decoder(list[i], rill_col_a);
+
+            while (true) {
+                if (!coder_decode(&decoder, &kv)) goto fail;
+                if (rill_kv_nil(&kv)) break;
+                if (kv.val < min || (!last && kv.val >= max)) continue;
+
+                inverted = rill_pairs_push(inverted, kv.val, kv.key);
+                if (!inverted) return false;
+            }
+        }
+
+        rill_pairs_compact(inverted);
+
+        for (size_t i = 0; i < inverted->len; ++i) {
+            if (!coder_encode(coder, &inverted->data[i])) goto fail;
+            pace_write(pace, coder);
+        }
+    }
+
+    rill_pairs_free(inverted);
+    return true;
+
+  fail:
+    rill_pairs_free(inverted);
     return false;
 }
 
@@ -554,9 +936,29 @@ bool rill_store_merge(
         rill_ts_t ts, size_t quant,
         struct rill_store **list, size_t list_len)
 {
-    assert(list_len > 1);
+    return rill_store_merge_ex(file, ts, quant, list, list_len, 0);
+}
+
+bool rill_store_merge_ex(
+        const char *file,
+        rill_ts_t ts, size_t quant,
+        struct rill_store **list, size_t list_len,
+        unsigned flags)
+{
+    return rill_store_merge_throttle(file, ts, quant, list, list_len, flags, NULL);
+}
+
+bool rill_store_merge_throttle(
+        const char *file,
+        rill_ts_t ts, size_t quant,
+        struct rill_store **list, size_t list_len,
+        unsigned flags,
+        struct rill_throttle *throttle)
+{
+    assert(list_len > 0);
 
     size_t pairs = 0;
+    bool has_col_b = true;
     struct vals *vals = NULL;
     struct vals *invert_vals = NULL;
 
@@ -568,35 +970,60 @@ bool rill_store_merge(
         struct vals *iret = vals_merge_from_index(invert_vals, list[i]->index_a);
 
         pairs += list[i]->head->pairs;
+        has_col_b = has_col_b && store_has_col_b(list[i]);
 
         if (ret) vals = ret; else goto fail_vals;
         if (iret) invert_vals = iret; else goto fail_invert_vals;
     }
 
     struct rill_store store = {0};
-    if (!writer_open(&store, file, vals, invert_vals,
-                     pairs, ts, quant)) {
+    if (!writer_open(&store, file, vals->len, invert_vals->len,
+                     pairs, ts, quant, flags)) {
         rill_fail("unable to create '%s'", file);
         goto fail_open;
     }
 
     init_store_offsets(&store, vals->len, invert_vals->len);
 
+    struct pace pace_data = {
+        .throttle = throttle,
+        .store = &store,
+        .off = store.head->data_a_off,
+    };
+    struct pace *pace = throttle ? &pace_data : NULL;
+
+    struct encoder encoder_b = {0};
     struct encoder encoder_a =
-        store_encoder(&store, store.index_a, vals, store.head->data_a_off);
-    if (!merge_with_config(&encoder_a, list, list_len, rill_col_a)) goto fail_coder_a;
+        store_encoder(&store, store.index_a, NULL, store.head->data_a_off);
+    if (!merge_with_config(&encoder_a, list, list_len, rill_col_a, vals, pace))
+        goto fail_coder_a;
     if (!coder_finish(&encoder_a)) goto fail_coder_a;
 
     prepare_col_b_offsets(&store, &encoder_a);
+    size_t len = store.head->data_b_off;
+
+    if (!(flags & rill_store_col_a_only)) {
+        // Only the inversion of column a needs to translate values to ids.
+        encoder_b = store_encoder(
+                &store, store.index_b,
+                has_col_b ? NULL : invert_vals,
+                store.head->data_b_off);
 
-    struct encoder encoder_b =
-        store_encoder(&store, store.index_b, invert_vals, store.head->data_b_off);
-    if (!merge_with_config(&encoder_b, list, list_len, rill_col_b)) goto fail_coder_b;
-    if (!coder_finish(&encoder_b)) goto fail_coder_b;
+        bool ret = has_col_b ?
+            merge_with_config(&encoder_b, list, list_len, rill_col_b, invert_vals, pace) :
+            merge_invert_col_a(&encoder_b, list, list_len, vals, pairs, pace);
+
+        if (!ret) goto fail_coder_b;
+        if (!coder_finish(&encoder_b)) goto fail_coder_b;
+
+        len += coder_off(&encoder_b);
+    }
+    else write_vals_index(store.index_b, vals);
 
     store.head->pairs = encoder_a.pairs;
 
-    writer_close(&store, store.head->data_b_off + coder_off(&encoder_b));
+    pace_finish(pace, len);
+    bool ret = writer_close(&store, len, flags);
 
     for (size_t i = 0; i < list_len; ++i)
         if (list[i]) vma_dont_need(list[i]);
@@ -605,13 +1032,13 @@ bool rill_store_merge(
     coder_close(&encoder_b);
     free(vals);
     free(invert_vals);
-    return true;
+    return ret;
 
-    coder_close(&encoder_b);
   fail_coder_b:
-    coder_close(&encoder_a);
   fail_coder_a:
-    writer_close(&store, 0);
+    coder_close(&encoder_b);
+    coder_close(&encoder_a);
+    writer_close(&store, 0, flags);
   fail_open:
     free(invert_vals);
   fail_invert_vals:
@@ -621,6 +1048,186 @@ bool rill_store_merge(
 }
 
 
+// -----------------------------------------------------------------------------
+// runs
+// -----------------------------------------------------------------------------
+
+struct run_it { const struct rill_kv *it, *end; };
+
+static void runs_sift_down(struct run_it *heap, size_t len, size_t i)
+{
+    while (true) {
+        size_t min = i;
+        size_t left = 2 * i + 1, right = 2 * i + 2;
+
+        if (left < len && rill_kv_cmp(heap[left].it, heap[min].it) < 0) min = left;
+        if (right < len && rill_kv_cmp(heap[right].it, heap[min].it) < 0) min = right;
+        if (min == i) return;
+
+        struct run_it tmp = heap[i];
+        heap[i] = heap[min];
+        heap[min] = tmp;
+        i = min;
+    }
+}
+
+// The heap has a slot per run which isn't bounded so it lives on the heap.
+static struct run_it *runs_heap_new(
+        struct rill_pairs *const *runs, size_t len, size_t *heap_len_out)
+{
+    struct run_it *heap = calloc(len + 1, sizeof(*heap));
+    if (!heap) {
+        rill_fail("unable to allocate heap for '%lu' runs", len);
+        return NULL;
+    }
+
+    size_t heap_len = 0;
+    for (size_t i = 0; i < len; ++i) {
+        if (!runs[i]->len) continue;
+        heap[heap_len++] = (struct run_it) {
+            .it = runs[i]->data,
+            .end = runs[i]->data + runs[i]->len,
+        };
+    }
+
+    for (size_t i = heap_len / 2; i-- > 0;) runs_sift_down(heap, heap_len, i);
+
+    *heap_len_out = heap_len;
+    return heap;
+}
+
+static const struct rill_kv *runs_heap_next(struct run_it *heap, size_t *len)
+{
+    if (!*len) return NULL;
+
+    const struct rill_kv *kv = heap[0].it++;
+    if (heap[0].it == heap[0].end) heap[0] = heap[--(*len)];
+    runs_sift_down(heap, *len, 0);
+
+    return kv;
+}
+
+static struct vals *vals_from_runs(struct rill_pairs *const *runs, size_t len)
+{
+    size_t cap = 0;
+    for (size_t i = 0; i < len; ++i) cap += runs[i]->len;
+
+    struct vals *vals = calloc(1, sizeof(*vals) + sizeof(vals->data[0]) * cap);
+    if (!vals) {
+        rill_fail("unable to allocate memory for vals: %lu", cap);
+        return NULL;
+    }
+
+    size_t heap_len = 0;
+    struct run_it *heap = runs_heap_new(runs, len, &heap_len);
+    if (!heap) {
+        free(vals);
+        return NULL;
+    }
+
+    const struct rill_kv *kv = NULL;
+    while ((kv = runs_heap_next(heap, &heap_len))) {
+        if (vals->len && vals->data[vals->len - 1] == kv->key) continue;
+        vals->data[vals->len++] = kv->key;
+    }
+
+    free(heap);
+    return vals;
+}
+
+static bool encode_runs(
+        struct encoder *coder, struct rill_pairs *const *runs, size_t len)
+{
+    size_t heap_len = 0;
+    struct run_it *heap = runs_heap_new(runs, len, &heap_len);
+    if (!heap) return false;
+
+    bool ret = true;
+    struct rill_kv prev = {0};
+    const struct rill_kv *kv = NULL;
+    while (ret && (kv = runs_heap_next(heap, &heap_len))) {
+        if (rill_unlikely(!rill_kv_nil(&prev) && !rill_kv_cmp(&prev, kv))) continue;
+        ret = coder_encode(coder, kv);
+        prev = *kv;
+    }
+
+    free(heap);
+    return ret;
+}
+
+bool rill_store_write_runs(
+        const char *file,
+        rill_ts_t ts,
+        size_t quant,
+        struct rill_pairs *const *runs,
+        struct rill_pairs *const *inverted,
+        size_t len,
+        unsigned flags)
+{
+    size_t pairs = 0;
+    for (size_t i = 0; i < len; ++i) pairs += runs[i]->len;
+    if (!pairs) return true;
+
+    const bool col_b = !(flags & rill_store_col_a_only);
+
+    struct vals *vals = vals_from_runs(inverted, len);
+    if (!vals) goto fail_vals;
+
+    struct vals *keys = vals_from_runs(runs, len);
+    if (!keys) goto fail_keys;
+
+    struct rill_store store = {0};
+    if (!writer_open(&store, file, vals->len, keys->len,
+                     pairs, ts, quant, flags)) {
+        rill_fail("unable to create '%s'", file);
+        goto fail_open;
+    }
+
+    init_store_offsets(&store, vals->len, keys->len);
+
+    struct encoder coder_b = {0};
+    struct encoder coder_a =
+        store_encoder(&store, store.index_a, vals, store.head->data_a_off);
+    if (!encode_runs(&coder_a, runs, len)) goto fail_encode_a;
+    if (!coder_finish(&coder_a)) goto fail_encode_a;
+
+    prepare_col_b_offsets(&store, &coder_a);
+    size_t store_len = store.head->data_b_off;
+
+    if (col_b) {
+        coder_b = store_encoder(&store, store.index_b, keys, store.head->data_b_off);
+        if (!encode_runs(&coder_b, inverted, len)) goto fail_encode_b;
+        if (!coder_finish(&coder_b)) goto fail_encode_b;
+
+        store_len += coder_off(&coder_b);
+    }
+    else write_vals_index(store.index_b, vals);
+
+    store.head->pairs = coder_a.pairs;
+
+    bool ret = writer_close(&store, store_len, flags);
+
+    coder_close(&coder_a);
+    coder_close(&coder_b);
+    free(vals);
+    free(keys);
+
+    return ret;
+
+  fail_encode_b:
+  fail_encode_a:
+    coder_close(&coder_b);
+    coder_close(&coder_a);
+    writer_close(&store, 0, flags);
+  fail_open:
+    free(keys);
+  fail_keys:
+    free(vals);
+  fail_vals:
+    return false;
+}
+
+
 // -----------------------------------------------------------------------------
 // scan
 // -----------------------------------------------------------------------------
@@ -653,6 +1260,12 @@ size_t rill_store_keys_count(const struct rill_store *store, enum rill_col colum
     return ix->len;
 }
 
+bool rill_store_has_col(const struct rill_store *store, enum rill_col col)
+{
+    assert(col == rill_col_a || col == rill_col_b);
+    return col == rill_col_a || store_has_col_b(store);
+}
+
 size_t rill_store_pairs(const struct rill_store *store)
 {
     return store->head->pairs;
@@ -664,37 +1277,90 @@ size_t rill_store_index_len(const struct rill_store *store, enum rill_col col)
     return col == rill_col_a ? store->index_a->len : store->index_b->len;
 }
 
+// -----------------------------------------------------------------------------
+// query
+// -----------------------------------------------------------------------------
+
+// Queries append to out but must leave it as it was if they fail. Growing out in
+// place would free it so it's instead copied into a new allocation on its first
+// growth which only replaces out once the query succeeds.
+struct result
+{
+    struct rill_pairs *out, *pairs;
+    size_t len;
+};
+
+static struct result result_make(struct rill_pairs *out)
+{
+    return (struct result) { .out = out, .pairs = out, .len = out->len };
+}
+
+static bool result_push(struct result *result, rill_key_t key, rill_val_t val)
+{
+    assert(key && val);
+    struct rill_pairs *pairs = result->pairs;
+
+    if (rill_unlikely(pairs->len == pairs->cap)) {
+        if (pairs == result->out) {
+            pairs = rill_pairs_new(pairs->cap * 2);
+            if (!pairs) return false;
+
+            memcpy(pairs->data, result->out->data,
+                    result->out->len * sizeof(pairs->data[0]));
+            pairs->len = result->out->len;
+        }
+        else {
+            pairs = rill_pairs_reserve(pairs, pairs->len + 1);
+            if (!pairs) return false;
+        }
+        result->pairs = pairs;
+    }
+
+    pairs->data[pairs->len] = (struct rill_kv) { .key = key, .val = val };
+    pairs->len++;
+    return true;
+}
+
+static struct rill_pairs *result_done(struct result *result)
+{
+    if (result->pairs != result->out) rill_pairs_free(result->out);
+    return result->pairs;
+}
+
+static struct rill_pairs *result_fail(struct result *result)
+{
+    if (result->pairs != result->out) rill_pairs_free(result->pairs);
+    result->out->len = result->len;
+    return NULL;
+}
+
+
 static struct rill_pairs *store_query_key_or_value(
         struct rill_store *store,
         rill_key_t key,
         struct rill_pairs *out,
         enum rill_col column)
 {
-    struct rill_pairs *result = out;
     size_t key_idx = 0;
     uint64_t off = 0;
     struct index *ix =
         column == rill_col_a ? store->index_a : store->index_b;
 
-    if (!index_find(ix, key, &key_idx, &off)) return result;
+    if (!index_find(ix, key, &key_idx, &off)) return out;
 
+    struct result result = result_make(out);
     struct rill_kv kv = {0};
     struct decoder coder = store_decoder_at(store, key_idx, off, column);
 
     while (true) {
-        if (!coder_decode(&coder, &kv)) goto fail;
+        if (!coder_decode(&coder, &kv)) return result_fail(&result);
         if (rill_kv_nil(&kv)) break;
         if (kv.key != key) break;
 
-        result = rill_pairs_push(result, kv.key, kv.val);
-        if (!result) goto fail;
+        if (!result_push(&result, kv.key, kv.val)) return result_fail(&result);
     }
 
-    return result;
-
-  fail:
-    // \todo potentially leaking result
-    return NULL;
+    return result_done(&result);
 }
 
 struct rill_pairs *rill_store_query_key(
@@ -703,12 +1369,375 @@ struct rill_pairs *rill_store_query_key(
     return store_query_key_or_value(store, key, out, rill_col_a);
 }
 
+// Ranges closer than this are paged in as a single range.
+enum { page_in_gap = 64 * 1024 };
+
+// Byte range [first, last) of the value list of an index entry within the file.
+static void store_value_list(
+        const struct rill_store *store, enum rill_col column, size_t key_idx,
+        size_t *first, size_t *last)
+{
+    const struct index *ix = column == rill_col_a ? store->index_a : store->index_b;
+    size_t data_off = column == rill_col_a ?
+        store->head->data_a_off : store->head->data_b_off;
+    size_t data_end = column == rill_col_a ?
+        store->head->data_b_off : store->vma_len;
+
+    *first = data_off + ix->data[key_idx].off;
+    *last = key_idx + 1 < ix->len ?
+        data_off + ix->data[key_idx + 1].off + 1 : data_end;
+}
+
+// Keys are looked up in sorted groups whose index searches advance in lock-step
+// from the last lower bound of the previous group. The value lists of all the
+// hits of a group are then prefetched, and paged in if there's more than one to
+// overlap, before any of them is decoded in file order. Hits that are close
+// together are paged in by a single madvise.
+static struct rill_pairs *store_probe(
+        struct rill_store *store,
+        enum rill_col column,
+        const uint64_t *keys, size_t len,
+        struct rill_pairs *out)
+{
+    struct result result = result_make(out);
+    struct index *ix = column == rill_col_a ? store->index_a : store->index_b;
+
+    size_t start = 0;
+    for (size_t i = 0; i < len && start < ix->len; i += index_group) {
+        size_t group = len - i < index_group ? len - i : index_group;
+        const uint64_t *group_keys = keys + i;
+
+        size_t pos[index_group] = {0};
+        index_find_group(ix, start, group_keys, group, pos);
+        start = pos[group - 1];
+
+        size_t hits[index_group];
+        size_t hits_len = 0;
+        for (size_t j = 0; j < group; ++j) {
+            assert(!(i + j) || keys[i + j - 1] <= keys[i + j]);
+            if ((i + j) && keys[i + j - 1] == keys[i + j]) continue;
+            if (pos[j] == ix->len || ix->data[pos[j]].key != group_keys[j]) continue;
+            hits[hits_len++] = j;
+        }
+
+        size_t range_start = 0, range_end = 0;
+        for (size_t j = 0; hits_len > 1 && j < hits_len; ++j) {
+            size_t first = 0, last = 0;
+            store_value_list(store, column, pos[hits[j]], &first, &last);
+            __builtin_prefetch(store->vma + first);
+
+            if (range_end && first <= range_end + page_in_gap) {
+                if (last > range_end) range_end = last;
+                continue;
+            }
+
+            if (range_end) vma_advise(store, range_start, range_end, MADV_WILLNEED);
+            range_start = first;
+            range_end = last;
+        }
+        if (range_end) vma_advise(store, range_start, range_end, MADV_WILLNEED);
+
+        for (size_t j = 0; j < hits_len; ++j) {
+            size_t key_idx = pos[hits[j]];
+            rill_key_t key = group_keys[hits[j]];
+
+            struct rill_kv kv = {0};
+            struct decoder coder =
+                store_decoder_at(store, key_idx, ix->data[key_idx].off, column);
+
+            while (true) {
+                if (!coder_decode(&coder, &kv)) return result_fail(&result);
+                if (rill_kv_nil(&kv)) break;
+                if (kv.key != key) break;
+
+                if (!result_push(&result, kv.key, kv.val)) return result_fail(&result);
+            }
+        }
+    }
+
+    return result_done(&result);
+}
+
+// Fallback for stores written without column b. The value is first resolved to
+// its dictionary id via index b which allows column a to be scanned without
+// translating every value it contains. Since column a is sorted by key, the
+// inverted pairs are produced in the same order as a column b lookup would.
+static struct rill_pairs *store_scan_value(
+        struct rill_store *store, rill_val_t val, struct rill_pairs *out)
+{
+    size_t val_idx = 0;
+    uint64_t off = 0;
+
+    if (!index_find(store->index_b, val, &val_idx, &off)) return out;
+    const rill_val_t id = val_idx + 1;
+
+    struct result result = result_make(out);
+    struct rill_kv kv = {0};
+    struct decoder coder = store_decoder(store, rill_col_a);
+    coder.lookup = NULL;
+
+    while (true) {
+        if (!coder_decode(&coder, &kv)) return result_fail(&result);
+        if (rill_kv_nil(&kv)) break;
+        if (kv.val != id) continue;
+
+        if (!result_push(&result, val, kv.key)) return result_fail(&result);
+    }
+
+    return result_done(&result);
+}
+
 struct rill_pairs *rill_store_query_value(
         struct rill_store *store, rill_val_t key, struct rill_pairs *out)
 {
+    if (!store_has_col_b(store)) return store_scan_value(store, key, out);
     return store_query_key_or_value(store, key, out, rill_col_b);
 }
 
+// Batches that cover more than 1/store_scan_ratio of the entries of an index
+// are answered by a single sequential pass over column a instead of a random
+// probe of the index and of the data for every entry. The requested entries
+// are marked in a bitmap over their position in the index and column a is
+// decoded into raw dictionary ids so that only the matching values are ever
+// translated.
+enum { store_scan_ratio = 16 };
+
+static bool store_scan_batch(const struct index *index, size_t len)
+{
+    return len * store_scan_ratio > index->len;
+}
+
+static inline bool bitmap_test(const uint64_t *bitmap, size_t idx)
+{
+    return bitmap[idx / 64] & (1UL << (idx % 64));
+}
+
+static uint64_t *store_bitmap(
+        struct index *index, const uint64_t *keys, size_t len)
+{
+    uint64_t *bitmap = calloc(index->len / 64 + 1, sizeof(*bitmap));
+    if (!bitmap) {
+        rill_fail("unable to allocate bitmap of '%lu' entries", index->len);
+        return NULL;
+    }
+
+    size_t pos = 0;
+    for (size_t i = 0; i < len && pos < index->len; ++i) {
+        assert(!i || keys[i - 1] <= keys[i]);
+
+        size_t idx = 0;
+        uint64_t off = 0;
+        if (index_gallop(index, keys[i], &pos, &idx, &off))
+            bitmap[idx / 64] |= 1UL << (idx % 64);
+    }
+
+    return bitmap;
+}
+
+static struct rill_pairs *store_scan(
+        struct rill_store *store,
+        enum rill_col column,
+        const uint64_t *keys, size_t len,
+        struct rill_pairs *out)
+{
+    struct index *dict = store->index_b;
+    struct index *ix = column == rill_col_a ? store->index_a : dict;
+
+    uint64_t *bitmap = store_bitmap(ix, keys, len);
+    if (!bitmap) return NULL;
+
+    struct result result = result_make(out);
+    struct rill_kv kv = {0};
+    struct decoder coder = store_decoder(store, rill_col_a);
+    coder.lookup = NULL;
+
+    while (true) {
+        if (!coder_decode(&coder, &kv)) goto fail;
+        if (rill_kv_nil(&kv)) break;
+
+        bool ok = true;
+        if (column == rill_col_a) {
+            if (!bitmap_test(bitmap, coder.keys - 1)) continue;
+            ok = result_push(&result, kv.key, dict->data[kv.val - 1].key);
+        }
+        else {
+            if (!bitmap_test(bitmap, kv.val - 1)) continue;
+            ok = result_push(&result, dict->data[kv.val - 1].key, kv.key);
+        }
+        if (!ok) goto fail;
+    }
+
+    free(bitmap);
+    return result_done(&result);
+
+  fail:
+    free(bitmap);
+    return result_fail(&result);
+}
+
+struct rill_pairs *rill_store_query_keys(
+        struct rill_store *store,
+        const rill_key_t *keys, size_t len,
+        struct rill_pairs *out)
+{
+    if (store_scan_batch(store->index_a, len))
+        return store_scan(store, rill_col_a, keys, len, out);
+    return store_probe(store, rill_col_a, keys, len, out);
+}
+
+// Column b is only probed if the store has it and the batch is small enough.
+struct rill_pairs *rill_store_query_values(
+        struct rill_store *store,
+        const rill_val_t *vals, size_t len,
+        struct rill_pairs *out)
+{
+    if (store_has_col_b(store) && !store_scan_batch(store->index_b, len))
+        return store_probe(store, rill_col_b, vals, len, out);
+    return store_scan(store, rill_col_b, vals, len, out);
+}
+
+
+// -----------------------------------------------------------------------------
+// range
+// -----------------------------------------------------------------------------
+
+// The value lists of a column are laid out in key order so the pairs of a range
+// form a single contiguous section which is decoded from its lower bound until
+// the first key past the range.
+static struct rill_pairs *store_range(
+        struct rill_store *store,
+        enum rill_col column,
+        uint64_t lo, uint64_t hi,
+        struct rill_pairs *out)
+{
+    struct index *ix = column == rill_col_a ? store->index_a : store->index_b;
+
+    size_t pos = 0, key_idx = 0;
+    uint64_t off = 0;
+    (void) index_gallop(ix, lo, &pos, &key_idx, &off);
+    if (pos == ix->len || ix->data[pos].key >= hi) return out;
+
+    struct result result = result_make(out);
+    struct rill_kv kv = {0};
+    struct decoder coder = store_decoder_at(store, pos, ix->data[pos].off, column);
+
+    while (true) {
+        if (!coder_decode(&coder, &kv)) return result_fail(&result);
+        if (rill_kv_nil(&kv)) break;
+        if (kv.key >= hi) break;
+
+        if (!result_push(&result, kv.key, kv.val)) return result_fail(&result);
+    }
+
+    return result_done(&result);
+}
+
+// Fallback for stores written without column b. The dictionary is sorted so
+// the range of values maps to a range of ids which is matched against column
+// a without translating the values outside of it.
+static struct rill_pairs *store_scan_range(
+        struct rill_store *store,
+        rill_val_t lo, rill_val_t hi,
+        struct rill_pairs *out)
+{
+    struct index *dict = store->index_b;
+
+    size_t first = 0, last = 0, key_idx = 0;
+    uint64_t off = 0;
+    (void) index_gallop(dict, lo, &first, &key_idx, &off);
+    last = first;
+    (void) index_gallop(dict, hi, &last, &key_idx, &off);
+    if (first == last) return out;
+
+    struct result result = result_make(out);
+    struct rill_kv kv = {0};
+    struct decoder coder = store_decoder(store, rill_col_a);
+    coder.lookup = NULL;
+
+    while (true) {
+        if (!coder_decode(&coder, &kv)) return result_fail(&result);
+        if (rill_kv_nil(&kv)) break;
+        if (kv.val <= first || kv.val > last) continue;
+
+        if (!result_push(&result, dict->data[kv.val - 1].key, kv.key))
+            return result_fail(&result);
+    }
+
+    return result_done(&result);
+}
+
+struct rill_pairs *rill_store_query_key_range(
+        struct rill_store *store,
+        rill_key_t lo, rill_key_t hi,
+        struct rill_pairs *out)
+{
+    if (lo >= hi) return out;
+    return store_range(store, rill_col_a, lo, hi, out);
+}
+
+struct rill_pairs *rill_store_query_value_range(
+        struct rill_store *store,
+        rill_val_t lo, rill_val_t hi,
+        struct rill_pairs *out)
+{
+    if (lo >= hi) return out;
+    if (store_has_col_b(store)) return store_range(store, rill_col_b, lo, hi, out);
+    return store_scan_range(store, lo, hi, out);
+}
+
+
+// -----------------------------------------------------------------------------
+// page in
+// -----------------------------------------------------------------------------
+
+static void store_read_ahead(struct rill_store *store, size_t start, size_t end)
+{
+    start &= ~(page_len - 1);
+    end = to_vma_len(end);
+    if (end > store->vma_len) end = store->vma_len;
+    if (start >= end) return;
+
+    (void) posix_fadvise(store->fd, start, end - start, POSIX_FADV_WILLNEED);
+}
+
+// The index is searched up front for the value lists of the entire batch which
+// are coalesced into ranges and handed to the kernel as asynchronous reads. The
+// device then serves all the ranges concurrently while the probe that follows
+// decodes them in file order, only waiting on the pages still in flight.
+// Batches that would be scanned are left to the kernel's sequential readahead.
+void rill_store_page_in(
+        struct rill_store *store,
+        enum rill_col column,
+        const uint64_t *keys, size_t len)
+{
+    assert(column == rill_col_a || column == rill_col_b);
+    if (column == rill_col_b && !store_has_col_b(store)) return;
+
+    struct index *ix = column == rill_col_a ? store->index_a : store->index_b;
+    if (store_scan_batch(ix, len)) return;
+
+    size_t pos = 0, start = 0, end = 0;
+    for (size_t i = 0; i < len && pos < ix->len; ++i) {
+        size_t key_idx = 0;
+        uint64_t off = 0;
+        if (!index_gallop(ix, keys[i], &pos, &key_idx, &off)) continue;
+
+        size_t first = 0, last = 0;
+        store_value_list(store, column, key_idx, &first, &last);
+
+        if (end && first <= end + page_in_gap) {
+            if (last > end) end = last;
+            continue;
+        }
+
+        if (end) store_read_ahead(store, start, end);
+        start = first;
+        end = last;
+    }
+
+    if (end) store_read_ahead(store, start, end);
+}
+
 size_t rill_store_keys(
     const struct rill_store *store, rill_key_t *out, size_t cap,
     enum rill_col column)
@@ -727,11 +1756,25 @@ size_t rill_store_keys(
 }
 
 
-struct rill_store_it { struct decoder decoder; };
+struct rill_store_it
+{
+    struct decoder decoder;
+
+    // Only set by rill_store_begin_inverted. Dictionary ids of index b in
+    // [lo, lo + step) are inverted by the next pass over column a.
+    struct rill_store *store;
+    struct rill_pairs *pass;
+    size_t pos, lo, step;
+};
 
 struct rill_store_it *rill_store_begin(
         struct rill_store *store, enum rill_col column)
 {
+    if (!rill_store_has_col(store, column)) {
+        rill_fail("no column b in '%s'", store->file);
+        return NULL;
+    }
+
     struct rill_store_it *it = calloc(1, sizeof(*it));
     if (!it) return NULL;
 
@@ -739,14 +1782,104 @@ struct rill_store_it *rill_store_begin(
     return it;
 }
 
+// Same split of the dictionary as merge_invert_col_a but sized for a query
+// which trades more passes over column a for a smaller memory footprint.
+enum { invert_it_pairs = 1 << 20 };
+
+struct rill_store_it *rill_store_begin_inverted(
+        struct rill_store *store, size_t pass_pairs)
+{
+    if (!pass_pairs) pass_pairs = invert_it_pairs;
+
+    size_t pairs = store->head->pairs;
+    size_t passes = pairs / pass_pairs + 1;
+
+    struct rill_store_it *it = calloc(1, sizeof(*it));
+    if (!it) {
+        rill_fail("unable to allocate inverted iterator for '%s'", store->file);
+        goto fail_alloc;
+    }
+
+    it->pass = rill_pairs_new(pairs / passes + 1);
+    if (!it->pass) goto fail_pass;
+
+    it->store = store;
+    it->step = store->index_b->len / passes + 1;
+    return it;
+
+  fail_pass:
+    free(it);
+  fail_alloc:
+    return NULL;
+}
+
+// Decodes column a into raw dictionary ids and keeps the pairs whose id is in
+// the range of the pass. Empty passes are skipped and an empty pass is only
+// left once the dictionary is exhausted.
+static bool store_it_invert(struct rill_store_it *it)
+{
+    struct rill_store *store = it->store;
+    struct index *dict = store->index_b;
+
+    rill_pairs_clear(it->pass);
+    it->pos = 0;
+
+    while (!it->pass->len && it->lo < dict->len) {
+        const rill_val_t lo = it->lo + 1, hi = lo + it->step;
+        it->lo += it->step;
+
+        struct rill_kv kv = {0};
+        struct decoder coder = store_decoder(store, rill_col_a);
+        coder.lookup = NULL;
+
+        while (true) {
+            if (!coder_decode(&coder, &kv)) return false;
+            if (rill_kv_nil(&kv)) break;
+            if (kv.val < lo || kv.val >= hi) continue;
+
+            struct rill_pairs *next =
+                rill_pairs_push(it->pass, dict->data[kv.val - 1].key, kv.key);
+            if (!next) return false;
+            it->pass = next;
+        }
+
+        rill_pairs_compact(it->pass);
+    }
+
+    return true;
+}
+
 void rill_store_it_free(struct rill_store_it *it)
 {
+    rill_pairs_free(it->pass);
     free(it);
 }
 
 bool rill_store_it_next(struct rill_store_it *it, struct rill_kv *kv)
 {
-    return coder_decode(&it->decoder, kv);
+    if (!it->store) return coder_decode(&it->decoder, kv);
+
+    if (it->pos == it->pass->len && !store_it_invert(it)) return false;
+
+    if (it->pos < it->pass->len) *kv = it->pass->data[it->pos++];
+    else *kv = (struct rill_kv) {0};
+    return true;
+}
+
+ssize_t rill_store_it_next_batch(
+        struct rill_store_it *it, rill_key_t *keys, rill_val_t *vals, size_t cap)
+{
+    if (!it->store) return coder_decode_batch(&it->decoder, keys, vals, cap);
+
+    for (size_t i = 0; i < cap; ++i) {
+        struct rill_kv kv = {0};
+        if (!rill_store_it_next(it, &kv)) return -1;
+        if (rill_kv_nil(&kv)) return i;
+
+        keys[i] = kv.key;
+        vals[i] = kv.val;
+    }
+    return cap;
 }
 
 struct rill_space* rill_store_space(struct rill_store* store)
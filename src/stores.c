@@ -0,0 +1,271 @@
+/* stores.c
+   agent (agent@local), 19 Oct 2026
+   FreeBSD-style copyright and disclaimer apply
+*/
+
+#include "rill.h"
+#include "utils.h"
+
+#include <stdlib.h>
+#include <assert.h>
+#include <stdatomic.h>
+
+
+// -----------------------------------------------------------------------------
+// stores
+// -----------------------------------------------------------------------------
+
+// Stores listed in the manifest are only opened when they're first accessed.
+// Accessors can race on the open so the store pointer is published via a CAS.
+struct item
+{
+    struct rill_manifest_entry entry;
+    _Atomic(struct rill_store *) store;
+};
+
+struct rill_stores
+{
+    const char *dir;
+
+    // Longest window of any store which bounds how far before a range a store
+    // can start and still overlap it.
+    rill_ts_t max_quant;
+
+    size_t len;
+    struct item *data;
+};
+
+static int item_cmp(const void *l, const void *r)
+{
+    const struct item *lhs = l, *rhs = r;
+
+    // earliest (biggest) to oldest (smallest)
+    if (lhs->entry.ts < rhs->entry.ts) return +1;
+    if (lhs->entry.ts > rhs->entry.ts) return -1;
+    return strncmp(lhs->entry.file, rhs->entry.file, rill_manifest_name_cap);
+}
+
+static bool stores_from_manifest(
+        struct rill_stores *stores, const struct rill_manifest *manifest)
+{
+    stores->data = calloc(manifest->len, sizeof(*stores->data));
+    if (!stores->data && manifest->len) return false;
+
+    for (size_t i = 0; i < manifest->len; ++i) {
+        stores->data[i].entry = manifest->data[i];
+        atomic_init(&stores->data[i].store, NULL);
+    }
+    stores->len = manifest->len;
+
+    return true;
+}
+
+// Without a manifest every store must be opened to know its ts. Stores that
+// fail to open are skipped as they're either incomplete or were removed by a
+// concurrent rotation but system errors (e.g. EMFILE) fail the listing.
+static bool stores_from_dir(struct rill_stores *stores)
+{
+    char (*names)[NAME_MAX + 1] = NULL;
+    ssize_t len = scan_dir_files(stores->dir, &names);
+    if (len == -1) return false;
+
+    stores->data = calloc(len, sizeof(*stores->data));
+    if (!stores->data && len) {
+        free(names);
+        return false;
+    }
+
+    for (size_t i = 0; i < (size_t) len; ++i) {
+        char file[PATH_MAX];
+        snprintf(file, sizeof(file), "%s/%s", stores->dir, names[i]);
+
+        struct rill_store *store = rill_store_open(file);
+        if (!store && rill_errno.errno_ && rill_errno.errno_ != ENOENT) {
+            for (size_t j = 0; j < stores->len; ++j)
+                rill_store_close(atomic_load(&stores->data[j].store));
+            free(stores->data);
+            free(names);
+            return false;
+        }
+        if (!store) continue;
+
+        struct item *item = &stores->data[stores->len++];
+        rill_store_manifest_entry(store, &item->entry);
+        atomic_init(&item->store, store);
+    }
+
+    free(names);
+    return true;
+}
+
+struct rill_stores *rill_stores_open(const char *dir)
+{
+    struct rill_stores *stores = calloc(1, sizeof(*stores));
+    if (!stores) {
+        rill_fail("unable to allocate memory for '%s'", dir);
+        goto fail_alloc_struct;
+    }
+
+    stores->dir = strndup(dir, PATH_MAX);
+    if (!stores->dir) {
+        rill_fail("unable to allocate memory for '%s'", dir);
+        goto fail_alloc_dir;
+    }
+
+    struct rill_manifest *manifest = NULL;
+    if (!rill_manifest_read(dir, &manifest)) manifest = NULL;
+
+    bool ok = manifest ?
+        stores_from_manifest(stores, manifest) :
+        stores_from_dir(stores);
+    rill_manifest_free(manifest);
+
+    if (!ok) {
+        rill_fail("unable to list stores of '%s'", dir);
+        goto fail_list;
+    }
+
+    qsort(stores->data, stores->len, sizeof(stores->data[0]), item_cmp);
+
+    for (size_t i = 0; i < stores->len; ++i) {
+        rill_ts_t quant = stores->data[i].entry.quant;
+        if (quant > stores->max_quant) stores->max_quant = quant;
+    }
+
+    return stores;
+
+  fail_list:
+    free((char *) stores->dir);
+  fail_alloc_dir:
+    free(stores);
+  fail_alloc_struct:
+    return NULL;
+}
+
+void rill_stores_close(struct rill_stores *stores)
+{
+    for (size_t i = 0; i < stores->len; ++i) {
+        struct rill_store *store = atomic_load(&stores->data[i].store);
+        if (store) rill_store_close(store);
+    }
+
+    free(stores->data);
+    free((char *) stores->dir);
+    free(stores);
+}
+
+size_t rill_stores_len(const struct rill_stores *stores)
+{
+    return stores->len;
+}
+
+const struct rill_manifest_entry *rill_stores_entry(
+        const struct rill_stores *stores, size_t i)
+{
+    assert(i < stores->len);
+    return &stores->data[i].entry;
+}
+
+struct rill_store *rill_stores_get(struct rill_stores *stores, size_t i)
+{
+    assert(i < stores->len);
+    struct item *item = &stores->data[i];
+
+    struct rill_store *store = atomic_load_explicit(&item->store, memory_order_acquire);
+    if (store) return store;
+
+    char file[PATH_MAX];
+    snprintf(file, sizeof(file), "%s/%s", stores->dir, item->entry.file);
+
+    store = rill_store_open(file);
+    if (!store) return NULL;
+
+    struct rill_store *expected = NULL;
+    if (atomic_compare_exchange_strong(&item->store, &expected, store))
+        return store;
+
+    rill_store_close(store);
+    return expected;
+}
+
+struct rill_store *rill_stores_take(struct rill_stores *stores, size_t i)
+{
+    struct rill_store *store = rill_stores_get(stores, i);
+    atomic_store(&stores->data[i].store, NULL);
+    return store;
+}
+
+// The window of a store is the quant that contains its ts as a rotated store
+// takes the ts of the latest store it merged. Stores that weren't rotated have
+// a quant of 0 and only cover their ts.
+static void item_window(const struct item *item, rill_ts_t *begin, rill_ts_t *end)
+{
+    rill_ts_t ts = item->entry.ts, quant = item->entry.quant;
+    *begin = quant ? ts - ts % quant : ts;
+    *end = *begin + (quant ? quant : 1);
+}
+
+// Returns the index of the first store whose ts is before the given ts.
+static size_t stores_lower(const struct rill_stores *stores, rill_ts_t ts)
+{
+    size_t lo = 0, hi = stores->len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (stores->data[mid].entry.ts >= ts) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+void rill_stores_range(
+        const struct rill_stores *stores,
+        rill_ts_t begin, rill_ts_t end,
+        size_t *first, size_t *last)
+{
+    rill_ts_t max_quant = stores->max_quant ? stores->max_quant : 1;
+
+    // Stores are sorted by decreasing ts and the ts of a store is always within
+    // its window so no store further than the longest window from the range
+    // can overlap it.
+    rill_ts_t upper = end < -1UL - max_quant ? end + max_quant - 1 : -1UL;
+    rill_ts_t lower = begin + 1 > max_quant ? begin + 1 - max_quant : 0;
+
+    *first = stores_lower(stores, upper);
+    *last = stores_lower(stores, lower);
+    if (*last < *first) *last = *first;
+}
+
+bool rill_stores_overlap(
+        const struct rill_stores *stores, size_t i,
+        rill_ts_t begin, rill_ts_t end)
+{
+    assert(i < stores->len);
+    rill_ts_t lo, hi;
+    item_window(&stores->data[i], &lo, &hi);
+    return lo < end && hi > begin;
+}
+
+
+// -----------------------------------------------------------------------------
+// scan
+// -----------------------------------------------------------------------------
+
+size_t rill_scan_dir(const char *dir, struct rill_store **list, size_t cap)
+{
+    struct rill_stores *stores = rill_stores_open(dir);
+    if (!stores) return 0;
+
+    size_t len = 0;
+    for (size_t i = 0; i < rill_stores_len(stores); ++i) {
+        if (len == cap) {
+            rill_fail("too many stores in '%s'", dir);
+            break;
+        }
+
+        list[len] = rill_stores_take(stores, i);
+        if (list[len]) len++;
+    }
+
+    rill_stores_close(stores);
+    return len;
+}
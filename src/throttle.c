@@ -0,0 +1,202 @@
+/* throttle.c
+   agent (agent@local), 19 Oct 2026
+   FreeBSD-style copyright and disclaimer apply
+*/
+
+#include "rill.h"
+#include "utils.h"
+
+#include <time.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+
+// -----------------------------------------------------------------------------
+// ioprio
+// -----------------------------------------------------------------------------
+
+// Not exposed by glibc.
+enum
+{
+    ioprio_class_shift = 13,
+    ioprio_class_be = 2,
+    ioprio_class_idle = 3,
+    ioprio_who_process = 1,
+};
+
+static int ioprio_value(enum rill_ioprio ioprio, int level)
+{
+    switch (ioprio) {
+    case rill_ioprio_best_effort:
+        if (level < 0) level = 0;
+        if (level > 7) level = 7;
+        return ioprio_class_be << ioprio_class_shift | level;
+    case rill_ioprio_idle: return ioprio_class_idle << ioprio_class_shift;
+    case rill_ioprio_none:
+    default: return 0;
+    }
+}
+
+
+// -----------------------------------------------------------------------------
+// throttle
+// -----------------------------------------------------------------------------
+
+static const uint64_t sec_nanos = 1000UL * 1000 * 1000;
+static const struct timespec pause_poll = { .tv_nsec = 10 * 1000 * 1000 };
+
+struct rill_throttle
+{
+    struct rill_throttle_opts opts;
+
+    pthread_mutex_t lock;
+    double tokens;
+    uint64_t refilled;
+
+    atomic_size_t pressure;
+
+    atomic_size_t bytes;
+    atomic_uint_fast64_t throttled_ns;
+    atomic_uint_fast64_t paused_ns;
+};
+
+static uint64_t now_nanos(void)
+{
+    struct timespec ts;
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * sec_nanos + ts.tv_nsec;
+}
+
+static void sleep_nanos(uint64_t nanos)
+{
+    struct timespec ts = { .tv_sec = nanos / sec_nanos, .tv_nsec = nanos % sec_nanos };
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+}
+
+struct rill_throttle *rill_throttle_new(const struct rill_throttle_opts *opts)
+{
+    struct rill_throttle *throttle = calloc(1, sizeof(*throttle));
+    if (!throttle) {
+        rill_fail("unable to allocate throttle");
+        return NULL;
+    }
+
+    throttle->opts = *opts;
+
+    pthread_mutex_init(&throttle->lock, NULL);
+    throttle->tokens = opts->burst_bytes ? opts->burst_bytes : opts->bytes_per_sec;
+    throttle->refilled = now_nanos();
+
+    atomic_init(&throttle->pressure, 0);
+    atomic_init(&throttle->bytes, 0);
+    atomic_init(&throttle->throttled_ns, 0);
+    atomic_init(&throttle->paused_ns, 0);
+
+    return throttle;
+}
+
+void rill_throttle_free(struct rill_throttle *throttle)
+{
+    if (!throttle) return;
+
+    pthread_mutex_destroy(&throttle->lock);
+    free(throttle);
+}
+
+void rill_throttle_stats(
+        const struct rill_throttle *throttle, struct rill_throttle_stats *stats)
+{
+    *stats = (struct rill_throttle_stats) {
+        .bytes = atomic_load(&throttle->bytes),
+        .throttled_ns = atomic_load(&throttle->throttled_ns),
+        .paused_ns = atomic_load(&throttle->paused_ns),
+    };
+}
+
+void rill_throttle_raise(struct rill_throttle *throttle)
+{
+    atomic_fetch_add(&throttle->pressure, 1);
+}
+
+void rill_throttle_lower(struct rill_throttle *throttle)
+{
+    size_t prev = atomic_fetch_sub(&throttle->pressure, 1);
+    assert(prev); (void) prev;
+}
+
+bool rill_throttle_apply(const struct rill_throttle *throttle)
+{
+    pid_t tid = syscall(SYS_gettid);
+    bool ok = true;
+
+    // Both are per-thread attributes on linux. Failures are only reported via
+    // the return value as the priorities are advisory.
+    if (throttle->opts.nice) {
+        if (setpriority(PRIO_PROCESS, tid, throttle->opts.nice) == -1) ok = false;
+    }
+
+    int ioprio = ioprio_value(throttle->opts.ioprio, throttle->opts.ioprio_level);
+    if (ioprio) {
+        if (syscall(SYS_ioprio_set, ioprio_who_process, tid, ioprio) == -1) ok = false;
+    }
+
+    return ok;
+}
+
+// Refills the bucket and returns how long the caller must sleep to pay for the
+// bytes. The bucket is allowed to go into debt which spreads a burst of charges
+// over the callers in the order they arrived.
+static uint64_t throttle_take(struct rill_throttle *throttle, size_t rate, size_t bytes)
+{
+    pthread_mutex_lock(&throttle->lock);
+
+    uint64_t now = now_nanos();
+
+    // The burst only applies to the sustained rate.
+    double burst = rate;
+    if (rate == throttle->opts.bytes_per_sec && throttle->opts.burst_bytes)
+        burst = throttle->opts.burst_bytes;
+
+    throttle->tokens += (double) (now - throttle->refilled) * rate / sec_nanos;
+    if (throttle->tokens > burst) throttle->tokens = burst;
+    throttle->refilled = now;
+
+    throttle->tokens -= bytes;
+    double debt = throttle->tokens < 0 ? -throttle->tokens : 0;
+
+    pthread_mutex_unlock(&throttle->lock);
+
+    return debt * sec_nanos / rate;
+}
+
+void rill_throttle_charge(struct rill_throttle *throttle, size_t bytes)
+{
+    atomic_fetch_add(&throttle->bytes, bytes);
+
+    bool pressure = atomic_load(&throttle->pressure);
+    size_t rate = pressure ?
+        throttle->opts.pressure_bytes_per_sec : throttle->opts.bytes_per_sec;
+
+    if (pressure && !rate) {
+        uint64_t start = now_nanos();
+        while (atomic_load(&throttle->pressure)) nanosleep(&pause_poll, NULL);
+        atomic_fetch_add(&throttle->paused_ns, now_nanos() - start);
+
+        rate = throttle->opts.bytes_per_sec;
+    }
+
+    if (!rate) return;
+
+    uint64_t wait = throttle_take(throttle, rate, bytes);
+    if (!wait) return;
+
+    sleep_nanos(wait);
+    atomic_fetch_add(&throttle->throttled_ns, wait);
+}
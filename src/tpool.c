@@ -0,0 +1,166 @@
+/* tpool.c
+   agent (agent@local), 19 Oct 2026
+   FreeBSD-style copyright and disclaimer apply
+*/
+
+#include "tpool.h"
+#include "rill.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+
+// -----------------------------------------------------------------------------
+// tpool
+// -----------------------------------------------------------------------------
+
+struct task
+{
+    struct task *next;
+    tpool_fn_t fn;
+    void *data;
+};
+
+struct tpool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t idle;
+
+    bool done;
+    size_t running;
+    struct task *head, **tail;
+
+    size_t len;
+    pthread_t threads[];
+};
+
+static __thread bool tpool_owned = false;
+
+bool tpool_worker(void)
+{
+    return tpool_owned;
+}
+
+static void *tpool_run(void *data)
+{
+    struct tpool *pool = data;
+    tpool_owned = true;
+
+    pthread_mutex_lock(&pool->lock);
+
+    while (true) {
+        while (!pool->head && !pool->done)
+            pthread_cond_wait(&pool->work, &pool->lock);
+        if (!pool->head) break;
+
+        struct task *task = pool->head;
+        pool->head = task->next;
+        if (!pool->head) pool->tail = &pool->head;
+        pool->running++;
+
+        pthread_mutex_unlock(&pool->lock);
+        task->fn(task->data);
+        free(task);
+        pthread_mutex_lock(&pool->lock);
+
+        pool->running--;
+        if (!pool->head && !pool->running) pthread_cond_broadcast(&pool->idle);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+struct tpool *tpool_new(size_t threads)
+{
+    struct tpool *pool = calloc(1, sizeof(*pool) + threads * sizeof(pool->threads[0]));
+    if (!pool) {
+        rill_fail("unable to allocate thread pool of '%lu' threads", threads);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    pool->tail = &pool->head;
+
+    for (; pool->len < threads; pool->len++) {
+        int err = pthread_create(&pool->threads[pool->len], NULL, tpool_run, pool);
+        if (err) {
+            errno = err;
+            rill_fail_errno("unable to create thread pool thread '%lu'", pool->len);
+            tpool_free(pool);
+            return NULL;
+        }
+    }
+
+    return pool;
+}
+
+// Waits for all the pending tasks to complete before joining the threads.
+void tpool_free(struct tpool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->done = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (size_t i = 0; i < pool->len; ++i)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->idle);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+bool tpool_pin(struct tpool *pool, const size_t *cpus, size_t len)
+{
+    for (size_t i = 0; i < pool->len && len; ++i) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus[i % len], &set);
+
+        int err = pthread_setaffinity_np(pool->threads[i], sizeof(set), &set);
+        if (err) {
+            errno = err;
+            rill_fail_errno("unable to pin thread '%lu' to cpu '%lu'", i, cpus[i % len]);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Falls back to executing the task inline if there are no threads to pick it
+// up or if the task can't be queued.
+void tpool_submit(struct tpool *pool, tpool_fn_t fn, void *data)
+{
+    struct task *task = NULL;
+    if (pool->len) task = calloc(1, sizeof(*task));
+
+    if (!task) {
+        fn(data);
+        return;
+    }
+
+    *task = (struct task) { .fn = fn, .data = data };
+
+    pthread_mutex_lock(&pool->lock);
+    *pool->tail = task;
+    pool->tail = &task->next;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void tpool_wait(struct tpool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->head || pool->running)
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,34 @@
+/* tpool.h
+   agent (agent@local), 19 Oct 2026
+   FreeBSD-style copyright and disclaimer apply
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+
+// -----------------------------------------------------------------------------
+// tpool
+// -----------------------------------------------------------------------------
+
+// Minimal fixed-size thread pool. Tasks can be submitted from within other
+// tasks. A pool of 0 threads executes every task inline on submission.
+
+struct tpool;
+
+typedef void (*tpool_fn_t) (void *data);
+
+struct tpool *tpool_new(size_t threads);
+void tpool_free(struct tpool *pool);
+
+// Pins the threads of the pool round-robin on the given cpus.
+bool tpool_pin(struct tpool *pool, const size_t *cpus, size_t len);
+
+void tpool_submit(struct tpool *pool, tpool_fn_t fn, void *data);
+void tpool_wait(struct tpool *pool);
+
+// True if the calling thread is owned by a pool as opposed to a task executed
+// inline on the thread of its submitter.
+bool tpool_worker(void);
@@ -0,0 +1,202 @@
+/* union.c
+   agent (agent@local), 19 Oct 2026
+   FreeBSD-style copyright and disclaimer apply
+*/
+
+#include "union.h"
+#include "utils.h"
+
+#include <assert.h>
+#include <string.h>
+
+#ifdef __AVX2__
+# include <immintrin.h>
+#endif
+
+
+// -----------------------------------------------------------------------------
+// out
+// -----------------------------------------------------------------------------
+
+// Duplicates can only be adjacent in the output so they're dropped by not
+// advancing over a value equal to the previous one. Values are never 0 which
+// makes it a safe initial value.
+struct union_out
+{
+    uint64_t *it;
+    size_t len;
+    uint64_t last;
+};
+
+static inline void out_push(struct union_out *out, uint64_t val)
+{
+    out->it[out->len] = val;
+    out->len += val != out->last;
+    out->last = val;
+}
+
+static void merge_scalar(
+        const uint64_t *lhs, size_t lhs_len,
+        const uint64_t *rhs, size_t rhs_len,
+        struct union_out *out)
+{
+    size_t i = 0, j = 0;
+
+    while (i < lhs_len && j < rhs_len)
+        out_push(out, lhs[i] <= rhs[j] ? lhs[i++] : rhs[j++]);
+
+    while (i < lhs_len) out_push(out, lhs[i++]);
+    while (j < rhs_len) out_push(out, rhs[j++]);
+}
+
+
+// -----------------------------------------------------------------------------
+// simd
+// -----------------------------------------------------------------------------
+
+#ifdef __AVX2__
+
+// AVX2 only has a signed comparison of 64 bits integers so values are biased
+// by the sign bit while they're in a register to preserve their order.
+static inline __m256i simd_load(const uint64_t *it, __m256i bias)
+{
+    return _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) it), bias);
+}
+
+static inline void simd_store(uint64_t *it, __m256i val, __m256i bias)
+{
+    _mm256_storeu_si256((__m256i *) it, _mm256_xor_si256(val, bias));
+}
+
+static inline void simd_minmax(__m256i *lo, __m256i *hi)
+{
+    __m256i gt = _mm256_cmpgt_epi64(*lo, *hi);
+    __m256i min = _mm256_blendv_epi8(*lo, *hi, gt);
+    __m256i max = _mm256_blendv_epi8(*hi, *lo, gt);
+    *lo = min;
+    *hi = max;
+}
+
+// Sorts a bitonic sequence of 4 values.
+static inline __m256i simd_bitonic(__m256i x)
+{
+    __m256i y = _mm256_permute4x64_epi64(x, 0x4E);
+    simd_minmax(&x, &y);
+    x = _mm256_blend_epi32(x, y, 0xF0);
+
+    y = _mm256_permute4x64_epi64(x, 0xB1);
+    simd_minmax(&x, &y);
+    return _mm256_blend_epi32(x, y, 0xCC);
+}
+
+// Bitonic merge network of two sorted vectors which leaves the 4 smallest
+// values in lo and the 4 largest in hi.
+static inline void simd_merge(__m256i *lo, __m256i *hi)
+{
+    *hi = _mm256_permute4x64_epi64(*hi, 0x1B);
+    simd_minmax(lo, hi);
+    *lo = simd_bitonic(*lo);
+    *hi = simd_bitonic(*hi);
+}
+
+// The next block is always loaded from the list with the smallest head which
+// guarantees that the 4 smallest values of the network are smaller than
+// anything left in either list. The network stops as soon as that list has
+// less than a full block left and the remainder is merged by the scalar loop.
+static void merge_simd(
+        const uint64_t *lhs, size_t lhs_len,
+        const uint64_t *rhs, size_t rhs_len,
+        struct union_out *out)
+{
+    const __m256i bias = _mm256_set1_epi64x(INT64_MIN);
+
+    __m256i lo = simd_load(lhs, bias);
+    __m256i hi = simd_load(rhs, bias);
+    size_t i = 4, j = 4;
+
+    uint64_t buf[4];
+    while (true) {
+        simd_merge(&lo, &hi);
+
+        simd_store(buf, lo, bias);
+        for (size_t k = 0; k < 4; ++k) out_push(out, buf[k]);
+
+        bool take_lhs = i < lhs_len && (j == rhs_len || lhs[i] <= rhs[j]);
+        if (take_lhs && i + 4 <= lhs_len) { lo = simd_load(lhs + i, bias); i += 4; }
+        else if (!take_lhs && j + 4 <= rhs_len) { lo = simd_load(rhs + j, bias); j += 4; }
+        else break;
+    }
+
+    simd_store(buf, hi, bias);
+
+    // At most one of the lists has a full block left.
+    uint64_t small[4 + 3];
+    struct union_out tail = { .it = small };
+    if (lhs_len - i < 4) {
+        merge_scalar(buf, 4, lhs + i, lhs_len - i, &tail);
+        merge_scalar(small, tail.len, rhs + j, rhs_len - j, out);
+    }
+    else {
+        merge_scalar(buf, 4, rhs + j, rhs_len - j, &tail);
+        merge_scalar(small, tail.len, lhs + i, lhs_len - i, out);
+    }
+}
+
+#endif
+
+
+// -----------------------------------------------------------------------------
+// union
+// -----------------------------------------------------------------------------
+
+size_t union_merge(
+        const uint64_t *lhs, size_t lhs_len,
+        const uint64_t *rhs, size_t rhs_len,
+        uint64_t *out)
+{
+    struct union_out ret = { .it = out };
+
+#ifdef __AVX2__
+    if (lhs_len >= 4 && rhs_len >= 4) {
+        merge_simd(lhs, lhs_len, rhs, rhs_len, &ret);
+        return ret.len;
+    }
+#endif
+
+    merge_scalar(lhs, lhs_len, rhs, rhs_len, &ret);
+    return ret.len;
+}
+
+// Adjacent runs are merged pairwise until a single run is left which bounds
+// the work to a logarithmic number of passes over the values.
+size_t union_runs(uint64_t *vals, uint64_t *tmp, size_t *offs, size_t runs)
+{
+    if (!runs) return 0;
+    assert(!offs[0]);
+
+    uint64_t *src = vals, *dst = tmp;
+    while (runs > 1) {
+        size_t len = 0, merged = 0;
+
+        for (size_t i = 0; i < runs; i += 2) {
+            size_t begin = offs[i], mid = offs[i + 1];
+            size_t end = i + 1 < runs ? offs[i + 2] : mid;
+
+            offs[merged++] = len;
+            len += union_merge(
+                    src + begin, mid - begin,
+                    src + mid, end - mid,
+                    dst + len);
+        }
+        offs[merged] = len;
+
+        uint64_t *swap = src;
+        src = dst;
+        dst = swap;
+        runs = merged;
+    }
+
+    size_t len = offs[1];
+    if (src != vals) memcpy(vals, src, len * sizeof(*vals));
+    return len;
+}
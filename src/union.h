@@ -0,0 +1,30 @@
+/* union.h
+   agent (agent@local), 19 Oct 2026
+   FreeBSD-style copyright and disclaimer apply
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// -----------------------------------------------------------------------------
+// union
+// -----------------------------------------------------------------------------
+
+// Unions of sorted lists of values which remove duplicates as they merge. The
+// values must be non-zero and every input list must be sorted and free of
+// duplicates.
+
+// Merges lhs and rhs into out which must have room for both lists. Returns the
+// number of values written to out.
+size_t union_merge(
+        const uint64_t *lhs, size_t lhs_len,
+        const uint64_t *rhs, size_t rhs_len,
+        uint64_t *out);
+
+// Merges the runs of vals delimited by offs, which holds runs + 1 offsets, back
+// into vals using tmp as scratch space of the same size. Returns the number of
+// values left in vals. offs is clobbered.
+size_t union_runs(uint64_t *vals, uint64_t *tmp, size_t *offs, size_t runs);
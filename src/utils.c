@@ -11,6 +11,7 @@
 #include <stdarg.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 
 // -----------------------------------------------------------------------------
@@ -89,34 +90,88 @@ static bool is_rill_file(const char *name)
     return strstr(name, ext);
 }
 
-size_t rill_scan_dir(const char *dir, struct rill_store **list, size_t cap)
+ssize_t scan_dir_files(const char *dir, char (**names)[NAME_MAX + 1])
 {
+    *names = NULL;
+
     DIR *dir_handle = opendir(dir);
     if (!dir_handle) {
         if (errno == ENOENT) return 0;
         rill_fail_errno("unable to open dir '%s'", dir);
-        return 0;
+        return -1;
     }
 
-    size_t len = 0;
+    size_t len = 0, cap = 0;
     struct dirent *entry = NULL;
     while ((entry = readdir(dir_handle))) {
         // I found the one filesystem that doesn't support dirent->d_type...
         if (!is_rill_file(entry->d_name)) continue;
 
-        char file[PATH_MAX];
-        snprintf(file, sizeof(file), "%s/%s", dir, entry->d_name);
-
-        list[len] = rill_store_open(file);
-        if (!list[len]) continue;
-
-        len++;
         if (len == cap) {
-            rill_fail("rotate: too many files to rotate in '%s'", dir);
-            break;
+            cap = cap ? cap * 2 : 64;
+            char (*ret)[NAME_MAX + 1] = realloc(*names, cap * sizeof(**names));
+            if (!ret) {
+                rill_fail("unable to allocate '%lu' file names for '%s'", cap, dir);
+                closedir(dir_handle);
+                free(*names);
+                *names = NULL;
+                return -1;
+            }
+            *names = ret;
         }
+
+        snprintf((*names)[len], sizeof((*names)[len]), "%s", entry->d_name);
+        len++;
     }
 
     closedir(dir_handle);
     return len;
 }
+
+
+// -----------------------------------------------------------------------------
+// trash
+// -----------------------------------------------------------------------------
+
+bool trash_dir(const char *dir, char *out, size_t len)
+{
+    if (snprintf(out, len, "%s/trash", dir) < (int) len) return true;
+
+    rill_fail("trash path too long for '%s'", dir);
+    return false;
+}
+
+bool trash_file(const char *file)
+{
+    char dir[PATH_MAX];
+    const char *base = strrchr(file, '/');
+    if (base) snprintf(dir, sizeof(dir), "%.*s", (int) (base - file), file);
+    else snprintf(dir, sizeof(dir), ".");
+    base = base ? base + 1 : file;
+
+    char trash[PATH_MAX];
+    if (!trash_dir(dir, trash, sizeof(trash))) return false;
+    if (mkdir(trash, 0775) == -1 && errno != EEXIST) {
+        rill_fail_errno("unable to create trash '%s'", trash);
+        return false;
+    }
+
+    // Store names are reused by later rotations so older versions of the file
+    // might still be in the trash.
+    char dest[PATH_MAX];
+    int len = snprintf(dest, sizeof(dest), "%s/%s", trash, base);
+    for (size_t i = 0; len < (int) sizeof(dest) && !access(dest, F_OK); ++i)
+        len = snprintf(dest, sizeof(dest), "%s/%s.%lu", trash, base, i);
+
+    if (len >= (int) sizeof(dest)) {
+        rill_fail("trash path too long for '%s'", file);
+        return false;
+    }
+
+    if (rename(file, dest) == -1) {
+        rill_fail_errno("unable to move '%s' to '%s'", file, dest);
+        return false;
+    }
+
+    return true;
+}
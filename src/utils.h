@@ -9,7 +9,10 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stddef.h>
+#include <stdbool.h>
 #include <string.h>
+#include <limits.h>
+#include <sys/types.h>
 
 
 // -----------------------------------------------------------------------------
@@ -84,3 +87,24 @@ static inline size_t to_vma_len(size_t len)
     if (!(len % page_len)) return len;
     return (len & ~(page_len - 1)) + page_len;
 }
+
+
+// -----------------------------------------------------------------------------
+// scan_dir
+// -----------------------------------------------------------------------------
+
+// Lists the names of the store files in the directory without opening them.
+// The names must be freed by the caller. Returns -1 on failure.
+ssize_t scan_dir_files(const char *dir, char (**names)[NAME_MAX + 1]);
+
+
+// -----------------------------------------------------------------------------
+// trash
+// -----------------------------------------------------------------------------
+
+// Path of the trash directory of the database directory.
+bool trash_dir(const char *dir, char *out, size_t len);
+
+// Moves the file into the trash directory next to it where it's progressively
+// freed by rill_reclaim.
+bool trash_file(const char *file);
@@ -0,0 +1,119 @@
+/* acc_bench.c
+   agent (agent@local), 19 Oct 2026
+   FreeBSD-style copyright and disclaimer apply
+*/
+
+#include "test.h"
+
+#include <time.h>
+#include <pthread.h>
+
+
+// -----------------------------------------------------------------------------
+// bench
+// -----------------------------------------------------------------------------
+
+static const char *dir = "bench.acc.db";
+
+enum
+{
+    max_producers = 32,
+    producer_pairs = 4 * 1000 * 1000,
+    acc_cap = 1 << 20,
+};
+
+enum { batch_len = 64 };
+
+struct producer
+{
+    size_t id;
+    bool multi_producer;
+    bool batch;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void *produce(void *data)
+{
+    struct producer *producer = data;
+
+    struct rill_acc_opts opts = { .multi_producer = producer->multi_producer };
+    struct rill_acc *acc = rill_acc_open_ex(dir, rill_acc_read_only, &opts);
+    if (!acc) rill_abort();
+
+    if (producer->batch) {
+        struct rill_kv kvs[batch_len];
+        for (size_t i = 0; i < producer_pairs; i += batch_len) {
+            for (size_t j = 0; j < batch_len; ++j)
+                kvs[j] = (struct rill_kv) { .key = producer->id + 1, .val = i + j + 1 };
+            rill_acc_ingest_batch(acc, kvs, batch_len);
+        }
+    }
+    else {
+        for (size_t i = 0; i < producer_pairs; ++i)
+            rill_acc_ingest(acc, producer->id + 1, i + 1);
+    }
+
+    rill_acc_close(acc);
+    return NULL;
+}
+
+static void bench(size_t producers, bool multi_producer, bool batch)
+{
+    rm(dir);
+
+    struct rill_acc *acc = rill_acc_open(dir, acc_cap);
+    if (!acc) rill_abort();
+
+    pthread_t threads[producers];
+    struct producer args[producers];
+
+    double start = now();
+
+    for (size_t i = 0; i < producers; ++i) {
+        args[i] = (struct producer) {
+            .id = i,
+            .multi_producer = multi_producer,
+            .batch = batch,
+        };
+        if (pthread_create(&threads[i], NULL, produce, &args[i])) abort();
+    }
+
+    for (size_t i = 0; i < producers; ++i)
+        pthread_join(threads[i], NULL);
+
+    double elapsed = now() - start;
+    double rate = (producers * producer_pairs) / elapsed;
+
+    printf("%s%s producers=%2zu elapsed=%6.3fs rate=%7.2fM pairs/s\n",
+            multi_producer ? "mp" : "sp", batch ? "-batch" : "      ",
+            producers, elapsed, rate / 1e6);
+
+    rill_acc_close(acc);
+    rm(dir);
+}
+
+
+// -----------------------------------------------------------------------------
+// main
+// -----------------------------------------------------------------------------
+
+int main(int argc, char **argv)
+{
+    (void) argc, (void) argv;
+
+    bench(1, false, false);
+    bench(1, false, true);
+
+    for (size_t producers = 1; producers <= max_producers; producers *= 2) {
+        bench(producers, true, false);
+        bench(producers, true, true);
+    }
+
+    return 0;
+}
@@ -0,0 +1,468 @@
+/* acc_test.c
+   agent (agent@local), 19 Oct 2026
+   FreeBSD-style copyright and disclaimer apply
+*/
+
+#include "test.h"
+
+#include <time.h>
+#include <pthread.h>
+#include <limits.h>
+
+
+// -----------------------------------------------------------------------------
+// utils
+// -----------------------------------------------------------------------------
+
+static size_t count_pairs(const char *dir)
+{
+    struct rill_query *query = rill_query_open(dir);
+    assert(query);
+
+    struct rill_pairs *pairs = rill_query_all(query, rill_col_a);
+    assert(pairs);
+
+    size_t len = pairs->len;
+    rill_pairs_free(pairs);
+    rill_query_close(query);
+
+    return len;
+}
+
+static void acc_dump(struct rill_acc *acc, const char *dir, size_t i)
+{
+    char file[PATH_MAX];
+    snprintf(file, sizeof(file), "%s/%010lu.rill", dir, i);
+    assert(rill_acc_write(acc, file, i));
+}
+
+
+// -----------------------------------------------------------------------------
+// single
+// -----------------------------------------------------------------------------
+
+bool test_single(void)
+{
+    const char *dir = "test.acc.single.db";
+    rm(dir);
+
+    enum { keys = 100, vals = 10 };
+
+    struct rill_acc *acc = rill_acc_open(dir, keys * vals);
+    assert(acc);
+
+    for (size_t key = 1; key <= keys; ++key) {
+        for (size_t val = 1; val <= vals; ++val)
+            rill_acc_ingest(acc, key, val);
+    }
+
+    acc_dump(acc, dir, 0);
+    acc_dump(acc, dir, 1); // nothing left to write
+    assert(count_pairs(dir) == keys * vals);
+
+    rill_acc_close(acc);
+    rm(dir);
+
+    return true;
+}
+
+
+// -----------------------------------------------------------------------------
+// batch
+// -----------------------------------------------------------------------------
+
+bool test_batch(void)
+{
+    const char *dir = "test.acc.batch.db";
+    rm(dir);
+
+    enum { batch = 50, batches = 20 };
+
+    // Small enough that most batches wrap around the end of the ring.
+    struct rill_acc *acc = rill_acc_open(dir, batch);
+    assert(acc);
+
+    struct rill_kv kvs[batch];
+    for (size_t i = 0; i < batches; ++i) {
+        for (size_t j = 0; j < batch; ++j)
+            kvs[j] = (struct rill_kv) { .key = i + 1, .val = j + 1 };
+
+        rill_acc_ingest_batch(acc, kvs, batch);
+        acc_dump(acc, dir, i);
+    }
+
+    assert(count_pairs(dir) == batch * batches);
+
+    rill_acc_close(acc);
+    rm(dir);
+
+    return true;
+}
+
+
+// -----------------------------------------------------------------------------
+// dedup
+// -----------------------------------------------------------------------------
+
+bool test_dedup(void)
+{
+    const char *dir = "test.acc.dedup.db";
+    rm(dir);
+
+    enum { keys = 100, vals = 10, dups = 3 };
+
+    struct rill_acc_opts opts = { .dedup_len = 64 };
+    struct rill_acc *acc = rill_acc_open_ex(dir, keys * vals * dups, &opts);
+    assert(acc);
+
+    for (size_t key = 1; key <= keys; ++key) {
+        for (size_t val = 1; val <= vals; ++val) {
+            for (size_t i = 0; i < dups; ++i)
+                rill_acc_ingest(acc, key, val);
+        }
+    }
+
+    struct rill_kv kvs[dups];
+    for (size_t i = 0; i < dups; ++i)
+        kvs[i] = (struct rill_kv) { .key = keys + 1, .val = 1 };
+    rill_acc_ingest_batch(acc, kvs, dups);
+
+    struct rill_acc_stats stats = {0};
+    rill_acc_stats(acc, &stats);
+    assert(stats.dedup_suppressed == (keys * vals + 1) * (dups - 1));
+
+    acc_dump(acc, dir, 0);
+    assert(count_pairs(dir) == keys * vals + 1);
+
+    rill_acc_close(acc);
+    rm(dir);
+
+    return true;
+}
+
+// Pairs that are still active after a flush must reach the next store.
+bool test_dedup_flush(void)
+{
+    const char *dir = "test.acc.dedup_flush.db";
+    rm(dir);
+
+    struct rill_acc_opts opts = { .dedup_len = 64 };
+    struct rill_acc *acc = rill_acc_open_ex(dir, 64, &opts);
+    assert(acc);
+
+    rill_acc_ingest(acc, 1, 10);
+    acc_dump(acc, dir, 0);
+
+    rill_acc_ingest(acc, 1, 10);
+    rill_acc_ingest(acc, 1, 10);
+    acc_dump(acc, dir, 1);
+
+    struct rill_acc_stats stats = {0};
+    rill_acc_stats(acc, &stats);
+    assert(stats.dedup_suppressed == 1);
+
+    for (size_t i = 0; i < 2; ++i) {
+        char file[PATH_MAX];
+        snprintf(file, sizeof(file), "%s/%010lu.rill", dir, i);
+
+        struct rill_store *store = rill_store_open(file);
+        assert(store);
+
+        struct rill_pairs *pairs = rill_store_query_key(store, 1, rill_pairs_new(1));
+        assert(pairs && pairs->len == 1);
+        assert(pairs->data[0].key == 1 && pairs->data[0].val == 10);
+
+        rill_pairs_free(pairs);
+        rill_store_close(store);
+    }
+
+    rill_acc_close(acc);
+    rm(dir);
+
+    return true;
+}
+
+
+// -----------------------------------------------------------------------------
+// runs
+// -----------------------------------------------------------------------------
+
+static void check_query_all(
+        const char *dir, struct rill_pairs *exp, enum rill_col col)
+{
+    struct rill_query *query = rill_query_open(dir);
+    struct rill_pairs *pairs = rill_query_all(query, col);
+
+    assert(pairs->len == exp->len);
+    for (size_t i = 0; i < exp->len; ++i)
+        assert(!rill_kv_cmp(&pairs->data[i], &exp->data[i]));
+
+    check_query_it(query, col);
+
+    rill_pairs_free(pairs);
+    rill_query_close(query);
+}
+
+bool test_runs(void)
+{
+    const char *dir = "test.acc.runs.db";
+    rm(dir);
+
+    enum { len = 5000 };
+
+    struct rill_acc_opts opts = { .sort_run_len = 100 };
+    struct rill_acc *acc = rill_acc_open_ex(dir, 2 * len, &opts);
+    assert(acc);
+
+    struct rng rng = rng_make(0);
+    struct rill_pairs *exp = rill_pairs_new(2 * len);
+
+    for (size_t i = 0; i < len; ++i) {
+        rill_key_t key = rng_gen_range(&rng, 1, rng_range_key);
+        rill_val_t val = rng_gen_range(&rng, 1, rng_range_val);
+        rill_acc_ingest(acc, key, val);
+        exp = rill_pairs_push(exp, key, val);
+    }
+
+    // Give the sorter a chance to go through most of the ring.
+    nanosleep(&(struct timespec) { .tv_nsec = 50 * 1000 * 1000 }, NULL);
+    acc_dump(acc, dir, 0);
+
+    // Flushed immediately so mostly made of the tail of the ring.
+    for (size_t i = 0; i < len; ++i) {
+        rill_key_t key = rng_gen_range(&rng, 1, rng_range_key);
+        rill_val_t val = rng_gen_range(&rng, 1, rng_range_val);
+        rill_acc_ingest(acc, key, val);
+        exp = rill_pairs_push(exp, key, val);
+    }
+    assert(rill_acc_write_ex(acc, "test.acc.runs.db/1.rill", 1, rill_store_col_a_only));
+
+    rill_pairs_compact(exp);
+    check_query_all(dir, exp, rill_col_a);
+
+    rill_pairs_invert(exp);
+    rill_pairs_compact(exp);
+    check_query_all(dir, exp, rill_col_b);
+
+    rill_pairs_free(exp);
+    rill_acc_close(acc);
+    rm(dir);
+
+    return true;
+}
+
+
+// -----------------------------------------------------------------------------
+// multi
+// -----------------------------------------------------------------------------
+
+enum { producers = 8, producer_pairs = 100 * 1000 };
+
+struct producer
+{
+    const char *dir;
+    size_t id;
+};
+
+static void *produce(void *data)
+{
+    struct producer *producer = data;
+
+    // Each producer maps the accumulator on its own to mimic separate
+    // processes.
+    struct rill_acc_opts opts = { .multi_producer = true };
+    struct rill_acc *acc = rill_acc_open_ex(producer->dir, rill_acc_read_only, &opts);
+    assert(acc);
+
+    for (size_t i = 0; i < producer_pairs; ++i)
+        rill_acc_ingest(acc, producer->id + 1, i + 1);
+
+    rill_acc_close(acc);
+    return NULL;
+}
+
+bool test_multi(void)
+{
+    const char *dir = "test.acc.multi.db";
+    rm(dir);
+
+    struct rill_acc_opts opts = { .multi_producer = true };
+    struct rill_acc *acc = rill_acc_open_ex(dir, producers * producer_pairs, &opts);
+    assert(acc);
+
+    pthread_t threads[producers];
+    struct producer args[producers];
+    for (size_t i = 0; i < producers; ++i) {
+        args[i] = (struct producer) { .dir = dir, .id = i };
+        assert(!pthread_create(&threads[i], NULL, produce, &args[i]));
+    }
+
+    // Flushing while producing exercises the partially published slots.
+    size_t dumps = 0;
+    for (; dumps < 10; ++dumps) acc_dump(acc, dir, dumps);
+
+    for (size_t i = 0; i < producers; ++i)
+        assert(!pthread_join(threads[i], NULL));
+
+    acc_dump(acc, dir, dumps);
+    assert(count_pairs(dir) == producers * producer_pairs);
+
+    rill_acc_close(acc);
+    rm(dir);
+
+    return true;
+}
+
+
+// -----------------------------------------------------------------------------
+// spill
+// -----------------------------------------------------------------------------
+
+static void check_spill(struct rill_acc_opts opts)
+{
+    const char *dir = "test.acc.spill.db";
+    rm(dir);
+
+    enum { keys = 100, vals = 50, rounds = 3 };
+    opts.spill_cap = keys * vals;
+
+    struct rill_acc *acc = rill_acc_open_ex(dir, 32, &opts);
+    assert(acc);
+
+    struct rill_acc_stats stats = {0};
+    rill_acc_stats(acc, &stats);
+    const size_t ring_len = stats.ring_len;
+    assert(ring_len < keys * vals);
+    assert(stats.spill_len == keys * vals);
+
+    for (size_t round = 0; round < rounds; ++round) {
+        for (size_t key = 1; key <= keys; ++key) {
+            struct rill_kv kvs[vals];
+            for (size_t val = 1; val <= vals; ++val)
+                kvs[val - 1] = (struct rill_kv) { .key = key, .val = round * vals + val };
+
+            if (key % 2) rill_acc_ingest_batch(acc, kvs, vals);
+            else for (size_t i = 0; i < vals; ++i) rill_acc_ingest(acc, kvs[i].key, kvs[i].val);
+        }
+
+        acc_dump(acc, dir, round);
+        assert(count_pairs(dir) == (round + 1) * keys * vals);
+    }
+
+    rill_acc_stats(acc, &stats);
+    assert(stats.ring_hwm == ring_len);
+    assert(stats.spill_hwm == keys * vals - ring_len);
+
+    rill_acc_close(acc);
+    rm(dir);
+}
+
+bool test_spill(void)
+{
+    check_spill((struct rill_acc_opts) {0});
+    check_spill((struct rill_acc_opts) { .multi_producer = true });
+    check_spill((struct rill_acc_opts) { .sort_run_len = 16 });
+    check_spill((struct rill_acc_opts) { .huge_pages = true });
+    return true;
+}
+
+
+// -----------------------------------------------------------------------------
+// view
+// -----------------------------------------------------------------------------
+
+static void check_view_key(
+        struct rill_query *query, rill_key_t key, size_t vals)
+{
+    struct rill_pairs *pairs = rill_query_key(query, key, rill_pairs_new(1));
+    assert(pairs && pairs->len == vals);
+    for (size_t i = 0; i < vals; ++i)
+        assert(pairs->data[i].key == key && pairs->data[i].val == i + 1);
+    rill_pairs_free(pairs);
+}
+
+bool test_view(void)
+{
+    const char *dir = "test.acc.view.db";
+    rm(dir);
+
+    enum { keys = 100, vals = 20 };
+
+    struct rill_acc *acc = rill_acc_open(dir, keys * vals);
+    assert(acc);
+
+    for (size_t key = 1; key <= keys; ++key)
+        rill_acc_ingest(acc, key, 1);
+    acc_dump(acc, dir, 0);
+
+    struct rill_query *query = rill_query_open(dir);
+    assert(query);
+    assert(rill_query_attach(query, acc));
+
+    // Only the pairs that reach the view after the query was opened are new.
+    for (size_t val = 2; val <= vals; ++val) {
+        for (size_t key = 1; key <= keys; ++key)
+            rill_acc_ingest(acc, key, val);
+
+        for (size_t key = 1; key <= keys; key += 7)
+            check_view_key(query, key, val);
+
+        if (val == vals / 2) acc_dump(acc, dir, val);
+    }
+
+    rill_val_t val = vals;
+    struct rill_pairs *pairs = rill_query_vals(query, &val, 1, rill_pairs_new(1));
+    assert(pairs && pairs->len == keys);
+    for (size_t i = 0; i < keys; ++i)
+        assert(pairs->data[i].key == vals && pairs->data[i].val == i + 1);
+    rill_pairs_free(pairs);
+
+    pairs = rill_query_all(query, rill_col_a);
+    assert(pairs && pairs->len == keys * vals);
+    rill_pairs_free(pairs);
+
+    // The range spans both the stores and the view.
+    pairs = rill_query_key_range(query, 10, 20, rill_pairs_new(1));
+    assert(pairs && pairs->len == 10 * vals);
+    for (size_t i = 0; i < pairs->len; ++i) {
+        assert(pairs->data[i].key == 10 + i / vals);
+        assert(pairs->data[i].val == 1 + i % vals);
+    }
+    rill_pairs_free(pairs);
+
+    pairs = rill_query_val_range(query, vals - 1, vals + 1, rill_pairs_new(1));
+    assert(pairs && pairs->len == 2 * keys);
+    rill_pairs_free(pairs);
+
+    // The view overlaps with the last store written.
+    check_query_it(query, rill_col_a);
+    check_query_it(query, rill_col_b);
+
+    rill_query_close(query);
+    rill_acc_close(acc);
+    rm(dir);
+
+    return true;
+}
+
+
+// -----------------------------------------------------------------------------
+// main
+// -----------------------------------------------------------------------------
+
+int main(int argc, char **argv)
+{
+    (void) argc, (void) argv;
+    bool ret = true;
+
+    ret = ret && test_single();
+    ret = ret && test_batch();
+    ret = ret && test_dedup();
+    ret = ret && test_dedup_flush();
+    ret = ret && test_runs();
+    ret = ret && test_multi();
+    ret = ret && test_spill();
+    ret = ret && test_view();
+
+    return ret ? 0 : 1;
+}
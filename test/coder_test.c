@@ -267,6 +267,31 @@ void check_coder(struct rill_pairs *pairs)
         assert(rill_kv_nil(&kv));
     }
 
+    { /* Batch A */
+        uint8_t *start = buffer;
+        struct decoder coder =
+            make_decoder_at(start, start + len_a, index_b, index_a, 0);
+
+        // Odd batch size to straddle the value lists.
+        enum { cap = 3 };
+        rill_key_t keys[cap];
+        rill_val_t vals[cap];
+
+        size_t i = 0;
+        while (true) {
+            ssize_t len = coder_decode_batch(&coder, keys, vals, cap);
+            assert(len >= 0 && len <= cap);
+
+            for (ssize_t j = 0; j < len; ++j, ++i) {
+                assert(keys[j] == pairs->data[i].key);
+                assert(vals[j] == pairs->data[i].val);
+            }
+            if (len < cap) break;
+        }
+        assert(i == pairs->len);
+        assert(!coder_decode_batch(&coder, keys, vals, cap));
+    }
+
     { /* Decode A */
         for (size_t i = 0; i < pairs->len; ++i) {
             size_t key_idx = 0;
@@ -102,6 +102,120 @@ bool test_index_lookup(void)
     return true;
 }
 
+
+// -----------------------------------------------------------------------------
+// test_index_gallop
+// -----------------------------------------------------------------------------
+
+// Every key in [0, max] is looked up in order and must agree with index_find.
+static void check_gallop(struct index *index, rill_key_t max)
+{
+    size_t pos = 0;
+    for (rill_key_t key = 0; key <= max; ++key) {
+        size_t exp_idx = 0, key_idx = 0;
+        uint64_t exp_off = 0, off = 0;
+
+        bool found = index_find(index, key, &exp_idx, &exp_off);
+        assert(index_gallop(index, key, &pos, &key_idx, &off) == found);
+        if (!found) continue;
+
+        assert(key_idx == exp_idx);
+        assert(off == exp_off);
+        assert(pos == key_idx);
+    }
+    assert(pos == index->len);
+}
+
+bool test_index_gallop(void)
+{
+    struct index *index;
+
+    index = index_from_keys(0, 3, 6, 9, 12, 15, 18, 21, 24, 27);
+    check_gallop(index, 30);
+    free(index);
+
+    index = index_from_keys(0, 3, 4, 5, 6, 7, 8, 9, 12, 27);
+    check_gallop(index, 30);
+    free(index);
+
+    index = index_from_keys(5);
+    check_gallop(index, 10);
+    free(index);
+
+    enum { len = 1000 };
+    index = index_alloc(len);
+    for (size_t i = 0; i < len; ++i) index_put(index, i * i, i);
+    check_gallop(index, len * len);
+
+    // Sparse lookups skip most of the index.
+    size_t pos = 0, key_idx = 0;
+    uint64_t off = 0;
+    assert(index_gallop(index, 100 * 100, &pos, &key_idx, &off) && off == 100);
+    assert(!index_gallop(index, 500 * 500 + 1, &pos, &key_idx, &off) && pos == 501);
+    assert(index_gallop(index, 999 * 999, &pos, &key_idx, &off) && off == 999);
+    free(index);
+
+    return true;
+}
+
+
+// -----------------------------------------------------------------------------
+// test_index_find_group
+// -----------------------------------------------------------------------------
+
+// Groups of every size starting at every key in [0, max] must agree with the
+// lower bounds found by index_gallop.
+static void check_find_group(struct index *index, rill_key_t max)
+{
+    rill_key_t keys[index_group];
+    size_t pos[index_group];
+
+    for (rill_key_t first = 0; first <= max; ++first) {
+        for (size_t len = 1; len <= index_group; ++len) {
+            for (size_t i = 0; i < len; ++i) keys[i] = first + i * i;
+            index_find_group(index, 0, keys, len, pos);
+
+            size_t exp = 0, key_idx = 0;
+            uint64_t off = 0;
+            for (size_t i = 0; i < len; ++i) {
+                (void) index_gallop(index, keys[i], &exp, &key_idx, &off);
+                assert(pos[i] == exp);
+            }
+
+            // Restarting from the lower bound of a smaller key is equivalent.
+            size_t start = pos[0];
+            index_find_group(index, start, keys, len, pos);
+            assert(pos[len - 1] == exp);
+        }
+    }
+}
+
+bool test_index_find_group(void)
+{
+    struct index *index;
+
+    index = index_from_keys(0, 3, 6, 9, 12, 15, 18, 21, 24, 27);
+    check_find_group(index, 30);
+    free(index);
+
+    index = index_from_keys(5);
+    check_find_group(index, 10);
+    free(index);
+
+    index = index_alloc(0);
+    check_find_group(index, 2);
+    free(index);
+
+    enum { len = 1000 };
+    index = index_alloc(len);
+    for (size_t i = 0; i < len; ++i) index_put(index, i * 3, i);
+    check_find_group(index, len * 3);
+    free(index);
+
+    return true;
+}
+
+
 // -----------------------------------------------------------------------------
 // main
 // -----------------------------------------------------------------------------
@@ -113,6 +227,8 @@ int main(int argc, char **argv)
 
     ret = ret && test_index_build();
     ret = ret && test_index_lookup();
+    ret = ret && test_index_gallop();
+    ret = ret && test_index_find_group();
 
     return ret ? 0 : 1;
 }
@@ -1,4 +1,7 @@
 #include "test.h"
+#include "union.h"
+
+#include <sys/stat.h>
 
 bool test_sequence()
 {
@@ -62,8 +65,310 @@ bool test_sequence()
     return true;
 }
 
+static void check_query(struct rill_query *query, size_t len)
+{
+    assert(query);
+
+    struct rill_pairs *pairs = rill_query_key(query, 1, rill_pairs_new(1));
+    assert(pairs->len == len);
+    rill_pairs_free(pairs);
+
+    pairs = rill_query_key_ts(query, 1, 100, 200, rill_pairs_new(1));
+    assert(pairs->len == 100);
+    for (size_t i = 0; i < pairs->len; ++i)
+        assert(pairs->data[i].val == 100 + i + 1);
+    rill_pairs_free(pairs);
+
+    const rill_key_t keys[] = { 2, 1 };
+    pairs = rill_query_keys(query, keys, 2, rill_pairs_new(1));
+    assert(pairs->len == len);
+    rill_pairs_free(pairs);
+
+    const rill_val_t vals[] = { len, 1, len + 1 };
+    pairs = rill_query_vals(query, vals, 3, rill_pairs_new(1));
+    assert(pairs->len == 2);
+    assert(pairs->data[0].key == 1 && pairs->data[0].val == 1);
+    assert(pairs->data[1].key == len && pairs->data[1].val == 1);
+    rill_pairs_free(pairs);
+
+    pairs = rill_query_key_range(query, 1, 3, rill_pairs_new(1));
+    assert(pairs->len == len);
+    rill_pairs_free(pairs);
+
+    pairs = rill_query_val_range(query, 2, len + 1, rill_pairs_new(1));
+    assert(pairs->len == len - 1);
+    for (size_t i = 0; i < pairs->len; ++i)
+        assert(pairs->data[i].key == i + 2 && pairs->data[i].val == 1);
+    rill_pairs_free(pairs);
+
+    pairs = rill_query_all(query, rill_col_b);
+    assert(pairs->len == len);
+    for (size_t i = 0; i < pairs->len; ++i)
+        assert(pairs->data[i].key == i + 1 && pairs->data[i].val == 1);
+    rill_pairs_free(pairs);
+
+    check_query_it(query, rill_col_a);
+    check_query_it(query, rill_col_b);
+
+    rill_query_close(query);
+}
+
+static void check_stores(const char *dir, size_t len)
+{
+    struct rill_stores *stores = rill_stores_open(dir);
+    assert(stores);
+    assert(rill_stores_len(stores) == len);
+
+    for (size_t i = 1; i < len; ++i) {
+        assert(rill_stores_entry(stores, i - 1)->ts >
+                rill_stores_entry(stores, i)->ts);
+    }
+
+    size_t first, last;
+    rill_stores_range(stores, 10, 20, &first, &last);
+    assert(last - first == 10);
+    for (size_t i = first; i < last; ++i) {
+        struct rill_store *store = rill_stores_get(stores, i);
+        assert(store);
+        assert(rill_store_ts(store) >= 10 && rill_store_ts(store) < 20);
+    }
+
+    rill_stores_close(stores);
+
+    check_query(rill_query_open(dir), len);
+
+    // Same results when the stores are queried in parallel.
+    const size_t cpus[] = { 0 };
+    struct rill_query_opts opts = { .threads = 4, .cpus = cpus, .cpus_len = 1 };
+    check_query(rill_query_open_ex(dir, &opts), len);
+
+    // Paging in the batches ahead of time doesn't change their results.
+    check_query(rill_query_open_ex(dir, &(struct rill_query_opts) { .page_in = true }), len);
+}
+
+bool test_stores()
+{
+    const char *dir = "test.query.stores.db";
+    rm(dir);
+    mkdir(dir, 0775);
+
+    // Well above the number of stores that used to be supported.
+    enum { len = 2048 };
+
+    struct rill_pairs *pairs = rill_pairs_new(1);
+    for (size_t i = 0; i < len; ++i) {
+        rill_pairs_clear(pairs);
+        pairs = rill_pairs_push(pairs, 1, i + 1);
+
+        char file[PATH_MAX];
+        snprintf(file, sizeof(file), "%s/%010lu.rill", dir, i);
+        assert(rill_store_write(file, i, 0, pairs));
+    }
+    rill_pairs_free(pairs);
+
+    check_stores(dir, len);
+
+    // Stores listed in the manifest are opened lazily.
+    assert(rill_manifest_rebuild(dir, NULL));
+    check_stores(dir, len);
+
+    // A removed store is only skipped once it's missing from the reloaded set
+    // and any other failure to open a store fails the query instead of
+    // returning partial results.
+    char file[PATH_MAX];
+    snprintf(file, sizeof(file), "%s/%010lu.rill", dir, 0UL);
+    assert(!unlink(file));
+
+    struct rill_query_opts opts[] = { {0}, { .threads = 2 } };
+    for (size_t i = 0; i < 2; ++i) {
+        struct rill_query *query = rill_query_open_ex(dir, &opts[i]);
+        struct rill_pairs *pairs = rill_pairs_new(1);
+        assert(!rill_query_key(query, 1, pairs));
+        assert(rill_errno.errno_ == ENOENT);
+        rill_pairs_free(pairs);
+        rill_query_close(query);
+    }
+
+    assert(rill_manifest_rebuild(dir, NULL));
+    for (size_t i = 0; i < 2; ++i) {
+        struct rill_query *query = rill_query_open_ex(dir, &opts[i]);
+        struct rill_pairs *pairs = rill_query_key(query, 1, rill_pairs_new(1));
+        assert(pairs && pairs->len == len - 1);
+        rill_pairs_free(pairs);
+        rill_query_close(query);
+    }
+
+    snprintf(file, sizeof(file), "%s/%010lu.rill", dir, 1UL);
+    FILE *corrupt = fopen(file, "w");
+    assert(corrupt && fputs("corrupt", corrupt) != EOF);
+    fclose(corrupt);
+
+    for (size_t i = 0; i < 2; ++i) {
+        struct rill_query *query = rill_query_open_ex(dir, &opts[i]);
+
+        // The pairs of the caller are left as they were by the failure.
+        struct rill_pairs *pairs = rill_pairs_push(rill_pairs_new(1), 2, 3);
+        assert(!rill_query_key(query, 1, pairs));
+        assert(pairs->len == 1 && pairs->data[0].key == 2 && pairs->data[0].val == 3);
+
+        rill_pairs_free(pairs);
+        rill_query_close(query);
+    }
+
+    rm(dir);
+    return true;
+}
+
+static void check_shards(const struct rill_acc_opts *opts)
+{
+    const char *dir = "test.query.shards.db";
+    enum { shards = 4, keys = 200, vals = 3 };
+
+    rm(dir);
+
+    struct rill_acc *acc = rill_acc_open_ex(dir, keys * vals, opts);
+    struct rill_pairs *exp = rill_pairs_new(keys * vals);
+
+    for (size_t ts = 0; ts < 2; ++ts) {
+        for (rill_key_t key = 1 + ts; key <= keys; key += 2) {
+            for (rill_val_t val = 1; val <= vals; ++val) {
+                rill_acc_ingest(acc, key, key * 10 + val);
+                exp = rill_pairs_push(exp, key, key * 10 + val);
+            }
+        }
+
+        char name[NAME_MAX];
+        snprintf(name, sizeof(name), "%010lu.rill", ts * hour_secs);
+        assert(rill_acc_write_shards(acc, dir, shards, name, ts * hour_secs, 0));
+    }
+    rill_acc_close(acc);
+    rill_pairs_compact(exp);
+
+    struct rill_rotate_stats stats = {0};
+    struct rill_rotate_opts rotate = { .threads = 2, .stats = &stats };
+    assert(rill_rotate_shards(dir, shards, 2 * day_secs, &rotate));
+    assert(stats.stores == shards);
+
+    struct rill_shards *db = rill_shards_open(dir, shards, 2);
+    assert(rill_shards_len(db) == shards);
+
+    // Every shard only contains its own keys.
+    for (size_t i = 0; i < shards; ++i) {
+        struct rill_pairs *pairs = rill_query_all(rill_shards_query(db, i), rill_col_a);
+        assert(pairs->len);
+        for (size_t j = 0; j < pairs->len; ++j)
+            assert(rill_shard(pairs->data[j].key, shards) == i);
+        rill_pairs_free(pairs);
+    }
+
+    {
+        struct rill_pairs *pairs = rill_shards_query_all(db, rill_col_a);
+        assert(pairs->len == exp->len);
+        for (size_t i = 0; i < exp->len; ++i)
+            assert(!rill_kv_cmp(&exp->data[i], &pairs->data[i]));
+        rill_pairs_free(pairs);
+    }
+
+    {
+        rill_key_t query[] = { 1, 2, keys };
+        struct rill_pairs *pairs = rill_shards_query_keys(db, query, 3, rill_pairs_new(1));
+        assert(pairs->len == 3 * vals);
+        for (size_t i = 0; i < pairs->len; ++i)
+            assert(pairs->data[i].val / 10 == pairs->data[i].key);
+        rill_pairs_free(pairs);
+    }
+
+    {
+        // Every key twice and in reverse order spread over every shard.
+        rill_key_t query[2 * keys];
+        for (size_t i = 0; i < 2 * keys; ++i) query[i] = keys - i % keys;
+
+        struct rill_pairs *pairs = rill_shards_query_keys(db, query, 2 * keys, rill_pairs_new(1));
+        assert(pairs->len == exp->len);
+        for (size_t i = 0; i < exp->len; ++i)
+            assert(!rill_kv_cmp(&exp->data[i], &pairs->data[i]));
+        rill_pairs_free(pairs);
+    }
+
+    {
+        rill_val_t query[keys];
+        for (size_t i = 0; i < keys; ++i) query[i] = (i + 1) * 10 + 1;
+
+        struct rill_pairs *pairs = rill_shards_query_vals(db, query, keys, rill_pairs_new(1));
+        assert(pairs->len == keys);
+        for (size_t i = 0; i < pairs->len; ++i)
+            assert(pairs->data[i].key == (i + 1) * 10 + 1);
+        rill_pairs_free(pairs);
+    }
+
+    rill_shards_close(db);
+    rill_pairs_free(exp);
+    rm(dir);
+}
+
+bool test_shards()
+{
+    check_shards(&(struct rill_acc_opts) {0});
+    check_shards(&(struct rill_acc_opts) { .sort_run_len = 64 });
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// union
+// -----------------------------------------------------------------------------
+
+bool test_union()
+{
+    // Values above 2^63 make sure that the order is unsigned.
+    enum { cands = 128 };
+    uint64_t cand[cands];
+    for (size_t i = 0; i < cands; ++i)
+        cand[i] = i < cands / 2 ? i + 1 : (1UL << 63) + i;
+
+    struct rng rng = rng_make(0);
+    for (size_t iterations = 0; iterations < 1000; ++iterations) {
+        size_t runs = rng_gen_range(&rng, 1, 12);
+        double prob = 1.0 / rng_gen_range(&rng, 1, 8);
+
+        uint64_t vals[cands * 12], tmp[cands * 12];
+        size_t offs[12 + 1];
+        bool exp[cands] = {0};
+
+        size_t len = 0;
+        for (size_t run = 0; run < runs; ++run) {
+            offs[run] = len;
+            for (size_t i = 0; i < cands; ++i) {
+                if (!rng_gen_prob(&rng, prob)) continue;
+                vals[len++] = cand[i];
+                exp[i] = true;
+            }
+        }
+        offs[runs] = len;
+
+        len = union_runs(vals, tmp, offs, runs);
+
+        size_t j = 0;
+        for (size_t i = 0; i < cands; ++i) {
+            if (!exp[i]) continue;
+            assert(j < len && vals[j] == cand[i]);
+            j++;
+        }
+        assert(j == len);
+    }
+
+    return true;
+}
+
+
 int main(int argc, char **argv)
 {
     (void) argc, (void) argv;
-    return test_sequence() ? 0 : 1;
+    bool ret = true;
+
+    ret = ret && test_sequence();
+    ret = ret && test_stores();
+    ret = ret && test_shards();
+    ret = ret && test_union();
+
+    return ret ? 0 : 1;
 }
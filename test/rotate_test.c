@@ -5,6 +5,10 @@
 
 #include "test.h"
 
+#include <time.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+
 
 // -----------------------------------------------------------------------------
 // rotate
@@ -83,6 +87,440 @@ bool test_rotate(void)
 }
 
 
+// -----------------------------------------------------------------------------
+// threads
+// -----------------------------------------------------------------------------
+
+static struct rill_pairs *rotate_all(const char *dir, size_t threads)
+{
+    rm(dir);
+
+    enum { step = 3 * hour_secs, end = 2 * month_secs };
+    struct rill_rotate_opts opts = { .threads = threads };
+
+    struct rill_acc *acc = rill_acc_open(dir, 1);
+
+    // Rotating only once at the end forces every quant to be merged in a
+    // single rotation which is the catch-up case.
+    for (rill_ts_t ts = 0; ts < end; ts += step) {
+        rill_acc_ingest(acc, ts / day_secs + 1, ts + 1);
+        acc_dump(acc, dir, ts);
+    }
+    assert(rill_rotate_ex(dir, end, &opts));
+
+    rill_acc_close(acc);
+
+    struct rill_query *query = rill_query_open(dir);
+    struct rill_pairs *pairs = rill_query_all(query, rill_col_a);
+    rill_query_close(query);
+
+    rm(dir);
+    return pairs;
+}
+
+bool test_threads(void)
+{
+    struct rill_pairs *exp = rotate_all("test.rotate.serial.db", 0);
+    struct rill_pairs *pairs = rotate_all("test.rotate.threads.db", 4);
+
+    assert(exp->len == pairs->len);
+    for (size_t i = 0; i < exp->len; ++i)
+        assert(!rill_kv_cmp(&exp->data[i], &pairs->data[i]));
+
+    rill_pairs_free(exp);
+    rill_pairs_free(pairs);
+
+    return true;
+}
+
+
+// -----------------------------------------------------------------------------
+// compaction
+// -----------------------------------------------------------------------------
+
+static struct rill_pairs *compact(
+        const char *dir, struct rill_rotate_opts *opts, struct rill_rotate_stats *stats)
+{
+    rm(dir);
+
+    enum { step = 3 * hour_secs, end = month_secs + 2 * week_secs };
+    opts->stats = stats;
+
+    struct rill_acc *acc = rill_acc_open(dir, 1);
+    for (rill_ts_t ts = 0; ts < end; ts += step) {
+        rill_acc_ingest(acc, ts / day_secs + 1, ts + 1);
+        acc_dump(acc, dir, ts);
+    }
+    rill_acc_close(acc);
+
+    assert(rill_rotate_ex(dir, end, opts));
+
+    struct rill_stores *stores = rill_stores_open(dir);
+    assert(rill_stores_len(stores) == stats->stores);
+    rill_stores_close(stores);
+
+    size_t bytes_read = 0, bytes_written = 0;
+    for (size_t i = 0; i < rill_rotate_tiers; ++i) {
+        const struct rill_rotate_tier *tier = &stats->tiers[i];
+        assert(!tier->merges == !tier->bytes_written);
+        bytes_read += tier->bytes_read;
+        bytes_written += tier->bytes_written;
+    }
+    assert(bytes_read == stats->bytes_read);
+    assert(bytes_written == stats->bytes_written);
+
+    struct rill_query *query = rill_query_open(dir);
+    struct rill_pairs *pairs = rill_query_all(query, rill_col_a);
+    rill_query_close(query);
+
+    rm(dir);
+    return pairs;
+}
+
+static void check_pairs(struct rill_pairs *exp, struct rill_pairs *pairs)
+{
+    assert(exp->len == pairs->len);
+    for (size_t i = 0; i < exp->len; ++i)
+        assert(!rill_kv_cmp(&exp->data[i], &pairs->data[i]));
+    rill_pairs_free(pairs);
+}
+
+bool test_compaction(void)
+{
+    const char *dir = "test.rotate.compaction.db";
+
+    struct rill_rotate_stats time = {0};
+    struct rill_pairs *exp = compact(dir, &(struct rill_rotate_opts) {0}, &time);
+    // Stores are spaced out by more then an hour so they're not rewritten.
+    assert(!time.tiers[0].merges);
+    for (size_t i = 1; i < rill_rotate_tiers; ++i)
+        assert(time.tiers[i].merges);
+    assert(time.bytes_written);
+
+    {
+        // Every store is carried over to the month except for the current one.
+        struct rill_rotate_stats stats = {0};
+        struct rill_rotate_opts opts = {
+            .compaction = rill_compaction_skip_small,
+            .min_bytes = -1UL,
+        };
+        check_pairs(exp, compact(dir, &opts, &stats));
+
+        for (size_t i = 0; i < rill_rotate_tiers - 1; ++i)
+            assert(!stats.tiers[i].merges);
+        assert(stats.tiers[rill_rotate_tiers - 1].merges == 1);
+        assert(stats.bytes_written < time.bytes_written);
+        assert(stats.stores > time.stores);
+    }
+
+    {
+        struct rill_rotate_stats stats = {0};
+        struct rill_rotate_opts opts = { .compaction = rill_compaction_size };
+        check_pairs(exp, compact(dir, &opts, &stats));
+
+        assert(stats.tiers[rill_rotate_tiers - 1].merges == 1);
+        assert(stats.bytes_written);
+    }
+
+    rill_pairs_free(exp);
+    return true;
+}
+
+
+// -----------------------------------------------------------------------------
+// manifest
+// -----------------------------------------------------------------------------
+
+static size_t query_len(const char *dir)
+{
+    struct rill_query *query = rill_query_open(dir);
+    struct rill_pairs *pairs = rill_query_all(query, rill_col_a);
+    rill_query_close(query);
+
+    size_t len = pairs->len;
+    rill_pairs_free(pairs);
+    return len;
+}
+
+bool test_manifest(void)
+{
+    const char *dir = "test.rotate.manifest.db";
+    rm(dir);
+
+    enum { step = 5 * hour_secs, end = 3 * week_secs };
+
+    struct rill_acc *acc = rill_acc_open(dir, 1);
+    for (rill_ts_t ts = 0; ts < end; ts += step) {
+        rill_acc_ingest(acc, 1, ts + 1);
+        acc_dump(acc, dir, ts);
+    }
+
+    struct rill_manifest *manifest = NULL;
+    assert(rill_manifest_read(dir, &manifest) && !manifest);
+
+    assert(rill_rotate(dir, end));
+    assert(rill_manifest_read(dir, &manifest) && manifest);
+
+    struct rill_stores *stores = rill_stores_open(dir);
+    size_t len = rill_stores_len(stores);
+    assert(len == manifest->len);
+
+    size_t pairs = 0;
+    for (size_t i = 0; i < len; ++i) {
+        struct rill_store *store = rill_stores_get(stores, i);
+        const struct rill_manifest_entry *entry =
+            rill_manifest_find(manifest, strrchr(rill_store_file(store), '/') + 1);
+        assert(entry);
+        assert(entry->ts == rill_store_ts(store));
+        assert(entry->quant == rill_store_quant(store));
+        assert(entry->pairs == rill_store_pairs(store));
+        pairs += entry->pairs;
+    }
+    rill_stores_close(stores);
+    assert(pairs == query_len(dir));
+    rill_manifest_free(manifest);
+
+    {
+        struct rill_store *list[len];
+        assert(rill_scan_dir(dir, list, len) == len);
+        for (size_t i = 0; i < len; ++i) rill_store_close(list[i]);
+        assert(rill_scan_dir(dir, list, len - 1) == len - 1);
+        for (size_t i = 0; i + 1 < len; ++i) rill_store_close(list[i]);
+    }
+
+    // New stores are added to the manifest as they're written.
+    rill_acc_ingest(acc, 1, end + 1);
+    acc_dump(acc, dir, end);
+    assert(rill_manifest_read(dir, &manifest) && manifest);
+    assert(manifest->len == len + 1);
+    assert(query_len(dir) == pairs + 1);
+    rill_manifest_free(manifest);
+
+    // Rotating again only opens the stores it merges.
+    assert(rill_rotate(dir, end + week_secs));
+    assert(query_len(dir) == pairs + 1);
+
+    // A corrupted manifest is ignored in favour of the directory.
+    {
+        char file[PATH_MAX];
+        snprintf(file, sizeof(file), "%s/manifest", dir);
+
+        int fd = open(file, O_WRONLY);
+        assert(fd != -1);
+        uint64_t bad_len = -1UL / 2;
+        assert(pwrite(fd, &bad_len, sizeof(bad_len), 8) == sizeof(bad_len));
+        close(fd);
+
+        assert(!rill_manifest_read(dir, &manifest));
+        assert(query_len(dir) == pairs + 1);
+    }
+
+    // A manifest that can't be updated by a writer is removed.
+    rill_acc_ingest(acc, 1, end + week_secs + 1);
+    acc_dump(acc, dir, end + week_secs);
+    assert(rill_manifest_read(dir, &manifest) && !manifest);
+    assert(query_len(dir) == pairs + 2);
+
+    assert(rill_manifest_rm(dir));
+    assert(query_len(dir) == pairs + 2);
+
+    rill_acc_close(acc);
+    rm(dir);
+
+    return true;
+}
+
+static struct rill_pairs *query_removed(struct rill_query *query, size_t op)
+{
+    switch (op) {
+    case 0: return rill_query_key(query, 1, rill_pairs_new(1));
+    case 1: return rill_query_all(query, rill_col_a);
+    default: break;
+    }
+
+    struct rill_query_it *it = rill_query_begin(query, rill_col_a);
+    assert(it);
+
+    struct rill_pairs *pairs = rill_pairs_new(1);
+    struct rill_kv kv = {0};
+    while (rill_query_it_next(it, &kv) && !rill_kv_nil(&kv))
+        pairs = rill_pairs_push(pairs, kv.key, kv.val);
+
+    rill_query_it_free(it);
+    return pairs;
+}
+
+bool test_manifest_removed(void)
+{
+    const char *dir = "test.rotate.removed.db";
+    enum { step = 5 * hour_secs, end = 3 * week_secs };
+
+    // The stores are only opened on first access so a rotation that merges
+    // them in between removes stores from under the query which must then
+    // reload its set rather than miss their pairs.
+    for (size_t op = 0; op < 3; ++op) {
+        rm(dir);
+
+        struct rill_acc *acc = rill_acc_open(dir, 1);
+        for (rill_ts_t ts = 0; ts < end; ts += step) {
+            rill_acc_ingest(acc, 1, ts + 1);
+            acc_dump(acc, dir, ts);
+        }
+        rill_acc_close(acc);
+        assert(rill_rotate(dir, end));
+        size_t pairs = query_len(dir);
+
+        struct rill_query *query = rill_query_open(dir);
+        assert(query);
+        assert(rill_rotate(dir, end + month_secs));
+
+        struct rill_pairs *result = query_removed(query, op);
+        assert(result && result->len == pairs);
+        rill_pairs_free(result);
+        rill_query_close(query);
+    }
+
+    rm(dir);
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// key_ts
+// -----------------------------------------------------------------------------
+
+static size_t query_key_ts(const char *dir, rill_ts_t begin, rill_ts_t end)
+{
+    struct rill_query *query = rill_query_open(dir);
+    assert(query);
+
+    struct rill_pairs *pairs = rill_query_key_ts(query, 1, begin, end, rill_pairs_new(1));
+    assert(pairs);
+    rill_query_close(query);
+
+    size_t len = pairs->len;
+    rill_pairs_free(pairs);
+    return len;
+}
+
+bool test_key_ts(void)
+{
+    const char *dir = "test.rotate.key_ts.db";
+    rm(dir);
+
+    enum { step = day_secs, end = month_secs + week_secs };
+
+    struct rill_acc *acc = rill_acc_open(dir, 1);
+    for (rill_ts_t ts = 0; ts < end; ts += step) {
+        rill_acc_ingest(acc, 1, ts + 1);
+        acc_dump(acc, dir, ts);
+    }
+    rill_acc_close(acc);
+    assert(rill_rotate(dir, end));
+
+    struct rill_stores *stores = rill_stores_open(dir);
+    size_t month = rill_stores_len(stores);
+    for (size_t i = 0; i < rill_stores_len(stores); ++i)
+        if (rill_stores_entry(stores, i)->quant == month_secs) month = i;
+    assert(month < rill_stores_len(stores));
+    assert(rill_stores_entry(stores, month)->ts / month_secs == 0);
+    rill_stores_close(stores);
+
+    // The month store starts before the range but still overlaps it. Ranges
+    // are matched at the granularity of the stores.
+    size_t days = month_secs / day_secs, weeks = end / day_secs - days;
+    assert(query_key_ts(dir, month_secs / 2, month_secs) == days);
+    assert(query_key_ts(dir, month_secs - 1, month_secs + 1) == days + weeks);
+    assert(query_key_ts(dir, month_secs, end) == weeks);
+    assert(query_key_ts(dir, end, end + month_secs) == 0);
+
+    rm(dir);
+    return true;
+}
+
+
+// -----------------------------------------------------------------------------
+// trash
+// -----------------------------------------------------------------------------
+
+static size_t trash_len(const char *dir)
+{
+    char trash[PATH_MAX];
+    snprintf(trash, sizeof(trash), "%s/trash", dir);
+
+    DIR *handle = opendir(trash);
+    if (!handle) return 0;
+
+    size_t len = 0;
+    struct dirent *entry;
+    while ((entry = readdir(handle)))
+        if (entry->d_type == DT_REG) len++;
+
+    closedir(handle);
+    return len;
+}
+
+bool test_trash(void)
+{
+    const char *dir = "test.rotate.trash.db";
+    rm(dir);
+
+    enum { step = 5 * hour_secs, end = 3 * week_secs };
+
+    struct rill_acc *acc = rill_acc_open(dir, 1);
+    for (rill_ts_t ts = 0; ts < end; ts += step) {
+        rill_acc_ingest(acc, 1, ts + 1);
+        acc_dump(acc, dir, ts);
+    }
+    rill_acc_close(acc);
+
+    size_t pairs = query_len(dir);
+
+    // Hold on to one of the stores that's about to be merged.
+    struct rill_stores *stores = rill_stores_open(dir);
+    struct rill_store *held = rill_stores_take(stores, rill_stores_len(stores) - 1);
+    rill_stores_close(stores);
+
+    // Merges executed inline on the calling thread leave its priority as is.
+    int nice = getpriority(PRIO_PROCESS, 0);
+    struct rill_throttle *throttle =
+        rill_throttle_new(&(struct rill_throttle_opts) { .nice = 1 });
+
+    struct rill_rotate_opts rotate = { .trash = true, .throttle = throttle };
+    assert(rill_rotate_ex(dir, end, &rotate));
+    assert(getpriority(PRIO_PROCESS, 0) == nice);
+    assert(query_len(dir) == pairs);
+    rill_throttle_free(throttle);
+
+    size_t trashed = trash_len(dir);
+    assert(trashed);
+
+    struct rill_reclaim_stats stats = {0};
+    struct rill_reclaim_opts opts = { .chunk_bytes = page_len, .stats = &stats };
+    assert(rill_reclaim(dir, &opts));
+    assert(stats.files == trashed - 1);
+    assert(stats.busy == 1);
+    assert(stats.bytes);
+    assert(trash_len(dir) == 1);
+
+    // Still readable while it's held.
+    assert(rill_store_pairs(held));
+    rill_store_close(held);
+
+    struct rill_reclaimer *reclaimer = rill_reclaimer_start(dir, &opts);
+    assert(reclaimer);
+    while (trash_len(dir)) {
+        const struct timespec delay = { .tv_nsec = 10 * 1000 * 1000 };
+        nanosleep(&delay, NULL);
+    }
+    rill_reclaimer_stop(reclaimer);
+
+    assert(query_len(dir) == pairs);
+    rm(dir);
+
+    return true;
+}
+
+
 // -----------------------------------------------------------------------------
 // main
 // -----------------------------------------------------------------------------
@@ -92,6 +530,12 @@ int main(int argc, char **argv)
     (void) argc, (void) argv;
     bool ret = true;
 
+    ret = ret && test_threads();
+    ret = ret && test_compaction();
+    ret = ret && test_manifest();
+    ret = ret && test_manifest_removed();
+    ret = ret && test_trash();
+    ret = ret && test_key_ts();
     ret = ret && test_rotate();
 
     return ret ? 0 : 1;
@@ -5,6 +5,14 @@
 
 #include "test.h"
 
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
 
 // -----------------------------------------------------------------------------
 // utils
@@ -126,6 +134,15 @@ static void check_scan_keys(
         }
     }
 
+    assert(exp->len == result->len);
+    for (size_t i = 0; i < exp->len; ++i)
+        assert(!rill_kv_cmp(&exp->data[i], &result->data[i]));
+
+    // The keys are sorted so the batch lookup yields the same pairs.
+    rill_pairs_clear(result);
+    rill_store_page_in(store, rill_col_a, keys->data, keys->len);
+    result = rill_store_query_keys(store, keys->data, keys->len, result);
+
     assert(exp->len == result->len);
     for (size_t i = 0; i < exp->len; ++i)
         assert(!rill_kv_cmp(&exp->data[i], &result->data[i]));
@@ -181,6 +198,8 @@ bool test_scan_keys(void)
         struct rill_pairs *copy = duplicate_pairs(pairs);
         struct rill_store *store = make_store(name, pairs);
 
+        // Small batches probe the index while large ones scan the store.
+        check_scan_keys(store, copy, make_list(1, 3, 7, 300));
         for (size_t iterations = 0; iterations < 10; ++iterations)
             check_scan_keys(store, copy, make_rng_list(&rng, rng_range_key));
 
@@ -217,6 +236,16 @@ static void check_scan_vals(
 
     rill_pairs_compact(exp);
 
+    assert(exp->len == result->len);
+    for (size_t i = 0; i < exp->len; ++i)
+        assert(!rill_kv_cmp(&exp->data[i], &result->data[i]));
+
+    // Scans of large batches are only sorted by the compaction.
+    rill_pairs_clear(result);
+    rill_store_page_in(store, rill_col_b, vals->data, vals->len);
+    result = rill_store_query_values(store, vals->data, vals->len, result);
+    rill_pairs_compact(result);
+
     assert(exp->len == result->len);
     for (size_t i = 0; i < exp->len; ++i)
         assert(!rill_kv_cmp(&exp->data[i], &result->data[i]));
@@ -272,6 +301,7 @@ bool test_scan_vals(void)
         struct rill_pairs *copy = duplicate_pairs(pairs);
         struct rill_store *store = make_store(name, pairs);
 
+        check_scan_vals(store, copy, make_list(3, 70));
         for (size_t iterations = 0; iterations < 10; ++iterations)
             check_scan_vals(store, copy, make_rng_list(&rng, rng_range_val));
 
@@ -284,6 +314,509 @@ bool test_scan_vals(void)
 }
 
 
+// -----------------------------------------------------------------------------
+// col_a_only
+// -----------------------------------------------------------------------------
+
+static struct rill_store *make_store_col_a(
+        const char *name, struct rill_pairs *pairs)
+{
+    unlink(name);
+    assert(rill_store_write_ex(name, 0, 0, pairs, rill_store_col_a_only));
+
+    struct rill_store *store = rill_store_open(name);
+    assert(store);
+
+    return store;
+}
+
+static void check_query_vals_eq(struct rill_store *exp, struct rill_store *store)
+{
+    struct rill_pairs *lhs = rill_pairs_new(128);
+    struct rill_pairs *rhs = rill_pairs_new(128);
+
+    for (rill_val_t val = 1; val <= rng_range_val; ++val) {
+        rill_pairs_clear(lhs);
+        rill_pairs_clear(rhs);
+
+        lhs = rill_store_query_value(exp, val, lhs);
+        rhs = rill_store_query_value(store, val, rhs);
+
+        assert(lhs->len == rhs->len);
+        for (size_t i = 0; i < lhs->len; ++i)
+            assert(!rill_kv_cmp(&lhs->data[i], &rhs->data[i]));
+    }
+
+    // Stores without column b scan column a even for small batches.
+    const rill_val_t vals[] = { 3, 70 };
+    rill_pairs_clear(lhs);
+    rill_pairs_clear(rhs);
+
+    lhs = rill_store_query_values(exp, vals, 2, lhs);
+    rhs = rill_store_query_values(store, vals, 2, rhs);
+    rill_pairs_compact(lhs);
+    rill_pairs_compact(rhs);
+
+    assert(lhs->len == rhs->len);
+    for (size_t i = 0; i < lhs->len; ++i)
+        assert(!rill_kv_cmp(&lhs->data[i], &rhs->data[i]));
+
+    free(lhs);
+    free(rhs);
+}
+
+static void check_it_inverted(
+        struct rill_store *exp, struct rill_store *store, size_t pass_pairs)
+{
+    struct rill_store_it *lhs = rill_store_begin(exp, rill_col_b);
+    struct rill_store_it *rhs = rill_store_begin_inverted(store, pass_pairs);
+    assert(lhs && rhs);
+
+    struct rill_kv exp_kv = {0}, kv = {0};
+    do {
+        assert(rill_store_it_next(lhs, &exp_kv));
+        assert(rill_store_it_next(rhs, &kv));
+        assert(kv.key == exp_kv.key && kv.val == exp_kv.val);
+    } while (!rill_kv_nil(&exp_kv));
+
+    rill_store_it_free(lhs);
+    rill_store_it_free(rhs);
+}
+
+bool test_col_a_only(void)
+{
+    struct rng rng = rng_make(0);
+    struct rill_pairs *pairs_a = make_rng_pairs(&rng);
+    struct rill_pairs *pairs_b = make_rng_pairs(&rng);
+
+    struct rill_pairs *all = duplicate_pairs(pairs_a);
+    for (size_t i = 0; i < pairs_b->len; ++i)
+        all = rill_pairs_push(all, pairs_b->data[i].key, pairs_b->data[i].val);
+
+    struct rill_store *exp = make_store("test.store.col_a.exp", all);
+    struct rill_store *store_a = make_store_col_a("test.store.col_a.a", pairs_a);
+    struct rill_store *store_b = make_store_col_a("test.store.col_a.b", pairs_b);
+
+    assert(!rill_store_has_col(store_a, rill_col_b));
+    assert(!rill_store_begin(store_a, rill_col_b));
+
+    struct rill_store *list[] = { store_a, store_b };
+
+    {
+        const char *name = "test.store.col_a.merge_b";
+        unlink(name);
+        assert(rill_store_merge_ex(name, 0, 0, list, 2, 0));
+
+        struct rill_store *merged = rill_store_open(name);
+        assert(rill_store_has_col(merged, rill_col_b));
+        assert(rill_store_pairs(merged) == rill_store_pairs(exp));
+        check_query_vals_eq(exp, merged);
+
+        rill_store_close(merged);
+    }
+
+    {
+        const char *name = "test.store.col_a.merge_a";
+        unlink(name);
+        assert(rill_store_merge_ex(name, 0, 0, list, 2, rill_store_col_a_only));
+
+        struct rill_store *merged = rill_store_open(name);
+        assert(!rill_store_has_col(merged, rill_col_b));
+        assert(rill_store_pairs(merged) == rill_store_pairs(exp));
+        check_query_vals_eq(exp, merged);
+
+        // Small passes split the dictionary into many ranges.
+        check_it_inverted(exp, merged, 0);
+        check_it_inverted(exp, merged, 1);
+        check_it_inverted(exp, merged, 13);
+        check_it_inverted(exp, merged, rill_store_pairs(merged));
+
+        rill_store_close(merged);
+    }
+
+    rill_store_close(exp);
+    rill_store_close(store_a);
+    rill_store_close(store_b);
+    rill_pairs_free(pairs_a);
+    rill_pairs_free(pairs_b);
+    rill_pairs_free(all);
+
+    return true;
+}
+
+
+// -----------------------------------------------------------------------------
+// open_ex
+// -----------------------------------------------------------------------------
+
+static void check_keys_eq(
+        struct rill_store *exp, struct rill_store *store, enum rill_col col)
+{
+    size_t len = rill_store_keys_count(exp, col);
+    assert(rill_store_keys_count(store, col) == len);
+
+    rill_key_t *lhs = calloc(len, sizeof(*lhs));
+    rill_key_t *rhs = calloc(len, sizeof(*rhs));
+    assert(rill_store_keys(exp, lhs, len, col) == len);
+    assert(rill_store_keys(store, rhs, len, col) == len);
+    assert(!memcmp(lhs, rhs, len * sizeof(*lhs)));
+
+    free(lhs);
+    free(rhs);
+}
+
+bool test_open_ex(void)
+{
+    static const char *name = "test.store.open_ex";
+
+    struct rng rng = rng_make(0);
+    struct rill_pairs *pairs = make_rng_pairs(&rng);
+    struct rill_store *exp = make_store(name, pairs);
+
+    const struct rill_store_opts opts[] = {
+        { .populate_index = true },
+        { .huge_pages = true },
+        { .index_advice = rill_advice_random, .data_advice = rill_advice_sequential },
+        {
+            .index_advice = rill_advice_random,
+            .data_advice = rill_advice_random,
+            .populate_index = true,
+            .huge_pages = true,
+        },
+    };
+
+    for (size_t i = 0; i < sizeof(opts) / sizeof(opts[0]); ++i) {
+        struct rill_store *store = rill_store_open_ex(name, &opts[i]);
+        assert(store);
+        assert(rill_store_pairs(store) == rill_store_pairs(exp));
+
+        // Reads both indexes in full which are prefaulted by populate_index.
+        check_keys_eq(exp, store, rill_col_a);
+        check_keys_eq(exp, store, rill_col_b);
+        check_query_vals_eq(exp, store);
+        rill_store_close(store);
+    }
+
+    rill_store_close(exp);
+
+    // A file locked by rill_reclaim is being truncated and reported as removed.
+    int fd = open(name, O_RDONLY);
+    assert(fd != -1);
+    assert(!flock(fd, LOCK_EX | LOCK_NB));
+    assert(!rill_store_open(name));
+    assert(rill_errno.errno_ == ENOENT);
+    close(fd);
+
+    rill_pairs_free(pairs);
+    unlink(name);
+
+    return true;
+}
+
+
+// -----------------------------------------------------------------------------
+// throttle
+// -----------------------------------------------------------------------------
+
+static struct rill_store *merge_throttle(
+        const char *name, struct rill_store **list, size_t len,
+        struct rill_throttle *throttle)
+{
+    unlink(name);
+    assert(rill_store_merge_throttle(name, 0, 0, list, len, 0, throttle));
+
+    struct rill_store *store = rill_store_open(name);
+    assert(store);
+    return store;
+}
+
+static void *lower_pressure(void *data)
+{
+    const struct timespec delay = { .tv_nsec = 50 * 1000 * 1000 };
+    nanosleep(&delay, NULL);
+
+    rill_throttle_lower(data);
+    return NULL;
+}
+
+// Priorities can't be undone so they're applied on a throwaway thread.
+static void *apply_throttle(void *data)
+{
+    errno = 0;
+    int nice = getpriority(PRIO_PROCESS, syscall(SYS_gettid));
+    assert(!errno);
+
+    assert(rill_throttle_apply(data));
+    assert(getpriority(PRIO_PROCESS, syscall(SYS_gettid)) == nice + 1);
+    return NULL;
+}
+
+bool test_throttle(void)
+{
+    static const char *name = "test.store.throttle";
+
+    struct rng rng = rng_make(0);
+    struct rill_pairs *pairs[2] = { make_rng_pairs(&rng), make_rng_pairs(&rng) };
+    struct rill_store *list[2] = {
+        make_store("test.store.throttle.0", pairs[0]),
+        make_store("test.store.throttle.1", pairs[1]),
+    };
+
+    struct rill_store *exp = merge_throttle(name, list, 2, NULL);
+
+    {
+        // An empty bucket forces the merge to sleep for its bytes.
+        struct rill_throttle_opts opts = {
+            .bytes_per_sec = 1 << 20,
+            .burst_bytes = 1,
+            .nice = 1,
+            .ioprio = rill_ioprio_idle,
+        };
+        struct rill_throttle *throttle = rill_throttle_new(&opts);
+
+        pthread_t thread;
+        assert(!pthread_create(&thread, NULL, apply_throttle, throttle));
+        pthread_join(thread, NULL);
+
+        struct rill_store *store = merge_throttle(name, list, 2, throttle);
+        check_query_vals_eq(exp, store);
+        rill_store_close(store);
+
+        struct rill_throttle_stats stats = {0};
+        rill_throttle_stats(throttle, &stats);
+        assert(stats.bytes);
+        assert(stats.throttled_ns);
+        assert(!stats.paused_ns);
+
+        rill_throttle_free(throttle);
+    }
+
+    {
+        // Merges are paused until the pressure signal is lowered.
+        struct rill_throttle *throttle = rill_throttle_new(&(struct rill_throttle_opts) {0});
+        rill_throttle_raise(throttle);
+
+        pthread_t thread;
+        assert(!pthread_create(&thread, NULL, lower_pressure, throttle));
+
+        struct rill_store *store = merge_throttle(name, list, 2, throttle);
+        check_query_vals_eq(exp, store);
+        rill_store_close(store);
+        pthread_join(thread, NULL);
+
+        struct rill_throttle_stats stats = {0};
+        rill_throttle_stats(throttle, &stats);
+        assert(stats.paused_ns);
+        assert(!stats.throttled_ns);
+
+        rill_throttle_free(throttle);
+    }
+
+    rill_store_close(exp);
+    for (size_t i = 0; i < 2; ++i) {
+        rill_store_rm(list[i]);
+        rill_pairs_free(pairs[i]);
+    }
+    unlink(name);
+
+    return true;
+}
+
+
+// -----------------------------------------------------------------------------
+// merge
+// -----------------------------------------------------------------------------
+
+static void check_merge_col(
+        struct rill_store *store, enum rill_col col, const struct rill_pairs *exp)
+{
+    struct rill_store_it *it = rill_store_begin(store, col);
+    assert(it);
+
+    struct rill_kv kv = {0};
+    for (size_t i = 0; i < exp->len; ++i) {
+        assert(rill_store_it_next(it, &kv));
+        assert(!rill_kv_cmp(&kv, &exp->data[i]));
+    }
+
+    assert(rill_store_it_next(it, &kv));
+    assert(rill_kv_nil(&kv));
+
+    rill_store_it_free(it);
+}
+
+bool test_merge(void)
+{
+    enum { len = 3 };
+    static const char *name = "test.store.merge";
+    const char *names[len] = {
+        "test.store.merge.0", "test.store.merge.1", "test.store.merge.2" };
+
+    struct rng rng = rng_make(0);
+    struct rill_pairs *all = rill_pairs_new(1);
+
+    // The last two inputs are a duplicate of the first one and a missing one.
+    struct rill_store *list[len + 2];
+    for (size_t i = 0; i < len; ++i) {
+        struct rill_pairs *pairs = make_rng_pairs(&rng);
+        for (size_t j = 0; j < pairs->len; ++j)
+            all = rill_pairs_push(all, pairs->data[j].key, pairs->data[j].val);
+
+        list[i] = make_store(names[i], pairs);
+        rill_pairs_free(pairs);
+    }
+    list[len] = rill_store_open(names[0]);
+    list[len + 1] = NULL;
+
+    unlink(name);
+    assert(rill_store_merge(name, 0, 0, list, len + 2));
+
+    struct rill_store *store = rill_store_open(name);
+    assert(store);
+
+    rill_pairs_compact(all);
+    check_merge_col(store, rill_col_a, all);
+
+    rill_pairs_invert(all);
+    rill_pairs_compact(all);
+    check_merge_col(store, rill_col_b, all);
+
+    rill_store_close(store);
+    for (size_t i = 0; i <= len; ++i) rill_store_close(list[i]);
+    for (size_t i = 0; i < len; ++i) unlink(names[i]);
+    rill_pairs_free(all);
+    unlink(name);
+
+    return true;
+}
+
+
+// -----------------------------------------------------------------------------
+// it_batch
+// -----------------------------------------------------------------------------
+
+static void check_it_batch(struct rill_store *store, enum rill_col col, size_t cap)
+{
+    struct rill_store_it *exp = rill_store_begin(store, col);
+    struct rill_store_it *it = rill_store_begin(store, col);
+    assert(exp && it);
+
+    rill_key_t keys[cap];
+    rill_val_t vals[cap];
+
+    struct rill_kv kv = {0};
+    while (true) {
+        ssize_t len = rill_store_it_next_batch(it, keys, vals, cap);
+        assert(len >= 0 && (size_t) len <= cap);
+
+        for (ssize_t i = 0; i < len; ++i) {
+            assert(rill_store_it_next(exp, &kv));
+            assert(kv.key == keys[i] && kv.val == vals[i]);
+        }
+
+        if ((size_t) len < cap) break;
+    }
+
+    assert(rill_store_it_next(exp, &kv));
+    assert(rill_kv_nil(&kv));
+
+    rill_store_it_free(exp);
+    rill_store_it_free(it);
+}
+
+bool test_it_batch(void)
+{
+    static const char *name = "test.store.it_batch";
+
+    struct rng rng = rng_make(0);
+    struct rill_pairs *pairs = make_rng_pairs(&rng);
+    struct rill_store *store = make_store(name, pairs);
+
+    for (size_t cap = 1; cap < 20; ++cap) {
+        check_it_batch(store, rill_col_a, cap);
+        check_it_batch(store, rill_col_b, cap);
+    }
+    check_it_batch(store, rill_col_a, 2 * pairs->len);
+
+    rill_store_close(store);
+    rill_pairs_free(pairs);
+    unlink(name);
+
+    return true;
+}
+
+
+// -----------------------------------------------------------------------------
+// range
+// -----------------------------------------------------------------------------
+
+static void check_range(
+        struct rill_store *store, struct rill_pairs *pairs,
+        enum rill_col col, uint64_t lo, uint64_t hi)
+{
+    struct rill_pairs *exp = rill_pairs_new(128);
+    for (size_t i = 0; i < pairs->len; ++i) {
+        struct rill_kv *kv = &pairs->data[i];
+        if (col == rill_col_a && kv->key >= lo && kv->key < hi)
+            exp = rill_pairs_push(exp, kv->key, kv->val);
+        if (col == rill_col_b && kv->val >= lo && kv->val < hi)
+            exp = rill_pairs_push(exp, kv->val, kv->key);
+    }
+    rill_pairs_compact(exp);
+
+    struct rill_pairs *result = rill_pairs_new(1);
+    if (col == rill_col_a) result = rill_store_query_key_range(store, lo, hi, result);
+    else result = rill_store_query_value_range(store, lo, hi, result);
+    assert(result);
+
+    // Stores without column b are only sorted by the compaction.
+    if (col == rill_col_b) rill_pairs_compact(result);
+
+    assert(exp->len == result->len);
+    for (size_t i = 0; i < exp->len; ++i)
+        assert(!rill_kv_cmp(&exp->data[i], &result->data[i]));
+
+    free(exp);
+    free(result);
+}
+
+static void check_ranges(struct rill_store *store, struct rill_pairs *pairs)
+{
+    const uint64_t bounds[][2] = {
+        { 0, 1 }, { 1, 2 }, { 3, 3 }, { 7, 3 },
+        { 10, 20 }, { 1, 100 }, { 50, 1000 }, { 0, -1UL },
+    };
+
+    for (size_t i = 0; i < sizeof(bounds) / sizeof(bounds[0]); ++i) {
+        check_range(store, pairs, rill_col_a, bounds[i][0], bounds[i][1]);
+        check_range(store, pairs, rill_col_b, bounds[i][0], bounds[i][1]);
+    }
+}
+
+bool test_range(void)
+{
+    struct rng rng = rng_make(0);
+    struct rill_pairs *pairs = make_rng_pairs(&rng);
+    struct rill_pairs *pairs_a = duplicate_pairs(pairs);
+    struct rill_pairs *copy = duplicate_pairs(pairs);
+
+    // Writing a store clobbers its pairs.
+    struct rill_store *store = make_store("test.store.range", pairs);
+    struct rill_store *store_a = make_store_col_a("test.store.range.a", pairs_a);
+
+    check_ranges(store, copy);
+    check_ranges(store_a, copy);
+
+    rill_store_close(store);
+    rill_store_close(store_a);
+    rill_pairs_free(pairs);
+    rill_pairs_free(pairs_a);
+    rill_pairs_free(copy);
+
+    return true;
+}
+
+
 // -----------------------------------------------------------------------------
 // main
 // -----------------------------------------------------------------------------
@@ -296,6 +829,12 @@ int main(int argc, char **argv)
     ret = ret && test_query_key();
     ret = ret && test_scan_keys();
     ret = ret && test_scan_vals();
+    ret = ret && test_col_a_only();
+    ret = ret && test_open_ex();
+    ret = ret && test_throttle();
+    ret = ret && test_merge();
+    ret = ret && test_it_batch();
+    ret = ret && test_range();
 
     return ret ? 0 : 1;
 }
@@ -63,6 +63,33 @@ struct rill_pairs *make_rng_pairs(struct rng *rng)
 }
 
 
+// -----------------------------------------------------------------------------
+// query
+// -----------------------------------------------------------------------------
+
+// The iterator must yield the same pairs as rill_query_all.
+void check_query_it(struct rill_query *query, enum rill_col col)
+{
+    struct rill_pairs *exp = rill_query_all(query, col);
+    assert(exp);
+
+    struct rill_query_it *it = rill_query_begin(query, col);
+    assert(it);
+
+    struct rill_kv kv = {0};
+    for (size_t i = 0; i < exp->len; ++i) {
+        assert(rill_query_it_next(it, &kv));
+        assert(!rill_kv_cmp(&kv, &exp->data[i]));
+    }
+
+    assert(rill_query_it_next(it, &kv));
+    assert(rill_kv_nil(&kv));
+
+    rill_query_it_free(it);
+    rill_pairs_free(exp);
+}
+
+
 // -----------------------------------------------------------------------------
 // rm
 // -----------------------------------------------------------------------------
@@ -75,11 +102,12 @@ void rm(const char *path)
     struct dirent *entry;
     while (true) {
         if (!(entry = readdir(dir))) break;
-        else if (entry->d_type != DT_REG) continue;
 
         char file[PATH_MAX];
         snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
-        unlink(file);
+
+        if (entry->d_type == DT_REG) unlink(file);
+        else if (entry->d_type == DT_DIR && entry->d_name[0] != '.') rm(file);
     }
 
     closedir(dir);